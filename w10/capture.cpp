@@ -0,0 +1,221 @@
+#include "capture.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+const char CAPTURE_MAGIC[8] = {'N', 'E', 'T', 'C', 'A', 'P', '1', '\0'};
+const size_t CAPTURE_CHUNK_SIZE = 256 * 1024;
+// about 64 MB waiting for the disk, records beyond that are dropped and counted
+const size_t CAPTURE_MAX_PENDING_CHUNKS = 256;
+// partially filled chunks still reach the file this often
+const std::chrono::seconds CAPTURE_FLUSH_INTERVAL(1);
+
+static std::atomic<bool> enabled{false};
+static std::mutex mutex;
+static std::condition_variable wake;
+static std::thread writer;
+static bool stopping = false;
+static FILE *file = nullptr;
+static std::vector<uint8_t> current;
+static std::deque<std::vector<uint8_t>> full;
+static std::vector<std::vector<uint8_t>> spare;
+static std::chrono::steady_clock::time_point startTime;
+static uint64_t lastTimeUs = 0;
+static std::atomic<uint64_t> dropped{0};
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t v)
+{
+  while (v >= 0x80)
+  {
+    out.push_back(uint8_t(v) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(uint8_t(v));
+}
+
+static void writer_loop()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true)
+  {
+    wake.wait_for(lock, CAPTURE_FLUSH_INTERVAL, [] { return stopping || !full.empty(); });
+    if (full.empty() && !current.empty())
+    {
+      full.push_back(std::move(current));
+      current = std::vector<uint8_t>();
+    }
+    while (!full.empty())
+    {
+      std::vector<uint8_t> chunk = std::move(full.front());
+      full.pop_front();
+      lock.unlock();
+      fwrite(chunk.data(), 1, chunk.size(), file);
+      chunk.clear();
+      lock.lock();
+      spare.push_back(std::move(chunk));
+    }
+    // a server killed without capture_close keeps everything up to the last pass
+    lock.unlock();
+    fflush(file);
+    lock.lock();
+    if (stopping)
+      break;
+  }
+}
+
+bool capture_open(const char *path, const char *protocol_tag)
+{
+  if (enabled)
+    return false;
+  file = fopen(path, "wb");
+  if (!file)
+    return false;
+  char tag[8] = {};
+  strncpy(tag, protocol_tag, sizeof(tag));
+  fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), file);
+  fwrite(tag, 1, sizeof(tag), file);
+
+  startTime = std::chrono::steady_clock::now();
+  lastTimeUs = 0;
+  stopping = false;
+  current.reserve(CAPTURE_CHUNK_SIZE);
+  writer = std::thread(writer_loop);
+  enabled = true;
+  return true;
+}
+
+void capture_close()
+{
+  if (!enabled)
+    return;
+  enabled = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current.empty())
+    {
+      full.push_back(std::move(current));
+      current = std::vector<uint8_t>();
+    }
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+  fclose(file);
+  file = nullptr;
+}
+
+bool capture_enabled()
+{
+  return enabled.load(std::memory_order_relaxed);
+}
+
+void capture_record(CaptureKind kind, uint16_t peer, uint8_t channel, const uint8_t *data,
+                    size_t size)
+{
+  if (!capture_enabled())
+    return;
+  uint64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - startTime).count();
+  bool handOff = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (full.size() >= CAPTURE_MAX_PENDING_CHUNKS)
+    {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    // concurrent callers may take the lock out of time order, never go backwards
+    nowUs = std::max(nowUs, lastTimeUs);
+    put_varint(current, nowUs - lastTimeUs);
+    lastTimeUs = nowUs;
+    current.push_back(uint8_t(kind << 6 | (channel & 0x3f)));
+    current.push_back(uint8_t(peer));
+    current.push_back(uint8_t(peer >> 8));
+    put_varint(current, size);
+    current.insert(current.end(), data, data + size);
+    if (current.size() >= CAPTURE_CHUNK_SIZE)
+    {
+      full.push_back(std::move(current));
+      if (!spare.empty())
+      {
+        current = std::move(spare.back());
+        spare.pop_back();
+      }
+      else
+      {
+        current = std::vector<uint8_t>();
+        current.reserve(CAPTURE_CHUNK_SIZE);
+      }
+      handOff = true;
+    }
+  }
+  if (handOff)
+    wake.notify_one();
+}
+
+uint64_t capture_dropped()
+{
+  return dropped.load(std::memory_order_relaxed);
+}
+
+static bool get_varint(FILE *f, uint64_t &v)
+{
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int c = fgetc(f);
+    if (c == EOF)
+      return false;
+    v |= uint64_t(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool capture_reader_open(CaptureReader &reader, const char *path)
+{
+  reader.file = fopen(path, "rb");
+  if (!reader.file)
+    return false;
+  char magic[8];
+  if (fread(magic, 1, sizeof(magic), reader.file) != sizeof(magic) ||
+      memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+      fread(reader.protocol, 1, 8, reader.file) != 8)
+  {
+    capture_reader_close(reader);
+    return false;
+  }
+  reader.protocol[8] = '\0';
+  reader.timeUs = 0;
+  return true;
+}
+
+bool capture_read(CaptureReader &reader, CaptureRecord &record)
+{
+  uint64_t delta = 0;
+  uint64_t size = 0;
+  uint8_t head[3];
+  if (!get_varint(reader.file, delta) || fread(head, 1, sizeof(head), reader.file) != sizeof(head) ||
+      !get_varint(reader.file, size) || size > (1u << 30))
+    return false;
+  reader.timeUs += delta;
+  record.timeUs = reader.timeUs;
+  record.kind = CaptureKind(head[0] >> 6);
+  record.channel = head[0] & 0x3f;
+  record.peer = uint16_t(head[1] | head[2] << 8);
+  record.data.resize(size_t(size));
+  return fread(record.data.data(), 1, record.data.size(), reader.file) == record.data.size();
+}
+
+void capture_reader_close(CaptureReader &reader)
+{
+  if (reader.file)
+    fclose(reader.file);
+  reader.file = nullptr;
+}
@@ -0,0 +1,240 @@
+// Replays a traffic capture (w10_server --capture file) through alternative snapshot
+// encodings and reports payload bytes per client per second for each of them:
+//   captured  - what the server actually sent
+//   full      - eid and x, y, ori as floats per entity
+//   bitpacked - eid and the packed 32 bit word, a raw batch
+//   delta     - per entity difference from the previous update sent to that client,
+//               assumes every update arrived, so it is a lower bound
+//   entropy   - raw batch planes through rANS, tables trained on the first half of
+//               the capture
+// Captures of other protocols (w4) only get their in/out totals.
+//
+// build with the w10 sources it uses:
+//   capture_eval.cpp capture.cpp entropy.cpp metrics.cpp protocol.cpp + enet
+// usage: capture_eval <capture file>
+#include "capture.h"
+#include "entropy.h"
+#include "protocol.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+struct ClientStats
+{
+  uint16_t peer = 0;
+  uint64_t startUs = 0;
+  uint64_t endUs = 0;
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+
+  uint64_t captured = 0;
+  uint64_t full = 0;
+  uint64_t bitpacked = 0;
+  uint64_t delta = 0;
+  uint64_t entropy = 0;
+
+  EntropyTable tables[SNAPSHOT_BATCH_PLANES];
+  bool hasTables = false;
+  std::unordered_map<uint16_t, uint32_t> lastSent;
+};
+
+// one snapshot message sent to a client, entries sorted by eid
+typedef std::function<void(ClientStats &client, const std::vector<SnapshotEntry> &entries,
+                           size_t captured_bytes)> snapshot_handler_t;
+
+static size_t varint_size(uint32_t v)
+{
+  size_t size = 1;
+  for (; v >= 0x80; v >>= 7)
+    ++size;
+  return size;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+  return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+}
+
+static size_t delta_size(ClientStats &client, const std::vector<SnapshotEntry> &entries)
+{
+  // per entry: varint eid delta, tag byte, then nothing (unchanged), zigzag varint x/y
+  // code deltas and a byte of ori delta (same origin), or the whole word
+  size_t bytes = SNAPSHOT_BATCH_HEADER_SIZE;
+  const uint32_t originMask = (1u << SNAPSHOT_X_SHIFT) - 1;
+  uint16_t prevEid = 0;
+  for (const SnapshotEntry &entry : entries)
+  {
+    bytes += varint_size(uint16_t(entry.eid - prevEid)) + 1;
+    prevEid = entry.eid;
+    auto last = client.lastSent.find(entry.eid);
+    if (last == client.lastSent.end() || (last->second & originMask) != (entry.packed & originMask))
+      bytes += sizeof(uint32_t);
+    else if (last->second != entry.packed)
+    {
+      auto field = [](uint32_t packed, int shift, int bits) { return int32_t((packed >> shift) & ((1u << bits) - 1)); };
+      bytes += varint_size(zigzag(field(entry.packed, SNAPSHOT_X_SHIFT, SnapshotNearX::bits) -
+                                  field(last->second, SNAPSHOT_X_SHIFT, SnapshotNearX::bits)));
+      bytes += varint_size(zigzag(field(entry.packed, SNAPSHOT_Y_SHIFT, SnapshotNearY::bits) -
+                                  field(last->second, SNAPSHOT_Y_SHIFT, SnapshotNearY::bits)));
+      bytes += 1;
+    }
+    client.lastSent[entry.eid] = entry.packed;
+  }
+  return bytes;
+}
+
+// reads the whole capture, tracks clients and calls `on_snapshot` for every snapshot
+// message the server sent; false if the file can't be read
+static bool replay(const char *path, std::vector<ClientStats> &clients, std::string &protocol,
+                   const snapshot_handler_t &on_snapshot)
+{
+  CaptureReader reader;
+  if (!capture_reader_open(reader, path))
+    return false;
+  protocol = reader.protocol;
+  const bool snapshots = protocol == "w10";
+  clients.clear();
+  std::unordered_map<uint16_t, size_t> active; // peer -> index in clients
+  CaptureRecord record;
+  std::vector<SnapshotEntry> entries;
+  while (capture_read(reader, record))
+  {
+    auto it = active.find(record.peer);
+    if (record.kind == E_CAPTURE_CONNECT || it == active.end())
+    {
+      ClientStats client;
+      client.peer = record.peer;
+      client.startUs = record.timeUs;
+      clients.push_back(std::move(client));
+      it = active.insert_or_assign(record.peer, clients.size() - 1).first;
+    }
+    ClientStats &client = clients[it->second];
+    client.endUs = record.timeUs;
+    if (record.kind == E_CAPTURE_DISCONNECT)
+    {
+      active.erase(it);
+      continue;
+    }
+    if (record.kind == E_CAPTURE_IN)
+      client.bytesIn += record.data.size();
+    if (record.kind != E_CAPTURE_OUT)
+      continue;
+    client.bytesOut += record.data.size();
+    if (!snapshots || record.data.empty())
+      continue;
+
+    ENetPacket packet = {};
+    packet.data = record.data.data();
+    packet.dataLength = record.data.size();
+    switch (get_packet_type(&packet))
+    {
+    case E_SERVER_TO_CLIENT_ENTROPY_TABLES:
+      client.hasTables = deserialize_entropy_tables(&packet, client.tables);
+      break;
+    case E_SERVER_TO_CLIENT_SNAPSHOT:
+      entries.resize(1);
+      if (deserialize_snapshot(&packet, entries[0].eid, entries[0].packed))
+        on_snapshot(client, entries, packet.dataLength);
+      break;
+    case E_SERVER_TO_CLIENT_SNAPSHOT_BATCH:
+      if (deserialize_snapshot_batch(&packet, client.hasTables ? client.tables : nullptr, entries))
+        on_snapshot(client, entries, packet.dataLength);
+      break;
+    default:
+      break;
+    }
+  }
+  capture_reader_close(reader);
+  return true;
+}
+
+static void print_rates(const ClientStats &client, double seconds)
+{
+  const uint64_t columns[] = {client.bytesIn, client.bytesOut, client.captured, client.full,
+                              client.bitpacked, client.delta, client.entropy};
+  for (uint64_t bytes : columns)
+    printf(" %9.0f", seconds > 0.0 ? bytes / seconds : 0.0);
+  printf("\n");
+}
+
+int main(int argc, const char **argv)
+{
+  if (argc < 2)
+  {
+    printf("usage: capture_eval <capture file>\n");
+    return 1;
+  }
+  std::vector<ClientStats> clients;
+  std::string protocol;
+
+  // pass 1: capture length, pass 2: train tables on the first half, pass 3: evaluate
+  uint64_t endUs = 0;
+  if (!replay(argv[1], clients, protocol, [](ClientStats &, const std::vector<SnapshotEntry> &, size_t) {}))
+  {
+    printf("Cannot read capture %s\n", argv[1]);
+    return 1;
+  }
+  for (const ClientStats &client : clients)
+    endUs = std::max(endUs, client.endUs);
+
+  static uint32_t counts[SNAPSHOT_BATCH_PLANES][256];
+  static EntropyTable tables[SNAPSHOT_BATCH_PLANES];
+  std::vector<uint8_t> planes;
+  std::vector<uint8_t> coded;
+  uint64_t trainUs = 0;
+  replay(argv[1], clients, protocol,
+         [&](ClientStats &client, const std::vector<SnapshotEntry> &entries, size_t)
+  {
+    if (client.endUs > endUs / 2)
+      return;
+    trainUs = client.endUs;
+    planes.resize(entries.size() * SNAPSHOT_ENTRY_SIZE);
+    snapshot_batch_planes(entries.data(), entries.size(), planes.data());
+    entropy_count(planes.data(), entries.size(), SNAPSHOT_BATCH_PLANES, counts);
+  });
+  for (size_t p = 0; p < SNAPSHOT_BATCH_PLANES; ++p)
+    entropy_build_table(tables[p], counts[p]);
+
+  replay(argv[1], clients, protocol,
+         [&](ClientStats &client, const std::vector<SnapshotEntry> &entries, size_t captured_bytes)
+  {
+    const size_t count = entries.size();
+    client.captured += captured_bytes;
+    client.full += SNAPSHOT_BATCH_HEADER_SIZE + count * (sizeof(uint16_t) + sizeof(float) * 3);
+    client.bitpacked += SNAPSHOT_BATCH_HEADER_SIZE + count * SNAPSHOT_ENTRY_SIZE;
+    client.delta += delta_size(client, entries);
+    planes.resize(count * SNAPSHOT_ENTRY_SIZE);
+    snapshot_batch_planes(entries.data(), count, planes.data());
+    entropy_encode(planes.data(), count, SNAPSHOT_BATCH_PLANES, tables, coded);
+    client.entropy += SNAPSHOT_BATCH_HEADER_SIZE + std::min(coded.size(), planes.size());
+  });
+
+  printf("%s capture, %.1f s, %zu clients, payload bytes per second (no ENet headers)\n",
+         protocol.c_str(), endUs * 1e-6, clients.size());
+  if (protocol == "w10")
+    printf("entropy tables trained on the first %.1f s\n", trainUs * 1e-6);
+  printf("%6s %8s %9s %9s %9s %9s %9s %9s %9s\n", "peer", "seconds", "in", "out",
+         "captured", "full", "bitpacked", "delta", "entropy");
+  ClientStats total;
+  double totalSeconds = 0.0;
+  for (const ClientStats &client : clients)
+  {
+    double seconds = (client.endUs - client.startUs) * 1e-6;
+    printf("%6u %8.1f", client.peer, seconds);
+    print_rates(client, seconds);
+    totalSeconds += seconds;
+    total.bytesIn += client.bytesIn;
+    total.bytesOut += client.bytesOut;
+    total.captured += client.captured;
+    total.full += client.full;
+    total.bitpacked += client.bitpacked;
+    total.delta += client.delta;
+    total.entropy += client.entropy;
+  }
+  printf("%6s %8.1f", "avg", totalSeconds);
+  print_rates(total, totalSeconds);
+  return 0;
+}
@@ -0,0 +1,336 @@
+#include "client_net.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "protocol.h"
+#include "crc32c.h"
+#include "packet_handle.h"
+#include "spsc_queue.h"
+
+// a frame's worth of snapshot batches with room to spare, what doesn't fit waits on
+// the network thread until the render loop catches up
+const size_t CLIENT_EVENT_QUEUE_SIZE = 4096;
+
+static SpscQueue<ClientEvent, CLIENT_EVENT_QUEUE_SIZE> events;
+// events the queue had no room for, kept in order in front of any new ones
+static std::deque<ClientEvent> backlog;
+// thr and steer bits, one word so the pair is always read together
+static std::atomic<uint64_t> input{0};
+
+static ENetHost *client = nullptr;
+static ENetPeer *serverPeer = nullptr;
+static std::thread thread;
+static std::atomic<bool> running{false};
+static uint32_t inputRate = CLIENT_INPUT_RATE;
+
+// decoding state, network thread only
+static uint16_t controlledEid = invalid_entity;
+static InputHistory inputHistory;
+static SnapshotFrame snapshotFrame;
+static EntropyTable entropyTables[SNAPSHOT_BATCH_PLANES];
+static bool hasEntropyTables = false;
+
+static void emit(ClientEventType type, const Entity &entity)
+{
+  const ClientEvent event = {type, entity};
+  if (backlog.empty() && events.push(event))
+    return;
+  backlog.push_back(event);
+}
+
+static void flush_backlog()
+{
+  while (!backlog.empty() && events.push(backlog.front()))
+    backlog.pop_front();
+}
+
+static void emit_eid(ClientEventType type, uint16_t eid)
+{
+  Entity entity;
+  entity.eid = eid;
+  emit(type, entity);
+}
+
+static void on_new_entity_packet(const PacketHandle &packet)
+{
+  Entity newEntity;
+  if (!deserialize_new_entity(packet.get(), newEntity))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  emit(E_CLIENT_EVENT_NEW_ENTITY, newEntity);
+}
+
+static void on_set_controlled_entity(const PacketHandle &packet)
+{
+  uint16_t eid = invalid_entity;
+  if (!deserialize_set_controlled_entity(packet.get(), eid))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  controlledEid = eid;
+  emit_eid(E_CLIENT_EVENT_CONTROLLED_ENTITY, eid);
+}
+
+static void on_world(const PacketHandle &packet)
+{
+  WorldBounds bounds;
+  if (!deserialize_world(packet.get(), bounds))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  snapshotFrame.world.set(bounds);
+  snapshotFrame.hasWorld = true;
+}
+
+static void on_origin(const PacketHandle &packet)
+{
+  SnapshotOrigin origin;
+  if (!deserialize_origin(packet.get(), origin))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  snapshotFrame.origins[origin.epoch] = origin;
+  snapshotFrame.hasOrigin[origin.epoch] = true;
+  // the server moves to the next epoch next, what we hold there is from a few origins ago
+  snapshotFrame.hasOrigin[(origin.epoch + 1) % SNAPSHOT_ORIGIN_EPOCHS] = false;
+}
+
+static void emit_snapshot(uint16_t eid, uint32_t packed)
+{
+  Entity entity;
+  entity.eid = eid;
+  if (!unpack_snapshot(packed, snapshotFrame, entity.x, entity.y, entity.ori))
+    return;
+  emit(E_CLIENT_EVENT_SNAPSHOT, entity);
+}
+
+static void on_snapshot(const PacketHandle &packet)
+{
+  uint16_t eid = invalid_entity;
+  uint32_t packed = 0;
+  if (!deserialize_snapshot(packet.get(), eid, packed))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  emit_snapshot(eid, packed);
+}
+
+static void on_snapshot_batch(const PacketHandle &packet)
+{
+  static std::vector<SnapshotEntry> batch;
+  // coded batches that beat the tables here are lost, like any unsequenced packet
+  if (!deserialize_snapshot_batch(packet.get(), hasEntropyTables ? entropyTables : nullptr, batch))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  for (const SnapshotEntry &entry : batch)
+    emit_snapshot(entry.eid, entry.packed);
+}
+
+static void on_entropy_tables(const PacketHandle &packet)
+{
+  hasEntropyTables = deserialize_entropy_tables(packet.get(), entropyTables);
+  if (!hasEntropyTables)
+    count_rejected(packet.get());
+}
+
+static void on_despawn(const PacketHandle &packet)
+{
+  std::vector<uint16_t> eids;
+  if (!deserialize_despawn(packet.get(), eids))
+  {
+    count_rejected(packet.get());
+    return;
+  }
+  for (uint16_t eid : eids)
+  {
+    if (eid == controlledEid)
+      controlledEid = invalid_entity;
+    emit_eid(E_CLIENT_EVENT_DESPAWN, eid);
+  }
+}
+
+static void on_key(const PacketHandle &packet)
+{
+  if (!deserialize_and_set_key(packet.get()))
+    count_rejected(packet.get());
+}
+
+static void on_receive(const PacketHandle &packet)
+{
+  switch (get_packet_type(packet.get()))
+  {
+  case E_SERVER_TO_CLIENT_NEW_ENTITY:
+    on_new_entity_packet(packet);
+    break;
+  case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
+    on_set_controlled_entity(packet);
+    break;
+  case E_SERVER_TO_CLIENT_SNAPSHOT:
+    on_snapshot(packet);
+    break;
+  case E_SERVER_TO_CLIENT_KEY:
+    on_key(packet);
+    break;
+  case E_SERVER_TO_CLIENT_DESPAWN:
+    on_despawn(packet);
+    break;
+  case E_SERVER_TO_CLIENT_WORLD:
+    on_world(packet);
+    break;
+  case E_SERVER_TO_CLIENT_ORIGIN:
+    on_origin(packet);
+    break;
+  case E_SERVER_TO_CLIENT_SNAPSHOT_BATCH:
+    on_snapshot_batch(packet);
+    break;
+  case E_SERVER_TO_CLIENT_ENTROPY_TABLES:
+    on_entropy_tables(packet);
+    break;
+  default:
+    count_rejected(packet.get());
+    break;
+  };
+}
+
+static void on_event(const ENetEvent &event)
+{
+  switch (event.type)
+  {
+  case ENET_EVENT_TYPE_CONNECT:
+    printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
+    send_join(serverPeer);
+    break;
+  case ENET_EVENT_TYPE_RECEIVE:
+  {
+    // destroyed once the handlers are done with it
+    PacketHandle packet(event.packet);
+    on_receive(packet);
+    break;
+  }
+  default:
+    break;
+  };
+}
+
+static void send_input()
+{
+  if (controlledEid == invalid_entity)
+    return;
+  const uint64_t bits = input.load(std::memory_order_relaxed);
+  const uint32_t thrBits = uint32_t(bits);
+  const uint32_t steerBits = uint32_t(bits >> 32);
+  float thr, steer;
+  memcpy(&thr, &thrBits, sizeof(float));
+  memcpy(&steer, &steerBits, sizeof(float));
+  push_input(inputHistory, thr, steer);
+  send_entity_input(serverPeer, controlledEid, inputHistory);
+  // out now rather than on the next service call
+  enet_host_flush(client);
+}
+
+static void net_loop()
+{
+  typedef std::chrono::steady_clock clock;
+  const auto period = std::chrono::microseconds(1000000 / inputRate);
+  auto nextInput = clock::now();
+  auto lastReport = nextInput;
+  while (running.load(std::memory_order_relaxed))
+  {
+    flush_backlog();
+    auto now = clock::now();
+    if (packet_tracking() && now - lastReport >= std::chrono::seconds(1))
+    {
+      print_packet_stats("");
+      lastReport = now;
+    }
+    if (now >= nextInput)
+    {
+      send_input();
+      nextInput += period;
+      // a stalled thread doesn't make up for the ticks it missed with a burst
+      if (nextInput <= now)
+        nextInput = now + period;
+    }
+    // sleep in the socket until a packet arrives or it's time for the next input
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(nextInput - clock::now());
+    const enet_uint32 timeout = wait.count() > 0 ? enet_uint32((wait.count() + 999) / 1000) : 0;
+    ENetEvent event;
+    if (enet_host_service(client, &event, timeout) > 0)
+    {
+      on_event(event);
+      while (enet_host_service(client, &event, 0) > 0)
+        on_event(event);
+    }
+  }
+}
+
+bool client_net_start(const char *host, uint16_t port, uint32_t input_rate)
+{
+  if (running || !input_rate)
+    return false;
+  client = enet_host_create(nullptr, 1, 2, 0, 0);
+  if (!client)
+  {
+    printf("Cannot create ENet client\n");
+    return false;
+  }
+  // has to match the server's
+  client->checksum = checksum_crc32c;
+
+  ENetAddress address;
+  enet_address_set_host(&address, host);
+  address.port = port;
+  // the server's channel limit cuts this down to the layout it was configured with
+  serverPeer = enet_host_connect(client, &address, ENET_PROTOCOL_MAXIMUM_CHANNEL_COUNT, 0);
+  if (!serverPeer)
+  {
+    printf("Cannot connect to server");
+    enet_host_destroy(client);
+    client = nullptr;
+    return false;
+  }
+  inputRate = input_rate;
+  running = true;
+  thread = std::thread(net_loop);
+  return true;
+}
+
+void client_net_stop()
+{
+  if (!running)
+    return;
+  running = false;
+  thread.join();
+  enet_peer_disconnect_now(serverPeer, 0);
+  enet_host_destroy(client);
+  client = nullptr;
+  serverPeer = nullptr;
+  // everything should be freed by now, whatever is still live leaked
+  if (packet_tracking())
+    print_packet_stats("on exit: ");
+}
+
+bool client_net_poll(ClientEvent &event)
+{
+  return events.pop(event);
+}
+
+void client_net_set_input(float thr, float steer)
+{
+  uint32_t thrBits, steerBits;
+  memcpy(&thrBits, &thr, sizeof(float));
+  memcpy(&steerBits, &steer, sizeof(float));
+  input.store(uint64_t(thrBits) | (uint64_t(steerBits) << 32), std::memory_order_relaxed);
+}
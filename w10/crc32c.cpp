@@ -0,0 +1,117 @@
+#include "crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86 1
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define CRC32C_X86 0
+#endif
+
+// GCC and clang only emit SSE4.2 in functions that ask for it, MSVC always can
+#if CRC32C_X86 && !defined(_MSC_VER) && !defined(__SSE4_2__)
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#else
+#define CRC32C_TARGET
+#endif
+
+const uint32_t CRC32C_POLY = 0x82f63b78; // reflected 0x1edc6f41
+
+struct Crc32cTable
+{
+  uint32_t entries[256];
+
+  Crc32cTable()
+  {
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+      entries[i] = crc;
+    }
+  }
+};
+
+static uint32_t update_table(uint32_t crc, const uint8_t *data, size_t size)
+{
+  static const Crc32cTable table;
+  for (size_t i = 0; i < size; ++i)
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if CRC32C_X86
+static CRC32C_TARGET uint32_t update_sse42(uint32_t crc, const uint8_t *data, size_t size)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  uint64_t crc64 = crc;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), data += sizeof(uint64_t))
+  {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = uint32_t(crc64);
+#else
+  for (; size >= sizeof(uint32_t); size -= sizeof(uint32_t), data += sizeof(uint32_t))
+  {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+#endif
+  for (; size > 0; --size, ++data)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+
+static bool cpu_has_sse42()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#else
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+}
+#else
+static uint32_t update_sse42(uint32_t crc, const uint8_t *data, size_t size)
+{
+  return update_table(crc, data, size);
+}
+
+static bool cpu_has_sse42()
+{
+  return false;
+}
+#endif
+
+static const bool hasSse42 = cpu_has_sse42();
+
+bool crc32c_hardware()
+{
+  return hasSse42;
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size)
+{
+  const uint8_t *bytes = (const uint8_t*)data;
+  return ~(hasSse42 ? update_sse42(~crc, bytes, size) : update_table(~crc, bytes, size));
+}
+
+enet_uint32 checksum_crc32c(const ENetBuffer *buffers, size_t buffer_count)
+{
+  uint32_t crc = 0;
+  for (size_t i = 0; i < buffer_count; ++i)
+    crc = crc32c_update(crc, buffers[i].data, buffers[i].dataLength);
+  // same byte order as enet_crc32
+  return ENET_HOST_TO_NET_32(crc);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it, picked at
+// run time so the build doesn't need -msse4.2, and a table otherwise.
+//   crc = crc32c_update(crc, data, size) over any number of pieces, starting from 0
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size);
+bool crc32c_hardware();
+
+// ENetHost::checksum callback: both ends have to set it, ENet then adds the sum to every
+// datagram and silently drops the ones that don't match
+enet_uint32 checksum_crc32c(const ENetBuffer *buffers, size_t buffer_count);
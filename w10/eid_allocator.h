@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "entity.h"
+
+// eid = generation << EID_INDEX_BITS | index. Freed indices are recycled with the
+// next generation, so a stale eid (old snapshot, late input) never matches the new
+// owner of its index. Index EID_INDEX_MASK is never handed out: with generation 15
+// it would spell invalid_entity.
+constexpr uint16_t EID_INDEX_BITS = 12;
+constexpr uint16_t EID_INDEX_MASK = (1 << EID_INDEX_BITS) - 1;
+constexpr uint16_t EID_GENERATIONS = 1 << (16 - EID_INDEX_BITS);
+
+inline uint16_t eid_index(uint16_t eid) { return eid & EID_INDEX_MASK; }
+inline uint16_t eid_generation(uint16_t eid) { return eid >> EID_INDEX_BITS; }
+inline uint16_t make_eid(uint16_t index, uint16_t generation)
+{
+  return uint16_t((generation << EID_INDEX_BITS) | index);
+}
+
+class EidAllocator
+{
+public:
+  // O(1), invalid_entity once all EID_INDEX_MASK indices are alive
+  uint16_t allocate()
+  {
+    uint16_t index = 0;
+    if (!freeIndices.empty())
+    {
+      index = freeIndices.front();
+      freeIndices.pop_front();
+    }
+    else if (generations.size() < EID_INDEX_MASK)
+    {
+      index = uint16_t(generations.size());
+      generations.push_back(0);
+      alive.push_back(false);
+    }
+    else
+      return invalid_entity;
+    alive[index] = true;
+    return make_eid(index, generations[index]);
+  }
+
+  // O(1), stale or unknown eids are ignored
+  void free(uint16_t eid)
+  {
+    if (!is_alive(eid))
+      return;
+    uint16_t index = eid_index(eid);
+    alive[index] = false;
+    generations[index] = (generations[index] + 1) % EID_GENERATIONS;
+    // FIFO reuse keeps a freed index out of circulation as long as possible
+    freeIndices.push_back(index);
+  }
+
+  bool is_alive(uint16_t eid) const
+  {
+    uint16_t index = eid_index(eid);
+    return eid != invalid_entity && index < generations.size() && alive[index] &&
+           generations[index] == eid_generation(eid);
+  }
+
+  size_t alive_count() const { return generations.size() - freeIndices.size(); }
+
+private:
+  std::vector<uint8_t> generations;
+  std::vector<bool> alive;
+  std::deque<uint16_t> freeIndices;
+};
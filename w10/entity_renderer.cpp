@@ -0,0 +1,160 @@
+#include "entity_renderer.h"
+#include <cmath>
+#include <cstdio>
+#include "mathUtils.h"
+
+// capsule outline is two half circles of this many segments
+const int CAPSULE_CAP_SEGMENTS = 12;
+// same depth the debug draw capsules were at
+const float ENTITY_Z = -0.01f;
+// i_data0 = (x, y, cos(ori), sin(ori)), i_data1 = rgba
+const uint16_t INSTANCE_STRIDE = 2 * 4 * sizeof(float);
+
+struct CapsuleVertex
+{
+  float x, y, z;
+};
+
+static bgfx::VertexBufferHandle vertexBuffer = BGFX_INVALID_HANDLE;
+static bgfx::IndexBufferHandle indexBuffer = BGFX_INVALID_HANDLE;
+static bgfx::ProgramHandle program = BGFX_INVALID_HANDLE;
+
+static const char *shader_dir()
+{
+  switch (bgfx::getRendererType())
+  {
+  case bgfx::RendererType::Direct3D11:
+  case bgfx::RendererType::Direct3D12: return "dx11";
+  case bgfx::RendererType::Metal:      return "metal";
+  case bgfx::RendererType::OpenGLES:   return "essl";
+  case bgfx::RendererType::OpenGL:     return "glsl";
+  case bgfx::RendererType::Vulkan:     return "spirv";
+  default:                             return nullptr;
+  }
+}
+
+static bgfx::ShaderHandle load_shader(const char *name)
+{
+  bgfx::ShaderHandle handle = BGFX_INVALID_HANDLE;
+  const char *dir = shader_dir();
+  if (!dir)
+    return handle;
+  char path[256];
+  snprintf(path, sizeof(path), "shaders/%s/%s.bin", dir, name);
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    printf("Cannot open shader %s\n", path);
+    return handle;
+  }
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size > 0)
+  {
+    const bgfx::Memory *mem = bgfx::alloc(uint32_t(size) + 1);
+    if (fread(mem->data, 1, size_t(size), f) == size_t(size))
+    {
+      mem->data[size] = '\0';
+      handle = bgfx::createShader(mem);
+    }
+  }
+  fclose(f);
+  return handle;
+}
+
+bool renderer_init()
+{
+  if (!(bgfx::getCaps()->supported & BGFX_CAPS_INSTANCING))
+    return false;
+  bgfx::ShaderHandle vs = load_shader("vs_entity");
+  bgfx::ShaderHandle fs = load_shader("fs_entity");
+  if (!bgfx::isValid(vs) || !bgfx::isValid(fs))
+  {
+    if (bgfx::isValid(vs))
+      bgfx::destroy(vs);
+    if (bgfx::isValid(fs))
+      bgfx::destroy(fs);
+    return false;
+  }
+  program = bgfx::createProgram(vs, fs, true);
+  if (!bgfx::isValid(program))
+    return false;
+
+  // flat capsule around the origin along x, half length 1 and radius 1 like the debug
+  // draw one, as a fan from the centre
+  std::vector<CapsuleVertex> vertices;
+  vertices.push_back({0.f, 0.f, ENTITY_Z});
+  for (int cap = 0; cap < 2; ++cap)
+  {
+    const float cx = cap == 0 ? 1.f : -1.f;
+    for (int i = 0; i <= CAPSULE_CAP_SEGMENTS; ++i)
+    {
+      const float angle = PI * (float(i) / CAPSULE_CAP_SEGMENTS - 0.5f + cap);
+      vertices.push_back({cx + cosf(angle), sinf(angle), ENTITY_Z});
+    }
+  }
+  std::vector<uint16_t> indices;
+  const uint16_t rim = uint16_t(vertices.size() - 1);
+  for (uint16_t i = 0; i < rim; ++i)
+  {
+    indices.push_back(0);
+    indices.push_back(uint16_t(1 + i));
+    indices.push_back(uint16_t(1 + (i + 1) % rim));
+  }
+
+  bgfx::VertexLayout layout;
+  layout.begin()
+    .add(bgfx::Attrib::Position, 3, bgfx::AttribType::Float)
+    .end();
+  vertexBuffer = bgfx::createVertexBuffer(
+    bgfx::copy(vertices.data(), uint32_t(vertices.size() * sizeof(CapsuleVertex))), layout);
+  indexBuffer = bgfx::createIndexBuffer(
+    bgfx::copy(indices.data(), uint32_t(indices.size() * sizeof(uint16_t))));
+  return true;
+}
+
+void renderer_shutdown()
+{
+  if (bgfx::isValid(indexBuffer))
+    bgfx::destroy(indexBuffer);
+  if (bgfx::isValid(vertexBuffer))
+    bgfx::destroy(vertexBuffer);
+  if (bgfx::isValid(program))
+    bgfx::destroy(program);
+  indexBuffer = BGFX_INVALID_HANDLE;
+  vertexBuffer = BGFX_INVALID_HANDLE;
+  program = BGFX_INVALID_HANDLE;
+}
+
+size_t renderer_draw(bgfx::ViewId view, const std::vector<Entity> &entities)
+{
+  if (!bgfx::isValid(program) || entities.empty())
+    return 0;
+  const uint32_t count = bgfx::getAvailInstanceDataBuffer(uint32_t(entities.size()), INSTANCE_STRIDE);
+  if (!count)
+    return 0;
+  bgfx::InstanceDataBuffer idb;
+  bgfx::allocInstanceDataBuffer(&idb, count, INSTANCE_STRIDE);
+  float *data = (float*)idb.data;
+  for (uint32_t i = 0; i < count; ++i, data += INSTANCE_STRIDE / sizeof(float))
+  {
+    const Entity &e = entities[i];
+    data[0] = e.x;
+    data[1] = e.y;
+    data[2] = cosf(e.ori);
+    data[3] = sinf(e.ori);
+    // abgr, same as the debug draw colors
+    data[4] = float(e.color & 0xff) / 255.f;
+    data[5] = float((e.color >> 8) & 0xff) / 255.f;
+    data[6] = float((e.color >> 16) & 0xff) / 255.f;
+    data[7] = float((e.color >> 24) & 0xff) / 255.f;
+  }
+  bgfx::setVertexBuffer(0, vertexBuffer);
+  bgfx::setIndexBuffer(indexBuffer);
+  bgfx::setInstanceDataBuffer(&idb);
+  // the fan's winding flips with the view, don't cull
+  bgfx::setState(BGFX_STATE_DEFAULT & ~BGFX_STATE_CULL_MASK);
+  bgfx::submit(view, program);
+  return count;
+}
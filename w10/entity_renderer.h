@@ -0,0 +1,18 @@
+#pragma once
+#include <bgfx/bgfx.h>
+#include <cstddef>
+#include <vector>
+#include "entity.h"
+
+// Draws every entity as one instanced capsule mesh, a single submit for the whole list
+// instead of a debug draw capsule each. Needs BGFX_CAPS_INSTANCING and the compiled
+// shaders in shaders/<renderer>/, built from shaders/*.sc with bgfx's shaderc:
+//   shaderc -f vs_entity.sc -o glsl/vs_entity.bin --type vertex --platform linux -p 120 -i <bgfx>/src
+//   shaderc -f fs_entity.sc -o glsl/fs_entity.bin --type fragment --platform linux -p 120 -i <bgfx>/src
+// (-p s_5_0 and dx11/ for Direct3D, -p spirv and spirv/ for Vulkan, -p metal and metal/)
+bool renderer_init(); // false - not supported here, draw the entities some other way
+void renderer_shutdown();
+
+// Returns how many entities from the front of the list were drawn, the rest didn't fit
+// in this frame's instance buffer (or everything, 0, if renderer_init failed)
+size_t renderer_draw(bgfx::ViewId view, const std::vector<Entity> &entities);
@@ -0,0 +1,119 @@
+#include "entropy.h"
+#include <algorithm>
+
+// rANS state is kept in [RANS_L, RANS_L << 8), renormalized a byte at a time
+const uint32_t RANS_L = 1u << 23;
+
+void entropy_count(const uint8_t *planes, size_t plane_size, size_t plane_count,
+                   uint32_t (*counts)[256])
+{
+  for (size_t p = 0; p < plane_count; ++p)
+    for (size_t i = 0; i < plane_size; ++i)
+      ++counts[p][planes[p * plane_size + i]];
+}
+
+void entropy_build_table(EntropyTable &table, const uint32_t counts[256])
+{
+  uint64_t total = 0;
+  for (int s = 0; s < 256; ++s)
+    total += counts[s];
+
+  uint32_t sum = 0;
+  for (int s = 0; s < 256; ++s)
+  {
+    uint64_t scaled = total ? uint64_t(counts[s]) * ENTROPY_PROB_SCALE / total : 0;
+    table.freq[s] = uint16_t(std::max<uint64_t>(scaled, 1));
+    sum += table.freq[s];
+  }
+  // rounding and the minimum of 1 leave the sum off by a little, settle it on the
+  // most frequent symbols where it costs the least
+  while (sum != ENTROPY_PROB_SCALE)
+  {
+    uint16_t *largest = std::max_element(table.freq, table.freq + 256);
+    if (sum > ENTROPY_PROB_SCALE)
+    {
+      uint32_t take = std::min<uint32_t>(sum - ENTROPY_PROB_SCALE, *largest - 1u);
+      *largest -= uint16_t(take);
+      sum -= take;
+    }
+    else
+    {
+      *largest += uint16_t(ENTROPY_PROB_SCALE - sum);
+      sum = ENTROPY_PROB_SCALE;
+    }
+  }
+  entropy_finish_table(table);
+}
+
+bool entropy_finish_table(EntropyTable &table)
+{
+  uint32_t cum = 0;
+  for (int s = 0; s < 256; ++s)
+  {
+    if (table.freq[s] == 0 || cum + table.freq[s] > ENTROPY_PROB_SCALE)
+      return false;
+    table.cumFreq[s] = uint16_t(cum);
+    std::fill_n(table.slotSymbol + cum, table.freq[s], uint8_t(s));
+    cum += table.freq[s];
+  }
+  table.cumFreq[256] = uint16_t(cum);
+  return cum == ENTROPY_PROB_SCALE;
+}
+
+void entropy_encode(const uint8_t *planes, size_t plane_size, size_t plane_count,
+                    const EntropyTable *tables, std::vector<uint8_t> &out)
+{
+  // rANS is last in first out: encode backwards, the decoder then reads forwards
+  thread_local std::vector<uint8_t> reversed;
+  reversed.clear();
+  uint32_t x = RANS_L;
+  for (size_t p = plane_count; p-- > 0;)
+  {
+    const EntropyTable &table = tables[p];
+    const uint8_t *plane = planes + p * plane_size;
+    for (size_t i = plane_size; i-- > 0;)
+    {
+      const uint32_t freq = table.freq[plane[i]];
+      const uint32_t xMax = ((RANS_L >> ENTROPY_PROB_BITS) << 8) * freq;
+      while (x >= xMax)
+      {
+        reversed.push_back(uint8_t(x));
+        x >>= 8;
+      }
+      x = ((x / freq) << ENTROPY_PROB_BITS) + (x % freq) + table.cumFreq[plane[i]];
+    }
+  }
+  for (int i = 0; i < 4; ++i, x >>= 8)
+    reversed.push_back(uint8_t(x));
+  out.assign(reversed.rbegin(), reversed.rend());
+}
+
+bool entropy_decode(const uint8_t *in, size_t in_size, size_t plane_size, size_t plane_count,
+                    const EntropyTable *tables, uint8_t *planes)
+{
+  if (in_size < 4)
+    return false;
+  const uint8_t *end = in + in_size;
+  uint32_t x = uint32_t(in[0]) << 24 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 8 | in[3];
+  in += 4;
+  for (size_t p = 0; p < plane_count; ++p)
+  {
+    const EntropyTable &table = tables[p];
+    uint8_t *plane = planes + p * plane_size;
+    for (size_t i = 0; i < plane_size; ++i)
+    {
+      const uint32_t slot = x & (ENTROPY_PROB_SCALE - 1);
+      const uint8_t s = table.slotSymbol[slot];
+      plane[i] = s;
+      x = table.freq[s] * (x >> ENTROPY_PROB_BITS) + slot - table.cumFreq[s];
+      while (x < RANS_L)
+      {
+        if (in == end)
+          return false;
+        x = (x << 8) | *in++;
+      }
+    }
+  }
+  // the encoder started from RANS_L, anything else means the stream was damaged
+  return x == RANS_L && in == end;
+}
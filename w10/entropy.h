@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Static rANS over bytes. Input is a set of byte planes of the same size, every plane
+// is coded with its own frequency table. Tables are trained once from symbol counts
+// and never change, the decoder has to be given the same ones.
+const uint32_t ENTROPY_PROB_BITS = 12;
+const uint32_t ENTROPY_PROB_SCALE = 1 << ENTROPY_PROB_BITS;
+
+struct EntropyTable
+{
+  uint16_t freq[256];
+  uint16_t cumFreq[257];
+  uint8_t slotSymbol[ENTROPY_PROB_SCALE]; // cumulative frequency slot -> symbol
+};
+
+// adds the symbols of every plane to counts[plane]
+void entropy_count(const uint8_t *planes, size_t plane_size, size_t plane_count,
+                   uint32_t (*counts)[256]);
+// scales counts to ENTROPY_PROB_SCALE, unseen symbols keep a frequency of 1 so any
+// input can still be coded
+void entropy_build_table(EntropyTable &table, const uint32_t counts[256]);
+// fills cumFreq and slotSymbol from freq, which is all that goes over the wire;
+// false if freq doesn't add up to ENTROPY_PROB_SCALE
+bool entropy_finish_table(EntropyTable &table);
+
+void entropy_encode(const uint8_t *planes, size_t plane_size, size_t plane_count,
+                    const EntropyTable *tables, std::vector<uint8_t> &out);
+// false on truncated or corrupt input
+bool entropy_decode(const uint8_t *in, size_t in_size, size_t plane_size, size_t plane_count,
+                    const EntropyTable *tables, uint8_t *planes);
@@ -0,0 +1,148 @@
+// Compression ratio and speed of the snapshot batch entropy stage. Runs the server's
+// snapshot pipeline (simulate, quantize, per peer select and pack) without a network,
+// records the raw batch planes, trains tables on the first half like the server does
+// and codes the second half with them.
+//
+// build with the w10 sources it uses:
+//   entropy_bench.cpp entropy.cpp protocol.cpp capture.cpp metrics.cpp entity.cpp send_scheduler.cpp
+//   + enet
+// usage: entropy_bench [entity count] [peer count] [ticks]
+#include "entity.h"
+#include "entropy.h"
+#include "protocol.h"
+#include "send_scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+struct RecordedBatch
+{
+  size_t count;
+  std::vector<uint8_t> planes;
+};
+
+int main(int argc, const char **argv)
+{
+  const size_t entityCount = argc > 1 ? size_t(atoi(argv[1])) : 1000;
+  const size_t peerCount = argc > 2 ? size_t(atoi(argv[2])) : 16;
+  const size_t ticks = argc > 3 ? size_t(atoi(argv[3])) : 2000;
+  const float dt = 0.01f;
+  const float tokensPerTick = 1200.f;
+
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<float> unit(-1.f, 1.f);
+  WorldBounds bounds = {-256.f, -128.f, 256.f, 128.f};
+  SnapshotWorld world;
+  world.set(bounds);
+
+  std::vector<Entity> entities(entityCount);
+  for (size_t i = 0; i < entityCount; ++i)
+  {
+    entities[i].eid = uint16_t(i);
+    entities[i].x = unit(gen) * bounds.maxX;
+    entities[i].y = unit(gen) * bounds.maxY;
+    entities[i].ori = unit(gen) * PI;
+  }
+  std::vector<PeerSendState> peers(peerCount);
+  std::vector<SnapshotOrigin> origins(peerCount);
+  for (size_t p = 0; p < peerCount; ++p)
+  {
+    scheduler_reset(peers[p]);
+    origins[p].x = entities[p].x;
+    origins[p].y = entities[p].y;
+  }
+
+  SnapshotCodes codes;
+  codes.farX.resize(entityCount);
+  codes.farY.resize(entityCount);
+  codes.ori.resize(entityCount);
+  std::vector<RecordedBatch> recorded;
+  std::vector<size_t> selected;
+  std::vector<SnapshotEntry> batch;
+  for (size_t tick = 0; tick < ticks; ++tick)
+  {
+    for (Entity &e : entities)
+    {
+      // inputs held for a while like a player would
+      if (gen() % 50 == 0)
+      {
+        e.thr = unit(gen) > -0.5f ? 1.f : 0.f;
+        e.steer = float(int(gen() % 3) - 1);
+      }
+      simulate_entity(e, dt);
+      e.x = clamp(e.x, bounds.minX, bounds.maxX);
+      e.y = clamp(e.y, bounds.minY, bounds.maxY);
+    }
+    quantize_snapshots(entities, 0, entityCount, world, codes);
+    for (size_t p = 0; p < peerCount; ++p)
+    {
+      const Entity &own = entities[p];
+      if (fabsf(own.x - origins[p].x) > SnapshotNearX::hi * 0.5f ||
+          fabsf(own.y - origins[p].y) > SnapshotNearY::hi * 0.5f)
+      {
+        origins[p].x = own.x;
+        origins[p].y = own.y;
+        origins[p].epoch = (origins[p].epoch + 1) % SNAPSHOT_ORIGIN_EPOCHS;
+      }
+      peers[p].tokens = tokensPerTick;
+      scheduler_select(peers[p], entities, own.eid, SNAPSHOT_ENTRY_SIZE,
+                       SNAPSHOT_BATCH_HEADER_SIZE, SNAPSHOT_BATCH_MAX_ENTRIES, selected);
+      batch.clear();
+      for (size_t idx : selected)
+        batch.push_back({entities[idx].eid,
+                         pack_snapshot(codes, idx, entities[idx].x, entities[idx].y, &origins[p])});
+      std::sort(batch.begin(), batch.end(),
+                [](const SnapshotEntry &a, const SnapshotEntry &b) { return a.eid < b.eid; });
+      RecordedBatch rec;
+      rec.count = batch.size();
+      rec.planes.resize(batch.size() * SNAPSHOT_ENTRY_SIZE);
+      snapshot_batch_planes(batch.data(), batch.size(), rec.planes.data());
+      recorded.push_back(std::move(rec));
+    }
+  }
+
+  const size_t trainEnd = recorded.size() / 2;
+  static uint32_t counts[SNAPSHOT_BATCH_PLANES][256];
+  for (size_t i = 0; i < trainEnd; ++i)
+    entropy_count(recorded[i].planes.data(), recorded[i].count, SNAPSHOT_BATCH_PLANES, counts);
+  static EntropyTable tables[SNAPSHOT_BATCH_PLANES];
+  for (size_t p = 0; p < SNAPSHOT_BATCH_PLANES; ++p)
+    entropy_build_table(tables[p], counts[p]);
+
+  std::vector<std::vector<uint8_t>> coded(recorded.size());
+  size_t rawBytes = 0;
+  size_t codedBytes = 0;
+  auto encodeStart = std::chrono::steady_clock::now();
+  for (size_t i = trainEnd; i < recorded.size(); ++i)
+    entropy_encode(recorded[i].planes.data(), recorded[i].count, SNAPSHOT_BATCH_PLANES, tables,
+                   coded[i]);
+  auto encodeEnd = std::chrono::steady_clock::now();
+
+  std::vector<uint8_t> decoded;
+  size_t mismatches = 0;
+  double decodeNs = 0.0;
+  for (size_t i = trainEnd; i < recorded.size(); ++i)
+  {
+    decoded.resize(recorded[i].planes.size());
+    auto start = std::chrono::steady_clock::now();
+    bool ok = entropy_decode(coded[i].data(), coded[i].size(), recorded[i].count,
+                             SNAPSHOT_BATCH_PLANES, tables, decoded.data());
+    decodeNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (!ok || decoded != recorded[i].planes)
+      ++mismatches;
+    rawBytes += recorded[i].planes.size();
+    codedBytes += coded[i].size();
+  }
+  double encodeNs = std::chrono::duration<double, std::nano>(encodeEnd - encodeStart).count();
+
+  printf("%zu entities, %zu peers, %zu batches coded (%zu trained on)\n",
+         entityCount, peerCount, recorded.size() - trainEnd, trainEnd);
+  printf("raw %zu B, coded %zu B, ratio %.3f (%.2f bits per entry)\n", rawBytes, codedBytes,
+         double(codedBytes) / rawBytes, 8.0 * codedBytes / (rawBytes / SNAPSHOT_ENTRY_SIZE));
+  printf("encode %.2f ns/B, decode %.2f ns/B (raw bytes), %zu mismatches\n",
+         encodeNs / rawBytes, decodeNs / rawBytes, mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,452 @@
+// Link conditioner: a UDP proxy between clients and a server that delays, drops,
+// duplicates, reorders, corrupts and rate limits datagrams, separately for each
+// direction and each client. It works below ENet, so any week's client and server can
+// be run through it on one box.
+//
+// Every client address gets its own socket towards the server, so the server still sees
+// one peer per client. Datagrams wait in a queue ordered by delivery time:
+//   latency +- jitter   jitter alone never reorders, like a single path
+//   reorder %           the datagram is held back a bit more and later ones overtake it
+//   rate kbit/s         per client serialization delay, datagrams that would wait longer
+//                       than `queue` ms are dropped like a full router buffer
+//   loss %, dup %, corrupt % (one random byte)
+//
+// build: link_conditioner.cpp + enet
+// usage: link_conditioner <listen port> <server host:port> [options]
+//   --profile lan|dsl|wifi|mobile|bad   starting point, the options below override it
+//   --latency ms --jitter ms --loss % --dup % --reorder % --corrupt % --rate kbit/s --queue ms
+//   prefix an option with up- (client to server) or down- to set one direction only
+//   --seed n   repeatable runs
+// then point the client at it, e.g. w10 --server 127.0.0.1:<listen port>
+#include <enet/enet.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum LinkDirection
+{
+  E_LINK_UP = 0, // client to server
+  E_LINK_DOWN,
+  E_LINK_DIRECTIONS
+};
+
+struct LinkConditions
+{
+  float latencyMs = 0.f;
+  float jitterMs = 0.f;
+  float lossPct = 0.f;
+  float dupPct = 0.f;
+  float reorderPct = 0.f;
+  float corruptPct = 0.f;
+  float rateKbps = 0.f; // 0 - unlimited
+  float queueMs = 200.f;
+};
+
+struct LinkProfile
+{
+  const char *name;
+  LinkConditions up;
+  LinkConditions down;
+};
+
+// one way figures, round trips are twice the latency
+static const LinkProfile PROFILES[] = {
+  {"lan", {1.f, 0.5f}, {1.f, 0.5f}},
+  {"dsl", {15.f, 3.f, 0.2f, 0.f, 0.f, 0.f, 1000.f}, {15.f, 3.f, 0.2f, 0.f, 0.f, 0.f, 8000.f}},
+  {"wifi", {5.f, 8.f, 1.f, 0.f, 0.5f}, {5.f, 8.f, 1.f, 0.f, 0.5f}},
+  {"mobile", {40.f, 20.f, 2.f, 0.2f, 1.f, 0.f, 500.f}, {40.f, 20.f, 2.f, 0.2f, 1.f, 0.f, 2000.f}},
+  {"bad", {100.f, 50.f, 10.f, 1.f, 5.f, 0.1f, 256.f}, {100.f, 50.f, 10.f, 1.f, 5.f, 0.1f, 256.f}},
+};
+
+struct LinkOption
+{
+  const char *name;
+  float LinkConditions::*field;
+};
+
+static const LinkOption OPTIONS[] = {
+  {"latency", &LinkConditions::latencyMs},
+  {"jitter", &LinkConditions::jitterMs},
+  {"loss", &LinkConditions::lossPct},
+  {"dup", &LinkConditions::dupPct},
+  {"reorder", &LinkConditions::reorderPct},
+  {"corrupt", &LinkConditions::corruptPct},
+  {"rate", &LinkConditions::rateKbps},
+  {"queue", &LinkConditions::queueMs},
+};
+
+// a client's side of the proxy
+struct Flow
+{
+  ENetAddress client;
+  ENetSocket upstream = ENET_SOCKET_NULL;
+  uint64_t lastActiveUs = 0;
+  // per direction: when the rate limited link is next free, latest in order delivery
+  uint64_t linkFreeUs[E_LINK_DIRECTIONS] = {};
+  uint64_t lastDeliverUs[E_LINK_DIRECTIONS] = {};
+};
+
+struct Datagram
+{
+  uint64_t deliverUs;
+  uint64_t seq; // keeps equal delivery times in arrival order
+  LinkDirection direction;
+  uint64_t flow;
+  std::vector<uint8_t> data;
+
+  bool operator>(const Datagram &other) const
+  {
+    return deliverUs != other.deliverUs ? deliverUs > other.deliverUs : seq > other.seq;
+  }
+};
+
+struct LinkStats
+{
+  uint32_t received = 0;
+  uint32_t delivered = 0;
+  uint32_t lost = 0;
+  uint32_t duplicated = 0;
+  uint32_t reordered = 0;
+  uint32_t corrupted = 0;
+  uint32_t overflowed = 0;
+  uint64_t bytes = 0;
+};
+
+// a client that stayed quiet this long has gone, ENet gives up on a peer after 30 s
+const uint64_t FLOW_TIMEOUT_US = 60ull * 1000 * 1000;
+const uint32_t MAX_WAIT_MS = 100;
+
+static LinkConditions conditions[E_LINK_DIRECTIONS];
+static LinkStats stats[E_LINK_DIRECTIONS];
+static std::unordered_map<uint64_t, Flow> flows; // by client host << 16 | port
+static std::priority_queue<Datagram, std::vector<Datagram>, std::greater<Datagram>> pending;
+static uint64_t nextSeq = 0;
+static std::mt19937 gen;
+
+static uint64_t now_us()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+}
+
+static uint64_t address_key(const ENetAddress &address)
+{
+  return uint64_t(address.host) << 16 | address.port;
+}
+
+static bool chance(float pct)
+{
+  return pct > 0.f && std::uniform_real_distribution<float>(0.f, 100.f)(gen) < pct;
+}
+
+static void enqueue(LinkDirection direction, uint64_t flow_key, Flow &flow, const uint8_t *data,
+                    size_t size, uint64_t now)
+{
+  const LinkConditions &link = conditions[direction];
+  LinkStats &stat = stats[direction];
+  ++stat.received;
+  if (chance(link.lossPct))
+  {
+    ++stat.lost;
+    return;
+  }
+  const int copies = chance(link.dupPct) ? 2 : 1;
+  stat.duplicated += copies - 1;
+  for (int copy = 0; copy < copies; ++copy)
+  {
+    Datagram datagram;
+    datagram.seq = nextSeq++;
+    datagram.direction = direction;
+    datagram.flow = flow_key;
+    datagram.data.assign(data, data + size);
+    if (size && chance(link.corruptPct))
+    {
+      datagram.data[gen() % size] ^= uint8_t(1 + gen() % 255);
+      ++stat.corrupted;
+    }
+
+    uint64_t departUs = now;
+    if (link.rateKbps > 0.f)
+    {
+      const uint64_t startUs = std::max(now, flow.linkFreeUs[direction]);
+      if (startUs - now > uint64_t(link.queueMs * 1000.f))
+      {
+        ++stat.overflowed;
+        continue;
+      }
+      flow.linkFreeUs[direction] = startUs + uint64_t(size * 8 * 1000 / link.rateKbps);
+      departUs = flow.linkFreeUs[direction];
+    }
+    const float jitter = link.jitterMs > 0.f ?
+      std::uniform_real_distribution<float>(-link.jitterMs, link.jitterMs)(gen) : 0.f;
+    datagram.deliverUs = departUs + uint64_t(std::max(0.f, link.latencyMs + jitter) * 1000.f);
+    if (chance(link.reorderPct))
+    {
+      const float holdMs = std::uniform_real_distribution<float>(1.f, link.latencyMs * 0.5f + 10.f)(gen);
+      datagram.deliverUs += uint64_t(holdMs * 1000.f);
+      ++stat.reordered;
+    }
+    else
+    {
+      datagram.deliverUs = std::max(datagram.deliverUs, flow.lastDeliverUs[direction]);
+      flow.lastDeliverUs[direction] = datagram.deliverUs;
+    }
+    pending.push(std::move(datagram));
+  }
+}
+
+static void send_datagram(ENetSocket socket, const ENetAddress &to, const std::vector<uint8_t> &data)
+{
+  ENetBuffer buffer;
+  buffer.data = (void*)data.data();
+  buffer.dataLength = data.size();
+  enet_socket_send(socket, &to, &buffer, 1);
+}
+
+static bool parse_host_port(const char *arg, ENetAddress &address)
+{
+  const char *colon = strrchr(arg, ':');
+  if (!colon)
+    return false;
+  std::string host(arg, colon);
+  address.port = uint16_t(atoi(colon + 1));
+  return address.port != 0 && enet_address_set_host(&address, host.c_str()) == 0;
+}
+
+static bool parse_options(int argc, const char **argv)
+{
+  // the profile goes first wherever it is, so options can override it
+  for (int i = 3; i + 1 < argc; ++i)
+  {
+    if (strcmp(argv[i], "--profile") != 0)
+      continue;
+    const LinkProfile *profile = nullptr;
+    for (const LinkProfile &p : PROFILES)
+      if (strcmp(p.name, argv[i + 1]) == 0)
+        profile = &p;
+    if (!profile)
+    {
+      printf("Unknown profile %s\n", argv[i + 1]);
+      return false;
+    }
+    conditions[E_LINK_UP] = profile->up;
+    conditions[E_LINK_DOWN] = profile->down;
+  }
+  gen.seed(std::random_device()());
+  for (int i = 3; i < argc; i += 2)
+  {
+    if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc)
+    {
+      printf("Expected an option and its value at %s\n", argv[i]);
+      return false;
+    }
+    const char *name = argv[i] + 2;
+    const char *value = argv[i + 1];
+    if (strcmp(name, "profile") == 0)
+      continue;
+    if (strcmp(name, "seed") == 0)
+    {
+      gen.seed(uint32_t(atoi(value)));
+      continue;
+    }
+    bool directions[E_LINK_DIRECTIONS] = {true, true};
+    if (strncmp(name, "up-", 3) == 0)
+    {
+      name += 3;
+      directions[E_LINK_DOWN] = false;
+    }
+    else if (strncmp(name, "down-", 5) == 0)
+    {
+      name += 5;
+      directions[E_LINK_UP] = false;
+    }
+    const LinkOption *option = nullptr;
+    for (const LinkOption &o : OPTIONS)
+      if (strcmp(o.name, name) == 0)
+        option = &o;
+    if (!option)
+    {
+      printf("Unknown option %s\n", argv[i]);
+      return false;
+    }
+    for (int d = 0; d < E_LINK_DIRECTIONS; ++d)
+      if (directions[d])
+        conditions[d].*option->field = float(atof(value));
+  }
+  return true;
+}
+
+static void print_conditions()
+{
+  static const char *NAMES[E_LINK_DIRECTIONS] = {"up", "down"};
+  for (int d = 0; d < E_LINK_DIRECTIONS; ++d)
+  {
+    const LinkConditions &c = conditions[d];
+    printf("%-4s latency %.1f ms, jitter %.1f ms, loss %.2f%%, dup %.2f%%, reorder %.2f%%, "
+           "corrupt %.2f%%, rate %s", NAMES[d], c.latencyMs, c.jitterMs, c.lossPct, c.dupPct,
+           c.reorderPct, c.corruptPct, c.rateKbps > 0.f ? "" : "unlimited\n");
+    if (c.rateKbps > 0.f)
+      printf("%.0f kbit/s, queue %.0f ms\n", c.rateKbps, c.queueMs);
+  }
+}
+
+static void print_stats()
+{
+  static const char *NAMES[E_LINK_DIRECTIONS] = {"up", "down"};
+  for (int d = 0; d < E_LINK_DIRECTIONS; ++d)
+  {
+    const LinkStats &s = stats[d];
+    printf("%-4s %5u in %5u out %6.1f kbit/s | lost %u dup %u reordered %u corrupt %u overflow %u\n",
+           NAMES[d], s.received, s.delivered, s.bytes * 8 * 0.001, s.lost, s.duplicated,
+           s.reordered, s.corrupted, s.overflowed);
+    stats[d] = LinkStats();
+  }
+}
+
+int main(int argc, const char **argv)
+{
+  if (argc < 3)
+  {
+    printf("usage: link_conditioner <listen port> <server host:port> [options]\n");
+    return 1;
+  }
+  if (enet_initialize() != 0)
+  {
+    printf("Cannot init ENet");
+    return 1;
+  }
+  ENetAddress serverAddress;
+  if (!parse_host_port(argv[2], serverAddress))
+  {
+    printf("Cannot resolve server %s\n", argv[2]);
+    return 1;
+  }
+  if (!parse_options(argc, argv))
+    return 1;
+
+  ENetAddress listenAddress;
+  listenAddress.host = ENET_HOST_ANY;
+  listenAddress.port = uint16_t(atoi(argv[1]));
+  ENetSocket listener = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+  if (listener == ENET_SOCKET_NULL || enet_socket_bind(listener, &listenAddress) < 0)
+  {
+    printf("Cannot listen on port %u\n", listenAddress.port);
+    return 1;
+  }
+  enet_socket_set_option(listener, ENET_SOCKOPT_NONBLOCK, 1);
+  printf("Forwarding port %u to %s\n", listenAddress.port, argv[2]);
+  print_conditions();
+
+  std::vector<uint8_t> buf(ENET_PROTOCOL_MAXIMUM_MTU);
+  uint64_t lastReportUs = now_us();
+  while (true)
+  {
+    uint64_t now = now_us();
+    while (!pending.empty() && pending.top().deliverUs <= now)
+    {
+      const Datagram &datagram = pending.top();
+      auto flow = flows.find(datagram.flow);
+      if (flow != flows.end())
+      {
+        if (datagram.direction == E_LINK_UP)
+          send_datagram(flow->second.upstream, serverAddress, datagram.data);
+        else
+          send_datagram(listener, flow->second.client, datagram.data);
+        ++stats[datagram.direction].delivered;
+        stats[datagram.direction].bytes += datagram.data.size();
+      }
+      pending.pop();
+    }
+
+    uint32_t waitMs = MAX_WAIT_MS;
+    if (!pending.empty())
+      waitMs = uint32_t(std::min<uint64_t>(MAX_WAIT_MS, (pending.top().deliverUs - now) / 1000));
+    ENetSocketSet readSet;
+    ENET_SOCKETSET_EMPTY(readSet);
+    ENET_SOCKETSET_ADD(readSet, listener);
+    ENetSocket maxSocket = listener;
+    for (const auto &flow : flows)
+    {
+      ENET_SOCKETSET_ADD(readSet, flow.second.upstream);
+      maxSocket = std::max(maxSocket, flow.second.upstream);
+    }
+    if (enet_socketset_select(maxSocket, &readSet, nullptr, waitMs) < 0)
+      continue;
+    now = now_us();
+
+    if (ENET_SOCKETSET_CHECK(readSet, listener))
+    {
+      ENetAddress from;
+      ENetBuffer buffer;
+      buffer.data = buf.data();
+      buffer.dataLength = buf.size();
+      int size = 0;
+      while ((size = enet_socket_receive(listener, &from, &buffer, 1)) > 0)
+      {
+        const uint64_t key = address_key(from);
+        auto flow = flows.find(key);
+        if (flow == flows.end())
+        {
+          Flow fresh;
+          fresh.client = from;
+          fresh.upstream = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+          if (fresh.upstream == ENET_SOCKET_NULL || enet_socket_bind(fresh.upstream, nullptr) < 0)
+          {
+            printf("Cannot open a socket for %x:%u\n", from.host, from.port);
+            if (fresh.upstream != ENET_SOCKET_NULL)
+              enet_socket_destroy(fresh.upstream);
+            continue;
+          }
+          enet_socket_set_option(fresh.upstream, ENET_SOCKOPT_NONBLOCK, 1);
+          printf("Client %x:%u\n", from.host, from.port);
+          flow = flows.emplace(key, fresh).first;
+        }
+        flow->second.lastActiveUs = now;
+        enqueue(E_LINK_UP, key, flow->second, buf.data(), size_t(size), now);
+      }
+    }
+    for (auto &flow : flows)
+    {
+      if (!ENET_SOCKETSET_CHECK(readSet, flow.second.upstream))
+        continue;
+      ENetAddress from;
+      ENetBuffer buffer;
+      buffer.data = buf.data();
+      buffer.dataLength = buf.size();
+      int size = 0;
+      while ((size = enet_socket_receive(flow.second.upstream, &from, &buffer, 1)) > 0)
+        if (address_key(from) == address_key(serverAddress))
+          enqueue(E_LINK_DOWN, flow.first, flow.second, buf.data(), size_t(size), now);
+    }
+
+    if (now - lastReportUs >= 1000 * 1000)
+    {
+      lastReportUs = now;
+      if (stats[E_LINK_UP].received || stats[E_LINK_DOWN].received)
+        print_stats();
+      for (auto flow = flows.begin(); flow != flows.end();)
+      {
+        if (now - flow->second.lastActiveUs < FLOW_TIMEOUT_US)
+        {
+          ++flow;
+          continue;
+        }
+        printf("Client %x:%u timed out\n", flow->second.client.host, flow->second.client.port);
+        enet_socket_destroy(flow->second.upstream);
+        flow = flows.erase(flow);
+      }
+    }
+  }
+
+  enet_socket_destroy(listener);
+  atexit(enet_deinitialize);
+  return 0;
+}
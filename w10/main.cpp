@@ -9,6 +9,8 @@
 #include "app.h"
 #include <enet/enet.h>
 #include <math.h>
+#include <string.h>
+#include <string>
 
 //for scancodes
 #include <GLFW/glfw3.h>
@@ -17,45 +19,55 @@
 #include <vector>
 #include "entity.h"
 #include "protocol.h"
+#include "eid_allocator.h"
+#include "client_net.h"
+#include "packet_handle.h"
+#include "entity_renderer.h"
 
 
 static std::vector<Entity> entities;
 static uint16_t my_entity = invalid_entity;
 
-void on_new_entity_packet(ENetPacket *packet)
+void on_new_entity(const Entity &newEntity)
 {
-  Entity newEntity;
-  deserialize_new_entity(packet, newEntity);
   // TODO: Direct adressing, of course!
-  for (const Entity &e : entities)
+  for (Entity &e : entities)
+  {
     if (e.eid == newEntity.eid)
       return; // don't need to do anything, we already have entity
+    // index recycled by the server, what we hold is a leftover of its previous owner
+    if (eid_index(e.eid) == eid_index(newEntity.eid))
+    {
+      e = newEntity;
+      return;
+    }
+  }
   entities.push_back(newEntity);
 }
 
-void on_set_controlled_entity(ENetPacket *packet)
-{
-  deserialize_set_controlled_entity(packet, my_entity);
-}
-
-void on_snapshot(ENetPacket *packet)
+void on_snapshot(const Entity &snapshot)
 {
-  uint16_t eid = invalid_entity;
-  float x = 0.f; float y = 0.f; float ori = 0.f;
-  deserialize_snapshot(packet, eid, x, y, ori);
   // TODO: Direct adressing, of course!
   for (Entity &e : entities)
-    if (e.eid == eid)
+    if (e.eid == snapshot.eid)
     {
-      e.x = x;
-      e.y = y;
-      e.ori = ori;
+      e.x = snapshot.x;
+      e.y = snapshot.y;
+      e.ori = snapshot.ori;
     }
 }
 
-void on_key(ENetPacket *packet)
+void on_despawn(uint16_t eid)
 {
-  deserialize_and_set_key(packet);
+  if (eid == my_entity)
+    my_entity = invalid_entity;
+  for (size_t i = 0; i < entities.size(); ++i)
+    if (entities[i].eid == eid)
+    {
+      entities[i] = entities.back();
+      entities.pop_back();
+      break;
+    }
 }
 
 int main(int argc, const char **argv)
@@ -66,29 +78,36 @@ int main(int argc, const char **argv)
     return 1;
   }
 
-  ENetHost *client = enet_host_create(nullptr, 1, 2, 0, 0);
-  if (!client)
+  // w10 [--server host:port] [--fuzz] [--track-packets]
+  // --server e.g. a link_conditioner in front of the server, --fuzz corrupts inputs,
+  // --track-packets prints live received packets every second and what is left on exit
+  std::string serverHost = "localhost";
+  uint16_t serverPort = 10131;
+  for (int i = 1; i < argc; ++i)
   {
-    printf("Cannot create ENet client\n");
-    return 1;
+    if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+    {
+      const char *server = argv[++i];
+      const char *colon = strrchr(server, ':');
+      serverHost.assign(server, colon ? colon : server + strlen(server));
+      if (colon)
+        serverPort = uint16_t(atoi(colon + 1));
+    }
+    else if (strcmp(argv[i], "--fuzz") == 0)
+      set_input_fuzzing(true);
+    else if (strcmp(argv[i], "--track-packets") == 0)
+      set_packet_tracking(true);
   }
-
-  ENetAddress address;
-  enet_address_set_host(&address, "localhost");
-  address.port = 10131;
-
-  ENetPeer *serverPeer = enet_host_connect(client, &address, 2, 0);
-  if (!serverPeer)
-  {
-    printf("Cannot connect to server");
+  if (!client_net_start(serverHost.c_str(), serverPort))
     return 1;
-  }
 
   int width = 1920;
   int height = 1080;
   if (!app_init(width, height))
     return 1;
   ddInit();
+  if (!renderer_init())
+    printf("Instanced rendering unavailable, falling back to debug draw\n");
 
   bx::Vec3 eye(0.f, 0.f, -16.f);
   bx::Vec3 at(0.f, 0.f, 0.f);
@@ -96,43 +115,29 @@ int main(int argc, const char **argv)
 
   float view[16];
   float proj[16];
-  bx::mtxLookAt(view, bx::load<bx::Vec3>(&eye.x), bx::load<bx::Vec3>(&at.x), bx::load<bx::Vec3>(&up.x) );
 
 
-  bool connected = false;
   int64_t now = bx::getHPCounter();
   int64_t last = now;
   float dt = 0.f;
   while (!app_should_close())
   {
-    ENetEvent event;
-    while (enet_host_service(client, &event, 0) > 0)
+    ClientEvent event;
+    while (client_net_poll(event))
     {
       switch (event.type)
       {
-      case ENET_EVENT_TYPE_CONNECT:
-        printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        send_join(serverPeer);
-        connected = true;
+      case E_CLIENT_EVENT_NEW_ENTITY:
+        on_new_entity(event.entity);
+        break;
+      case E_CLIENT_EVENT_CONTROLLED_ENTITY:
+        my_entity = event.entity.eid;
         break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        switch (get_packet_type(event.packet))
-        {
-        case E_SERVER_TO_CLIENT_NEW_ENTITY:
-          on_new_entity_packet(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
-          on_set_controlled_entity(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_SNAPSHOT:
-          on_snapshot(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_KEY:
-          on_key(event.packet);
-          break;
-        };
+      case E_CLIENT_EVENT_SNAPSHOT:
+        on_snapshot(event.entity);
         break;
-      default:
+      case E_CLIENT_EVENT_DESPAWN:
+        on_despawn(event.entity.eid);
         break;
       };
     }
@@ -142,19 +147,22 @@ int main(int argc, const char **argv)
       bool right = app_keypressed(GLFW_KEY_RIGHT);
       bool up = app_keypressed(GLFW_KEY_UP);
       bool down = app_keypressed(GLFW_KEY_DOWN);
-      // TODO: Direct adressing, of course!
-      for (Entity &e : entities)
-        if (e.eid == my_entity)
-        {
-          // Update
-          float thr = (up ? 1.f : 0.f) + (down ? -1.f : 0.f);
-          float steer = (left ? 1.f : 0.f) + (right ? -1.f : 0.f);
-
-          // Send
-          send_entity_input(serverPeer, my_entity, thr, steer);
-        }
+      float thr = (up ? 1.f : 0.f) + (down ? -1.f : 0.f);
+      float steer = (left ? 1.f : 0.f) + (right ? -1.f : 0.f);
+
+      // sent by the network thread at its own rate
+      client_net_set_input(thr, steer);
     }
 
+    // the world is bigger than the screen, keep our entity in the middle
+    for (const Entity &e : entities)
+      if (e.eid == my_entity)
+      {
+        eye.x = at.x = e.x;
+        eye.y = at.y = e.y;
+      }
+    bx::mtxLookAt(view, bx::load<bx::Vec3>(&eye.x), bx::load<bx::Vec3>(&at.x), bx::load<bx::Vec3>(&up.x) );
+
     app_poll_events();
     // Handle window resize.
     app_handle_resize(width, height);
@@ -165,12 +173,15 @@ int main(int argc, const char **argv)
     const bgfx::ViewId kClearView = 0;
     bgfx::touch(kClearView);
 
+    const size_t drawn = renderer_draw(0, entities);
+
     DebugDrawEncoder dde;
 
     dde.begin(0);
 
-    for (const Entity &e : entities)
+    for (size_t i = drawn; i < entities.size(); ++i)
     {
+      const Entity &e = entities[i];
       dde.push();
 
         dde.setColor(e.color);
@@ -191,6 +202,8 @@ int main(int argc, const char **argv)
     last = now;
     printf("%f\n", 1.f/dt);
   }
+  client_net_stop();
+  renderer_shutdown();
   ddShutdown();
   bgfx::shutdown();
   app_terminate();
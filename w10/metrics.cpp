@@ -0,0 +1,298 @@
+#include "metrics.h"
+#include <enet/enet.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum MetricKind
+{
+  E_METRIC_COUNTER,
+  E_METRIC_GAUGE,
+  E_METRIC_HISTOGRAM
+};
+
+struct MetricEntry
+{
+  MetricKind kind;
+  void *metric;
+  std::string name;
+  const char *help;
+  std::string labels;
+  double scale;
+};
+
+// quantiles dumped for every histogram, 1 is the largest recorded value
+const double METRIC_QUANTILES[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+// how long the dump thread blocks before it checks for stop and the file interval
+const uint32_t METRICS_POLL_MS = 100;
+
+static std::mutex mutex;
+static std::vector<MetricEntry> entries;
+static std::thread server;
+static std::atomic<bool> running{false};
+static ENetSocket listener = ENET_SOCKET_NULL;
+static std::string filePath;
+static uint32_t fileInterval = 1000;
+
+static void add_entry(MetricKind kind, void *metric, const std::string &name, const char *help,
+                      const std::string &labels, double scale)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.push_back({kind, metric, name, help, labels, scale});
+}
+
+void metrics_register(MetricCounter &metric, const std::string &name, const char *help,
+                      const std::string &labels)
+{
+  add_entry(E_METRIC_COUNTER, &metric, name, help, labels, 1.0);
+}
+
+void metrics_register(MetricGauge &metric, const std::string &name, const char *help,
+                      const std::string &labels, double scale)
+{
+  add_entry(E_METRIC_GAUGE, &metric, name, help, labels, scale);
+}
+
+void metrics_register(MetricHistogram &metric, const std::string &name, const char *help,
+                      const std::string &labels, double scale)
+{
+  add_entry(E_METRIC_HISTOGRAM, &metric, name, help, labels, scale);
+}
+
+static void bucket_bounds(size_t bucket, uint64_t &lo, uint64_t &hi)
+{
+  if (bucket < (1u << METRIC_HISTOGRAM_SUB_BITS))
+  {
+    lo = hi = bucket;
+    return;
+  }
+  const int shift = int(bucket >> METRIC_HISTOGRAM_SUB_BITS) - 1;
+  const uint64_t mantissa = bucket - (size_t(shift) << METRIC_HISTOGRAM_SUB_BITS);
+  lo = mantissa << shift;
+  hi = lo + ((uint64_t(1) << shift) - 1);
+}
+
+static void append_sample(std::string &out, const std::string &name, const std::string &labels,
+                          const char *extra_label, double value)
+{
+  char buf[64];
+  out += name;
+  if (!labels.empty() || extra_label)
+  {
+    out += '{';
+    out += labels;
+    if (!labels.empty() && extra_label)
+      out += ',';
+    if (extra_label)
+      out += extra_label;
+    out += '}';
+  }
+  snprintf(buf, sizeof(buf), " %.10g\n", value);
+  out += buf;
+}
+
+static void append_histogram(std::string &out, const MetricEntry &entry)
+{
+  const MetricHistogram &histogram = *(const MetricHistogram*)entry.metric;
+  // relaxed loads, a record landing mid-dump only shows up in the next one
+  static thread_local uint64_t counts[METRIC_HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  double sum = 0.0;
+  for (size_t b = 0; b < METRIC_HISTOGRAM_BUCKETS; ++b)
+  {
+    counts[b] = histogram.buckets[b].load(std::memory_order_relaxed);
+    if (!counts[b])
+      continue;
+    uint64_t lo, hi;
+    bucket_bounds(b, lo, hi);
+    total += counts[b];
+    sum += counts[b] * (0.5 * double(lo) + 0.5 * double(hi));
+  }
+  size_t b = 0;
+  uint64_t seen = 0;
+  for (double q : METRIC_QUANTILES)
+  {
+    // highest value the quantile's bucket stands for, like HdrHistogram reports it
+    double value = 0.0;
+    if (total)
+    {
+      const uint64_t rank = q >= 1.0 ? total : std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+      while (b < METRIC_HISTOGRAM_BUCKETS && seen + counts[b] < rank)
+        seen += counts[b++];
+      uint64_t lo, hi;
+      bucket_bounds(std::min(b, METRIC_HISTOGRAM_BUCKETS - 1), lo, hi);
+      value = double(hi) * entry.scale;
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "quantile=\"%g\"", q);
+    append_sample(out, entry.name, entry.labels, label, value);
+  }
+  append_sample(out, entry.name + "_sum", entry.labels, nullptr, sum * entry.scale);
+  append_sample(out, entry.name + "_count", entry.labels, nullptr, double(total));
+}
+
+std::string metrics_text()
+{
+  static const char *TYPE_NAMES[] = {"counter", "gauge", "summary"};
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string out;
+  std::vector<bool> written(entries.size(), false);
+  // one HELP/TYPE block per name, with every label set registered under it
+  for (size_t i = 0; i < entries.size(); ++i)
+  {
+    if (written[i])
+      continue;
+    out += "# HELP " + entries[i].name + " " + entries[i].help + "\n";
+    out += "# TYPE " + entries[i].name + " " + TYPE_NAMES[entries[i].kind] + "\n";
+    for (size_t j = i; j < entries.size(); ++j)
+    {
+      const MetricEntry &entry = entries[j];
+      if (written[j] || entry.name != entries[i].name)
+        continue;
+      written[j] = true;
+      if (entry.kind == E_METRIC_COUNTER)
+        append_sample(out, entry.name, entry.labels, nullptr,
+                      double(((MetricCounter*)entry.metric)->value.load(std::memory_order_relaxed)));
+      else if (entry.kind == E_METRIC_GAUGE)
+        append_sample(out, entry.name, entry.labels, nullptr,
+                      double(((MetricGauge*)entry.metric)->value.load(std::memory_order_relaxed)) * entry.scale);
+      else
+        append_histogram(out, entry);
+    }
+  }
+  return out;
+}
+
+static void send_all(ENetSocket socket, const std::string &data)
+{
+  size_t sent = 0;
+  while (sent < data.size())
+  {
+    ENetBuffer buffer;
+    buffer.data = (void*)(data.data() + sent);
+    buffer.dataLength = data.size() - sent;
+    int n = enet_socket_send(socket, nullptr, &buffer, 1);
+    if (n < 0)
+      return;
+    if (n == 0)
+    {
+      enet_uint32 wait = ENET_SOCKET_WAIT_SEND;
+      if (enet_socket_wait(socket, &wait, METRICS_POLL_MS) != 0 || !(wait & ENET_SOCKET_WAIT_SEND))
+        return;
+    }
+    sent += size_t(n);
+  }
+}
+
+// any request gets the dump, scrapers only ever ask for the one page
+static void serve_scrape(ENetSocket client)
+{
+  char request[1024];
+  enet_uint32 wait = ENET_SOCKET_WAIT_RECEIVE;
+  if (enet_socket_wait(client, &wait, METRICS_POLL_MS) == 0 && (wait & ENET_SOCKET_WAIT_RECEIVE))
+  {
+    ENetBuffer buffer;
+    buffer.data = request;
+    buffer.dataLength = sizeof(request);
+    enet_socket_receive(client, nullptr, &buffer, 1);
+  }
+  const std::string body = metrics_text();
+  char header[160];
+  snprintf(header, sizeof(header),
+           "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+  send_all(client, header + body);
+  enet_socket_shutdown(client, ENET_SOCKET_SHUTDOWN_READ_WRITE);
+}
+
+// the whole dump goes to a temporary file first, so readers never see half of it
+static void write_file()
+{
+  const std::string tmpPath = filePath + ".tmp";
+  FILE *f = fopen(tmpPath.c_str(), "wb");
+  if (!f)
+    return;
+  const std::string text = metrics_text();
+  const bool written = fwrite(text.data(), 1, text.size(), f) == text.size();
+  if (fclose(f) != 0 || !written)
+    return;
+  if (rename(tmpPath.c_str(), filePath.c_str()) != 0)
+  {
+    // rename doesn't replace an existing file on Windows
+    remove(filePath.c_str());
+    rename(tmpPath.c_str(), filePath.c_str());
+  }
+}
+
+static void server_loop()
+{
+  auto lastWrite = std::chrono::steady_clock::now();
+  while (running.load(std::memory_order_relaxed))
+  {
+    if (listener != ENET_SOCKET_NULL)
+    {
+      enet_uint32 wait = ENET_SOCKET_WAIT_RECEIVE;
+      if (enet_socket_wait(listener, &wait, METRICS_POLL_MS) == 0 && (wait & ENET_SOCKET_WAIT_RECEIVE))
+      {
+        ENetSocket client = enet_socket_accept(listener, nullptr);
+        if (client != ENET_SOCKET_NULL)
+        {
+          serve_scrape(client);
+          enet_socket_destroy(client);
+        }
+      }
+    }
+    else
+      std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_POLL_MS));
+
+    auto now = std::chrono::steady_clock::now();
+    if (!filePath.empty() && now - lastWrite >= std::chrono::milliseconds(fileInterval))
+    {
+      write_file();
+      lastWrite = now;
+    }
+  }
+  if (!filePath.empty())
+    write_file();
+}
+
+bool metrics_start(uint16_t port, const char *path, uint32_t file_interval_ms)
+{
+  if (running || (!port && !path))
+    return false;
+  if (port)
+  {
+    ENetAddress address;
+    enet_address_set_host_ip(&address, "127.0.0.1");
+    address.port = port;
+    listener = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+    if (listener == ENET_SOCKET_NULL)
+      return false;
+    enet_socket_set_option(listener, ENET_SOCKOPT_REUSEADDR, 1);
+    if (enet_socket_bind(listener, &address) < 0 || enet_socket_listen(listener, 4) < 0)
+    {
+      enet_socket_destroy(listener);
+      listener = ENET_SOCKET_NULL;
+      return false;
+    }
+  }
+  filePath = path ? path : "";
+  fileInterval = file_interval_ms;
+  running = true;
+  server = std::thread(server_loop);
+  return true;
+}
+
+void metrics_stop()
+{
+  if (!running)
+    return;
+  running = false;
+  server.join();
+  if (listener != ENET_SOCKET_NULL)
+    enet_socket_destroy(listener);
+  listener = ENET_SOCKET_NULL;
+}
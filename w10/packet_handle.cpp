@@ -0,0 +1,71 @@
+#include "packet_handle.h"
+#include <atomic>
+#include <cstdio>
+
+static std::atomic<bool> tracking{false};
+static std::atomic<uint64_t> tracked{0};
+static std::atomic<uint64_t> freed{0};
+static std::atomic<uint64_t> trackedBytes{0};
+static std::atomic<uint64_t> freedBytes{0};
+
+static void on_packet_free(ENetPacket *packet)
+{
+  freed.fetch_add(1, std::memory_order_relaxed);
+  freedBytes.fetch_add(packet->dataLength, std::memory_order_relaxed);
+}
+
+static void track_packet(ENetPacket *packet)
+{
+  // already counted, or somebody else's callback and not ours to account for
+  if (packet->freeCallback)
+    return;
+  packet->freeCallback = on_packet_free;
+  tracked.fetch_add(1, std::memory_order_relaxed);
+  trackedBytes.fetch_add(packet->dataLength, std::memory_order_relaxed);
+}
+
+PacketHandle::PacketHandle(ENetPacket *packet) : packet(packet)
+{
+  if (packet && tracking.load(std::memory_order_relaxed))
+    track_packet(packet);
+}
+
+void PacketHandle::reset(ENetPacket *replacement)
+{
+  if (packet && packet != replacement)
+    enet_packet_destroy(packet);
+  packet = replacement;
+  if (packet && tracking.load(std::memory_order_relaxed))
+    track_packet(packet);
+}
+
+void set_packet_tracking(bool enabled)
+{
+  tracking = enabled;
+}
+
+bool packet_tracking()
+{
+  return tracking.load(std::memory_order_relaxed);
+}
+
+PacketStats packet_stats()
+{
+  PacketStats stats;
+  // freed first, a packet freed between the loads would otherwise go negative
+  stats.freed = freed.load(std::memory_order_relaxed);
+  const uint64_t freedSize = freedBytes.load(std::memory_order_relaxed);
+  stats.tracked = tracked.load(std::memory_order_relaxed);
+  const uint64_t trackedSize = trackedBytes.load(std::memory_order_relaxed);
+  stats.live = stats.tracked - stats.freed;
+  stats.liveBytes = trackedSize - freedSize;
+  return stats;
+}
+
+void print_packet_stats(const char *prefix)
+{
+  const PacketStats stats = packet_stats();
+  printf("%spackets live %llu (%llu bytes), tracked %llu, freed %llu\n", prefix,
+         (unsigned long long)stats.live, (unsigned long long)stats.liveBytes,
+         (unsigned long long)stats.tracked, (unsigned long long)stats.freed);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstddef>
+#include <cstdint>
+
+// Owns a packet ENet handed over (a received one) and destroys it when it goes out of
+// scope. Handlers borrow it, only release() gives the packet up, e.g. to send it on.
+class PacketHandle
+{
+public:
+  PacketHandle() = default;
+  explicit PacketHandle(ENetPacket *packet);
+  ~PacketHandle() { reset(); }
+
+  PacketHandle(PacketHandle &&other) : packet(other.release()) {}
+  PacketHandle &operator=(PacketHandle &&other)
+  {
+    if (this != &other)
+      reset(other.release());
+    return *this;
+  }
+  PacketHandle(const PacketHandle &) = delete;
+  PacketHandle &operator=(const PacketHandle &) = delete;
+
+  ENetPacket *get() const { return packet; }
+  explicit operator bool() const { return packet != nullptr; }
+  ENetPacket *release()
+  {
+    ENetPacket *released = packet;
+    packet = nullptr;
+    return released;
+  }
+  void reset(ENetPacket *replacement = nullptr);
+
+private:
+  ENetPacket *packet = nullptr;
+};
+
+// Debug accounting of packet lifetimes, off by default. While it is on every packet a
+// handle takes counts as live until ENet really frees it (through the packet's free
+// callback), so a packet that is never destroyed shows up as live for good.
+struct PacketStats
+{
+  uint64_t tracked;
+  uint64_t freed;
+  uint64_t live;
+  uint64_t liveBytes;
+};
+
+void set_packet_tracking(bool enabled);
+bool packet_tracking();
+PacketStats packet_stats();
+void print_packet_stats(const char *prefix);
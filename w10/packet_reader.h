@@ -0,0 +1,61 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Bounds checked reads from a received packet. A read past the end yields zeros and
+// fails the reader for good, so deserializers read every field unconditionally and
+// check once at the end instead of branching per field.
+class PacketReader
+{
+public:
+  explicit PacketReader(const ENetPacket *packet)
+    : ptr(packet->data), end(packet->data + packet->dataLength) {}
+
+  template<typename T>
+  T read()
+  {
+    T val{};
+    if (size_t(end - ptr) >= sizeof(T))
+    {
+      memcpy(&val, ptr, sizeof(T));
+      ptr += sizeof(T);
+    }
+    else
+      fail();
+    return val;
+  }
+
+  template<typename T>
+  void read(T &val) { val = read<T>(); }
+
+  // nullptr (and failed) if fewer than `size` bytes are left
+  const uint8_t *read_bytes(size_t size)
+  {
+    if (size_t(end - ptr) < size)
+    {
+      fail();
+      return nullptr;
+    }
+    const uint8_t *bytes = ptr;
+    ptr += size;
+    return bytes;
+  }
+
+  size_t remaining() const { return size_t(end - ptr); }
+  bool ok() const { return !failed; }
+  // every read fit and nothing was left over
+  bool done() const { return !failed && ptr == end; }
+
+private:
+  void fail()
+  {
+    ptr = end;
+    failed = true;
+  }
+
+  const uint8_t *ptr;
+  const uint8_t *end;
+  bool failed = false;
+};
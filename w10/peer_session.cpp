@@ -0,0 +1,76 @@
+#include "peer_session.h"
+
+static ENetHost *sessionHost = nullptr;
+static std::vector<PeerSession> pool; // one per peer slot, never reallocated after init
+static std::vector<PeerSession*> active;
+
+void sessions_init(ENetHost *host)
+{
+  sessionHost = host;
+  pool.clear();
+  pool.resize(host->peerCount);
+  active.clear();
+  active.reserve(host->peerCount);
+}
+
+PeerSession *session_open(ENetPeer *peer)
+{
+  PeerSession &session = pool[peer - sessionHost->peers];
+  // keep the buffers' capacity from the previous owner of this slot
+  PeerSession fresh;
+  fresh.outgoing.swap(session.outgoing);
+  fresh.outgoing.clear();
+  session = std::move(fresh);
+
+  session.peer = peer;
+  scheduler_reset(session.send);
+  session.denseIdx = active.size();
+  active.push_back(&session);
+  peer->data = &session;
+  return &session;
+}
+
+void session_close(ENetPeer *peer)
+{
+  PeerSession *session = get_session(peer);
+  if (!session)
+    return;
+  PeerSession *last = active.back();
+  active[session->denseIdx] = last;
+  last->denseIdx = session->denseIdx;
+  active.pop_back();
+
+  for (ENetPacket *packet : session->outgoing)
+    enet_packet_destroy(packet);
+  session->outgoing.clear();
+  if (session->outgoingOrigin)
+    enet_packet_destroy(session->outgoingOrigin);
+  session->outgoingOrigin = nullptr;
+  session->peer = nullptr;
+  peer->data = nullptr;
+}
+
+// per entity arrays are resized lazily, they may not reach `last` yet
+template<typename T>
+static void swap_remove(std::vector<T> &values, size_t slot, size_t last)
+{
+  if (slot < values.size())
+    values[slot] = last < values.size() ? values[last] : T();
+  if (values.size() > last)
+    values.resize(last);
+}
+
+void session_remove_entity(PeerSession &session, size_t slot, size_t last)
+{
+  swap_remove(session.send.priority, slot, last);
+}
+
+size_t session_count()
+{
+  return active.size();
+}
+
+PeerSession &session_at(size_t dense_idx)
+{
+  return *active[dense_idx];
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+#include "send_scheduler.h"
+#include "protocol.h"
+
+// Everything the server knows about one connected peer. Sessions live in a pool
+// sized to the host's peer table, peer->data points into it, and the connected ones
+// are listed densely so per-tick loops never touch empty peer slots.
+struct PeerSession
+{
+  ENetPeer *peer = nullptr;
+  uint16_t controlledEid = invalid_entity;
+  uint32_t cipherKey = 0;
+
+  uint16_t lastInputSeq = 0; // newest input sequence applied
+  uint32_t inputsReceived = 0;
+
+  // snapshot positions are near offsets from this once the peer has been told about it
+  SnapshotOrigin origin;
+  bool hasOrigin = false;
+  float sinceOriginMove = 0.f;
+  // batches to this peer may be rANS coded once it has been sent the tables
+  bool hasEntropyTables = false;
+
+  PeerSendState send;
+  // snapshots serialized by a job thread, sent from the main thread after the barrier
+  std::vector<ENetPacket*> outgoing;
+  ENetPacket *outgoingOrigin = nullptr;
+
+  uint32_t packetsIn = 0;
+  uint32_t bytesIn = 0;
+  uint32_t packetsOut = 0;
+  uint32_t bytesOut = 0;
+
+  size_t denseIdx = 0;
+};
+
+void sessions_init(ENetHost *host);
+PeerSession *session_open(ENetPeer *peer);
+void session_close(ENetPeer *peer);
+
+// entity at `slot` was removed by moving the one at `last` into it, mirror that
+void session_remove_entity(PeerSession &session, size_t slot, size_t last);
+
+inline PeerSession *get_session(ENetPeer *peer) { return (PeerSession*)peer->data; }
+
+// connected sessions, densely packed; order changes when one closes
+size_t session_count();
+PeerSession &session_at(size_t dense_idx);
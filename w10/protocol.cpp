@@ -1,28 +1,140 @@
 #include "protocol.h"
+#include "capture.h"
+#include "metrics.h"
+#include "packet_reader.h"
 #include "quantisation.h"
+#include <algorithm>
+#include <cmath>
 #include <cstring> // memcpy
 #include <iostream>
 #include <stdlib.h>
 
 static uint32_t xorCipherKey = 0;
+static bool fuzzInputs = false;
+
+static const char *MESSAGE_TYPE_NAMES[] = {
+  "join", "new_entity", "set_controlled_entity", "input", "snapshot", "key", "despawn",
+  "world", "origin", "snapshot_batch", "entropy_tables", "unknown"
+};
+static_assert(sizeof(MESSAGE_TYPE_NAMES) / sizeof(MESSAGE_TYPE_NAMES[0]) == E_MESSAGE_TYPE_COUNT + 1,
+              "every message type needs a metrics name");
+// by message type, the last slot takes whatever a peer sent that isn't one
+static uint8_t reliableChannel = 0;
+static uint8_t unreliableChannel = 1;
+static MetricCounter packetsOut[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter bytesOut[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter packetsIn[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter bytesIn[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter rejected[E_MESSAGE_TYPE_COUNT + 1];
+
+struct MessageSize
+{
+  size_t min;
+  size_t max;
+};
+
+// whole packet sizes, the deserializers check what's inside the variable sized ones
+static const MessageSize MESSAGE_SIZES[] = {
+  {1, 1}, // join
+  {1 + sizeof(Entity), 1 + sizeof(Entity)}, // new entity
+  {1 + sizeof(uint16_t), 1 + sizeof(uint16_t)}, // set controlled entity
+  {INPUT_HEADER_SIZE + 1, INPUT_HEADER_SIZE + INPUT_REDUNDANCY}, // input
+  {SNAPSHOT_PACKET_SIZE, SNAPSHOT_PACKET_SIZE}, // snapshot
+  {1 + sizeof(uint32_t), 1 + sizeof(uint32_t)}, // key
+  {1 + sizeof(uint16_t), SIZE_MAX}, // despawn
+  {1 + sizeof(WorldBounds), 1 + sizeof(WorldBounds)}, // world
+  {2 + 2 * sizeof(float), 2 + 2 * sizeof(float)}, // origin
+  {SNAPSHOT_BATCH_HEADER_SIZE, SNAPSHOT_BATCH_HEADER_SIZE + SNAPSHOT_BATCH_MAX_ENTRIES * SNAPSHOT_ENTRY_SIZE}, // snapshot batch
+  {1 + 256 * sizeof(uint16_t) * SNAPSHOT_BATCH_PLANES, 1 + 256 * sizeof(uint16_t) * SNAPSHOT_BATCH_PLANES}, // entropy tables
+};
+static_assert(sizeof(MESSAGE_SIZES) / sizeof(MESSAGE_SIZES[0]) == E_MESSAGE_TYPE_COUNT,
+              "every message type needs its sizes");
+
+static size_t metric_type(const ENetPacket *packet)
+{
+  return packet->dataLength && *packet->data < E_MESSAGE_TYPE_COUNT ? size_t(*packet->data) : size_t(E_MESSAGE_TYPE_COUNT);
+}
+
+void register_protocol_metrics()
+{
+  for (size_t type = 0; type <= E_MESSAGE_TYPE_COUNT; ++type)
+  {
+    const std::string out = std::string("type=\"") + MESSAGE_TYPE_NAMES[type] + "\",direction=\"out\"";
+    const std::string in = std::string("type=\"") + MESSAGE_TYPE_NAMES[type] + "\",direction=\"in\"";
+    metrics_register(packetsOut[type], "server_packets_total", "Packets by message type.", out);
+    metrics_register(packetsIn[type], "server_packets_total", "Packets by message type.", in);
+    metrics_register(bytesOut[type], "server_bytes_total", "Payload bytes by message type.", out);
+    metrics_register(bytesIn[type], "server_bytes_total", "Payload bytes by message type.", in);
+    metrics_register(rejected[type], "server_rejected_packets_total",
+                     "Received packets dropped as malformed, by the type they claimed.",
+                     std::string("type=\"") + MESSAGE_TYPE_NAMES[type] + "\"");
+  }
+}
+
+void count_received(const ENetPacket *packet)
+{
+  const size_t type = metric_type(packet);
+  packetsIn[type].add();
+  bytesIn[type].add(packet->dataLength);
+}
+
+void set_channel_layout(uint8_t reliable, uint8_t unreliable)
+{
+  reliableChannel = reliable;
+  unreliableChannel = unreliable;
+}
+
+uint8_t reliable_channel()
+{
+  return reliableChannel;
+}
+
+uint8_t unreliable_channel()
+{
+  return unreliableChannel;
+}
+
+void peer_send(ENetPeer *peer, uint8_t channel, ENetPacket *packet)
+{
+  const size_t type = metric_type(packet);
+  const size_t size = packet->dataLength;
+  // the packet is ENet's after a successful send, but its data lives until it goes out
+  if (enet_peer_send(peer, channel, packet) != 0)
+    return;
+  packetsOut[type].add();
+  bytesOut[type].add(size);
+  capture_record(E_CAPTURE_OUT, peer->incomingPeerID, channel, packet->data, size);
+}
 
 void send_join(ENetPeer *peer)
 {
   ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t), ENET_PACKET_FLAG_RELIABLE);
   *packet->data = E_CLIENT_TO_SERVER_JOIN;
 
-  enet_peer_send(peer, 0, packet);
+  peer_send(peer, reliableChannel, packet);
+}
+
+void send_shared(ENetPeer *const *peers, size_t count, uint8_t channel, ENetPacket *packet)
+{
+  for (size_t i = 0; i < count; ++i)
+    peer_send(peers[i], channel, packet);
+  if (packet->referenceCount == 0)
+    enet_packet_destroy(packet);
 }
 
 void send_new_entity(ENetPeer *peer, const Entity &ent)
+{
+  peer_send(peer, reliableChannel, create_new_entity_packet(ent));
+}
+
+ENetPacket *create_new_entity_packet(const Entity &ent)
 {
   ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(Entity),
                                                    ENET_PACKET_FLAG_RELIABLE);
   uint8_t *ptr = packet->data;
   *ptr = E_SERVER_TO_CLIENT_NEW_ENTITY; ptr += sizeof(uint8_t);
   memcpy(ptr, &ent, sizeof(Entity)); ptr += sizeof(Entity);
-
-  enet_peer_send(peer, 0, packet);
+  return packet;
 }
 
 void send_set_controlled_entity(ENetPeer *peer, uint16_t eid)
@@ -33,7 +145,7 @@ void send_set_controlled_entity(ENetPeer *peer, uint16_t eid)
   *ptr = E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY; ptr += sizeof(uint8_t);
   memcpy(ptr, &eid, sizeof(uint16_t)); ptr += sizeof(uint16_t);
 
-  enet_peer_send(peer, 0, packet);
+  peer_send(peer, reliableChannel, packet);
 }
 
 void send_cipher_key(ENetPeer *peer, uint32_t key)
@@ -44,7 +156,12 @@ void send_cipher_key(ENetPeer *peer, uint32_t key)
   *ptr = E_SERVER_TO_CLIENT_KEY; ptr += sizeof(uint8_t);
   memcpy(ptr, &key, sizeof(uint32_t)); ptr += sizeof(uint32_t);
 
-  enet_peer_send(peer, 0, packet);
+  peer_send(peer, reliableChannel, packet);
+}
+
+void set_input_fuzzing(bool enabled)
+{
+  fuzzInputs = enabled;
 }
 
 void fuzz_packet_data(ENetPacket *packet)
@@ -52,70 +169,286 @@ void fuzz_packet_data(ENetPacket *packet)
   packet->data[rand() % packet->dataLength] = (uint8_t)rand();
 }
 
-void send_entity_input(ENetPeer *peer, uint16_t eid, float thr, float ori)
+void push_input(InputHistory &inputs, float thr, float steer)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
-                                                   sizeof(float) * 2,
-                                                   //sizeof(uint8_t),
-                                                   ENET_PACKET_FLAG_UNSEQUENCED);
+  memmove(inputs.codes + 1, inputs.codes, INPUT_REDUNDANCY - 1);
+  inputs.codes[0] = pack_input(thr, steer);
+  inputs.count = uint8_t(std::min<size_t>(inputs.count + 1, INPUT_REDUNDANCY));
+  ++inputs.seq;
+}
+
+void send_entity_input(ENetPeer *peer, uint16_t eid, const InputHistory &inputs)
+{
+  static_assert(INPUT_REDUNDANCY <= 8, "changed mask is one byte");
+  uint8_t changed = 0;
+  uint8_t codes[INPUT_REDUNDANCY];
+  size_t codeCount = 0;
+  codes[codeCount++] = inputs.codes[0];
+  for (size_t i = 1; i < inputs.count; ++i)
+    if (inputs.codes[i] != inputs.codes[i - 1])
+    {
+      changed |= uint8_t(1 << (i - 1));
+      codes[codeCount++] = inputs.codes[i];
+    }
+
+  ENetPacket *packet = enet_packet_create(nullptr, INPUT_HEADER_SIZE + codeCount,
+                                          ENET_PACKET_FLAG_UNSEQUENCED);
   uint8_t *ptr = packet->data;
   *ptr = E_CLIENT_TO_SERVER_INPUT; ptr += sizeof(uint8_t);
   memcpy(ptr, &eid, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  memcpy(ptr, &thr, sizeof(float)); ptr += sizeof(float);
-  memcpy(ptr, &ori, sizeof(float)); ptr += sizeof(float);
-  /*
-  float4bitsQuantized thrPacked(thr, -1.f, 1.f);
-  float4bitsQuantized oriPacked(ori, -1.f, 1.f);
-  uint8_t thrSteerPacked = (thrPacked.packedVal << 4) | oriPacked.packedVal;
-  memcpy(ptr, &thrSteerPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
-  */
-  /*
-  memcpy(ptr, &thrPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
-  memcpy(ptr, &oriPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
-  */
-
-  fuzz_packet_data(packet);
+  memcpy(ptr, &inputs.seq, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  *ptr = inputs.count; ptr += sizeof(uint8_t);
+  *ptr = changed; ptr += sizeof(uint8_t);
+  memcpy(ptr, codes, codeCount);
+
+  if (fuzzInputs)
+    fuzz_packet_data(packet);
   cipher_data(packet);
 
-  enet_peer_send(peer, 1, packet);
+  peer_send(peer, unreliableChannel, packet);
 }
 
-void send_snapshot(ENetPeer *peer, uint16_t eid, float x, float y, float ori)
+void send_snapshot(ENetPeer *peer, uint16_t eid, uint32_t packed)
 {
-  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
-                                                   sizeof(uint16_t) +
-                                                   sizeof(uint16_t) +
-                                                   sizeof(uint8_t),
+  peer_send(peer, unreliableChannel, create_snapshot_packet(eid, packed));
+}
+
+ENetPacket *create_snapshot_packet(uint16_t eid, uint32_t packed)
+{
+  ENetPacket *packet = enet_packet_create(nullptr, SNAPSHOT_PACKET_SIZE,
                                                    ENET_PACKET_FLAG_UNSEQUENCED);
   uint8_t *ptr = packet->data;
   *ptr = E_SERVER_TO_CLIENT_SNAPSHOT; ptr += sizeof(uint8_t);
   memcpy(ptr, &eid, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  uint16_t xPacked = pack_float<uint16_t>(x, -16.f, 16.f, 11);
-  uint16_t yPacked = pack_float<uint16_t>(y, -8.f, 8.f, 10);
-  uint8_t oriPacked = pack_float<uint8_t>(ori, -PI, PI, 8);
-  //printf("xPacked/unpacked %d %f\n", xPacked, x);
-  memcpy(ptr, &xPacked, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  memcpy(ptr, &yPacked, sizeof(uint16_t)); ptr += sizeof(uint16_t);
-  memcpy(ptr, &oriPacked, sizeof(uint8_t)); ptr += sizeof(uint8_t);
+  memcpy(ptr, &packed, sizeof(uint32_t)); ptr += sizeof(uint32_t);
 
-  enet_peer_send(peer, 1, packet);
+  return packet;
 }
 
-MessageType get_packet_type(ENetPacket *packet)
+void SnapshotWorld::set(const WorldBounds &world_bounds)
 {
-  return (MessageType)*packet->data;
+  bounds = world_bounds;
+  x.set(bounds.minX, bounds.maxX);
+  y.set(bounds.minY, bounds.maxY);
 }
 
-void deserialize_new_entity(ENetPacket *packet, Entity &ent)
+void quantize_snapshots(const std::vector<Entity> &entities, size_t from, size_t to,
+                        const SnapshotWorld &world, SnapshotCodes &codes)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  ent = *(Entity*)(ptr); ptr += sizeof(Entity);
+  // gather to SoA so the codecs can run four lanes at a time
+  thread_local std::vector<float> xs, ys, oris;
+  const size_t count = to - from;
+  xs.resize(count);
+  ys.resize(count);
+  oris.resize(count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    const Entity &e = entities[from + i];
+    xs[i] = e.x;
+    ys[i] = e.y;
+    oris[i] = e.ori;
+  }
+  world.x.encode_batch(xs.data(), codes.farX.data() + from, count);
+  world.y.encode_batch(ys.data(), codes.farY.data() + from, count);
+  SnapshotOri::encode_batch(oris.data(), codes.ori.data() + from, count);
 }
 
-void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid)
+uint32_t pack_snapshot(const SnapshotCodes &codes, size_t idx, float x, float y,
+                       const SnapshotOrigin *origin)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  eid = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
+  uint32_t packed = uint32_t(codes.ori[idx]) << SNAPSHOT_ORI_SHIFT;
+  float dx = origin ? x - origin->x : 0.f;
+  float dy = origin ? y - origin->y : 0.f;
+  if (origin && dx >= SnapshotNearX::lo && dx <= SnapshotNearX::hi &&
+      dy >= SnapshotNearY::lo && dy <= SnapshotNearY::hi)
+  {
+    packed |= uint32_t(origin->epoch) << SNAPSHOT_EPOCH_SHIFT;
+    packed |= uint32_t(SnapshotNearX::encode(dx)) << SNAPSHOT_X_SHIFT;
+    packed |= uint32_t(SnapshotNearY::encode(dy)) << SNAPSHOT_Y_SHIFT;
+  }
+  else
+  {
+    packed |= 1u << SNAPSHOT_FAR_SHIFT;
+    packed |= uint32_t(codes.farX[idx]) << SNAPSHOT_X_SHIFT;
+    packed |= uint32_t(codes.farY[idx]) << SNAPSHOT_Y_SHIFT;
+  }
+  return packed;
+}
+
+bool unpack_snapshot(uint32_t packed, const SnapshotFrame &frame, float &x, float &y, float &ori)
+{
+  const uint32_t xCode = (packed >> SNAPSHOT_X_SHIFT) & SnapshotNearX::max_code;
+  const uint32_t yCode = (packed >> SNAPSHOT_Y_SHIFT) & SnapshotNearY::max_code;
+  if ((packed >> SNAPSHOT_FAR_SHIFT) & 1)
+  {
+    if (!frame.hasWorld)
+      return false;
+    x = frame.world.x.decode(uint16_t(xCode));
+    y = frame.world.y.decode(uint16_t(yCode));
+  }
+  else
+  {
+    // unsequenced snapshot that beat the reliable origin message here
+    const uint8_t epoch = (packed >> SNAPSHOT_EPOCH_SHIFT) & (SNAPSHOT_ORIGIN_EPOCHS - 1);
+    if (!frame.hasOrigin[epoch])
+      return false;
+    x = frame.origins[epoch].x + SnapshotNearX::decode(uint16_t(xCode));
+    y = frame.origins[epoch].y + SnapshotNearY::decode(uint16_t(yCode));
+  }
+  ori = SnapshotOri::decode(uint8_t(packed >> SNAPSHOT_ORI_SHIFT));
+  return true;
+}
+
+void send_despawn(ENetPeer *peer, const uint16_t *eids, uint16_t count)
+{
+  peer_send(peer, reliableChannel, create_despawn_packet(eids, count));
+}
+
+ENetPacket *create_despawn_packet(const uint16_t *eids, uint16_t count)
+{
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
+                                                   sizeof(uint16_t) * count,
+                                                   ENET_PACKET_FLAG_RELIABLE);
+  uint8_t *ptr = packet->data;
+  *ptr = E_SERVER_TO_CLIENT_DESPAWN; ptr += sizeof(uint8_t);
+  memcpy(ptr, &count, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  memcpy(ptr, eids, sizeof(uint16_t) * count); ptr += sizeof(uint16_t) * count;
+  return packet;
+}
+
+void send_world(ENetPeer *peer, const WorldBounds &bounds)
+{
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(WorldBounds),
+                                                   ENET_PACKET_FLAG_RELIABLE);
+  uint8_t *ptr = packet->data;
+  *ptr = E_SERVER_TO_CLIENT_WORLD; ptr += sizeof(uint8_t);
+  memcpy(ptr, &bounds, sizeof(WorldBounds)); ptr += sizeof(WorldBounds);
+
+  peer_send(peer, reliableChannel, packet);
+}
+
+void send_origin(ENetPeer *peer, const SnapshotOrigin &origin)
+{
+  peer_send(peer, reliableChannel, create_origin_packet(origin));
+}
+
+ENetPacket *create_origin_packet(const SnapshotOrigin &origin)
+{
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) * 2 + sizeof(float) * 2,
+                                                   ENET_PACKET_FLAG_RELIABLE);
+  uint8_t *ptr = packet->data;
+  *ptr = E_SERVER_TO_CLIENT_ORIGIN; ptr += sizeof(uint8_t);
+  *ptr = origin.epoch; ptr += sizeof(uint8_t);
+  memcpy(ptr, &origin.x, sizeof(float)); ptr += sizeof(float);
+  memcpy(ptr, &origin.y, sizeof(float)); ptr += sizeof(float);
+
+  return packet;
+}
+
+void snapshot_batch_planes(const SnapshotEntry *entries, size_t count, uint8_t *planes)
+{
+  uint16_t prevEid = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    uint16_t eidDelta = entries[i].eid - prevEid;
+    prevEid = entries[i].eid;
+    planes[i] = uint8_t(eidDelta);
+    planes[count + i] = uint8_t(eidDelta >> 8);
+    for (size_t b = 0; b < sizeof(uint32_t); ++b)
+      planes[(2 + b) * count + i] = uint8_t(entries[i].packed >> (8 * b));
+  }
+}
+
+ENetPacket *create_snapshot_batch_packet(SnapshotEntry *entries, size_t count,
+                                         const EntropyTable *tables)
+{
+  std::sort(entries, entries + count,
+            [](const SnapshotEntry &a, const SnapshotEntry &b) { return a.eid < b.eid; });
+  thread_local std::vector<uint8_t> planes, coded;
+  planes.resize(count * SNAPSHOT_ENTRY_SIZE);
+  snapshot_batch_planes(entries, count, planes.data());
+
+  SnapshotBatchCoding coding = E_SNAPSHOT_BATCH_RAW;
+  if (tables)
+  {
+    entropy_encode(planes.data(), count, SNAPSHOT_BATCH_PLANES, tables, coded);
+    if (coded.size() < planes.size())
+      coding = E_SNAPSHOT_BATCH_RANS;
+  }
+  const std::vector<uint8_t> &payload = coding == E_SNAPSHOT_BATCH_RANS ? coded : planes;
+  uint16_t count16 = uint16_t(count);
+
+  ENetPacket *packet = enet_packet_create(nullptr, SNAPSHOT_BATCH_HEADER_SIZE + payload.size(),
+                                                   ENET_PACKET_FLAG_UNSEQUENCED);
+  uint8_t *ptr = packet->data;
+  *ptr = E_SERVER_TO_CLIENT_SNAPSHOT_BATCH; ptr += sizeof(uint8_t);
+  *ptr = coding; ptr += sizeof(uint8_t);
+  memcpy(ptr, &count16, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  memcpy(ptr, payload.data(), payload.size()); ptr += payload.size();
+
+  return packet;
+}
+
+void count_snapshot_batch_symbols(const ENetPacket *packet, uint32_t (*counts)[256])
+{
+  const uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
+  if (*ptr != E_SNAPSHOT_BATCH_RAW)
+    return;
+  ptr += sizeof(uint8_t);
+  uint16_t count = 0;
+  memcpy(&count, ptr, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  entropy_count(ptr, count, SNAPSHOT_BATCH_PLANES, counts);
+}
+
+void send_entropy_tables(ENetPeer *peer, const EntropyTable *tables)
+{
+  peer_send(peer, reliableChannel, create_entropy_tables_packet(tables));
+}
+
+ENetPacket *create_entropy_tables_packet(const EntropyTable *tables)
+{
+  const size_t tableBytes = sizeof(tables[0].freq);
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + tableBytes * SNAPSHOT_BATCH_PLANES,
+                                                   ENET_PACKET_FLAG_RELIABLE);
+  uint8_t *ptr = packet->data;
+  *ptr = E_SERVER_TO_CLIENT_ENTROPY_TABLES; ptr += sizeof(uint8_t);
+  for (size_t p = 0; p < SNAPSHOT_BATCH_PLANES; ++p)
+  {
+    memcpy(ptr, tables[p].freq, tableBytes); ptr += tableBytes;
+  }
+  return packet;
+}
+
+MessageType get_packet_type(const ENetPacket *packet)
+{
+  if (!packet->dataLength || packet->data[0] >= E_MESSAGE_TYPE_COUNT)
+    return E_MESSAGE_TYPE_COUNT;
+  const MessageType type = MessageType(packet->data[0]);
+  const MessageSize &size = MESSAGE_SIZES[type];
+  if (packet->dataLength < size.min || packet->dataLength > size.max)
+    return E_MESSAGE_TYPE_COUNT;
+  return type;
+}
+
+void count_rejected(const ENetPacket *packet)
+{
+  rejected[metric_type(packet)].add();
+}
+
+bool deserialize_new_entity(ENetPacket *packet, Entity &ent)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(ent);
+  return reader.done();
+}
+
+bool deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(eid);
+  return reader.done();
 }
 
 void xor_packet_data(ENetPacket *packet, uint8_t *key_ptr)
@@ -134,47 +467,142 @@ void cipher_data(ENetPacket *packet)
   xor_packet_data(packet, (uint8_t*)&xorCipherKey);
 }
 
-void decipher_data(ENetPacket *packet, ENetPeer *peer)
+void decipher_data(ENetPacket *packet, uint32_t key)
 {
-  xor_packet_data(packet, (uint8_t*)peer->data);
+  xor_packet_data(packet, (uint8_t*)&key);
 }
 
-void deserialize_entity_input(ENetPacket *packet, uint16_t &eid, float &thr, float &steer)
+bool deserialize_entity_input(ENetPacket *packet, uint16_t &eid, InputHistory &inputs)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(eid);
+  reader.read(inputs.seq);
+  reader.read(inputs.count);
+  const uint8_t changed = reader.read<uint8_t>();
+  const uint8_t newest = reader.read<uint8_t>();
+  if (!reader.ok() || inputs.count == 0 || inputs.count > INPUT_REDUNDANCY ||
+      changed >> (inputs.count - 1))
+    return false;
+  inputs.codes[0] = newest;
+  for (size_t i = 1; i < inputs.count; ++i)
+    inputs.codes[i] = changed & (1 << (i - 1)) ? reader.read<uint8_t>() : inputs.codes[i - 1];
+  if (!reader.done())
+    return false;
+  // a controller is within [-1, 1], code 0 is the one below
+  for (size_t i = 0; i < inputs.count; ++i)
+    if (!(inputs.codes[i] >> 4) || !(inputs.codes[i] & 0x0f))
+      return false;
+  return true;
+}
 
-  eid = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  thr = *(float*)(ptr); ptr += sizeof(float);
-  steer = *(float*)(ptr); ptr += sizeof(float);
-  //uint8_t thrSteerPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  /*
-  uint8_t thrPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  uint8_t oriPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  */
-  /*
-  static uint8_t neutralPackedValue = pack_float<uint8_t>(0.f, -1.f, 1.f, 4);
-  float4bitsQuantized thrPacked(thrSteerPacked >> 4);
-  float4bitsQuantized steerPacked(thrSteerPacked & 0x0f);
-  thr = thrPacked.packedVal == neutralPackedValue ? 0.f : thrPacked.unpack(-1.f, 1.f);
-  steer = steerPacked.packedVal == neutralPackedValue ? 0.f : steerPacked.unpack(-1.f, 1.f);
-  */
-}
-
-void deserialize_snapshot(ENetPacket *packet, uint16_t &eid, float &x, float &y, float &ori)
+bool deserialize_snapshot(ENetPacket *packet, uint16_t &eid, uint32_t &packed)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  eid = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  uint16_t xPacked = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  uint16_t yPacked = *(uint16_t*)(ptr); ptr += sizeof(uint16_t);
-  uint8_t oriPacked = *(uint8_t*)(ptr); ptr += sizeof(uint8_t);
-  x = unpack_float<uint16_t>(xPacked, -16.f, 16.f, 11);
-  y = unpack_float<uint16_t>(yPacked, -8.f, 8.f, 10);
-  ori = unpack_float<uint8_t>(oriPacked, -PI, PI, 8);
+  // the hot one: a single size check instead of one per field, same cost as no checks
+  if (packet->dataLength != SNAPSHOT_PACKET_SIZE)
+    return false;
+  const uint8_t *ptr = packet->data + sizeof(uint8_t);
+  memcpy(&eid, ptr, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  memcpy(&packed, ptr, sizeof(uint32_t));
+  return true;
 }
 
-void deserialize_and_set_key(ENetPacket *packet)
+bool deserialize_and_set_key(ENetPacket *packet)
 {
-  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
-  xorCipherKey = *(uint32_t*)(ptr); ptr += sizeof(uint32_t);
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  uint32_t key = reader.read<uint32_t>();
+  if (!reader.done())
+    return false;
+  xorCipherKey = key;
+  return true;
+}
+
+bool deserialize_despawn(ENetPacket *packet, std::vector<uint16_t> &eids)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  uint16_t count = reader.read<uint16_t>();
+  const uint8_t *data = reader.read_bytes(sizeof(uint16_t) * count);
+  if (!reader.done())
+    return false;
+  eids.resize(count);
+  memcpy(eids.data(), data, sizeof(uint16_t) * count);
+  return true;
+}
+
+bool deserialize_world(ENetPacket *packet, WorldBounds &bounds)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  WorldBounds read = reader.read<WorldBounds>();
+  // the snapshot codecs divide by the extent
+  if (!reader.done() || !(read.maxX > read.minX) || !(read.maxY > read.minY))
+    return false;
+  bounds = read;
+  return true;
+}
+
+bool deserialize_origin(ENetPacket *packet, SnapshotOrigin &origin)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  origin.epoch = reader.read<uint8_t>() % SNAPSHOT_ORIGIN_EPOCHS;
+  reader.read(origin.x);
+  reader.read(origin.y);
+  return reader.done() && std::isfinite(origin.x) && std::isfinite(origin.y);
 }
 
+bool deserialize_snapshot_batch(ENetPacket *packet, const EntropyTable *tables,
+                                std::vector<SnapshotEntry> &entries)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  const uint8_t coding = reader.read<uint8_t>();
+  const uint16_t count = reader.read<uint16_t>();
+  const size_t payloadSize = reader.remaining();
+  const uint8_t *payload = reader.read_bytes(payloadSize);
+  // the server never sends more, a bigger count only makes the decoder spin
+  if (!reader.ok() || count > SNAPSHOT_BATCH_MAX_ENTRIES)
+    return false;
+
+  thread_local std::vector<uint8_t> decoded;
+  const uint8_t *planes = payload;
+  if (coding == E_SNAPSHOT_BATCH_RANS)
+  {
+    decoded.resize(size_t(count) * SNAPSHOT_ENTRY_SIZE);
+    if (!tables || !entropy_decode(payload, payloadSize, count, SNAPSHOT_BATCH_PLANES, tables,
+                                   decoded.data()))
+      return false;
+    planes = decoded.data();
+  }
+  else if (coding != E_SNAPSHOT_BATCH_RAW || payloadSize != size_t(count) * SNAPSHOT_ENTRY_SIZE)
+    return false;
+
+  entries.resize(count);
+  uint16_t eid = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    eid += uint16_t(planes[i] | planes[count + i] << 8);
+    entries[i].eid = eid;
+    entries[i].packed = 0;
+    for (size_t b = 0; b < sizeof(uint32_t); ++b)
+      entries[i].packed |= uint32_t(planes[(2 + b) * count + i]) << (8 * b);
+  }
+  return true;
+}
+
+bool deserialize_entropy_tables(ENetPacket *packet, EntropyTable *tables)
+{
+  const size_t tableBytes = sizeof(tables[0].freq);
+  if (packet->dataLength != sizeof(uint8_t) + tableBytes * SNAPSHOT_BATCH_PLANES)
+    return false;
+  uint8_t *ptr = packet->data; ptr += sizeof(uint8_t);
+  for (size_t p = 0; p < SNAPSHOT_BATCH_PLANES; ++p)
+  {
+    memcpy(tables[p].freq, ptr, tableBytes); ptr += tableBytes;
+    if (!entropy_finish_table(tables[p]))
+      return false;
+  }
+  return true;
+}
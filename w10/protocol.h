@@ -2,6 +2,9 @@
 #include <enet/enet.h>
 #include <cstdint>
 #include "entity.h"
+#include "quantisation.h"
+#include "entropy.h"
+#include <vector>
 
 enum MessageType : uint8_t
 {
@@ -10,24 +13,204 @@ enum MessageType : uint8_t
   E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY,
   E_CLIENT_TO_SERVER_INPUT,
   E_SERVER_TO_CLIENT_SNAPSHOT,
-  E_SERVER_TO_CLIENT_KEY
+  E_SERVER_TO_CLIENT_KEY,
+  E_SERVER_TO_CLIENT_DESPAWN,
+  E_SERVER_TO_CLIENT_WORLD,
+  E_SERVER_TO_CLIENT_ORIGIN,
+  E_SERVER_TO_CLIENT_SNAPSHOT_BATCH,
+  E_SERVER_TO_CLIENT_ENTROPY_TABLES,
+  E_MESSAGE_TYPE_COUNT
 };
 
+// Snapshot positions are encoded against an origin the server keeps per client close
+// to its entity. Inside the near window around it they are fine offsets, anything
+// further is a coarse absolute position within the world bounds sent at join, so the
+// world size doesn't cost bits. Origins are numbered by a 2 bit epoch and every
+// snapshot names the one it was encoded against.
+typedef Quantized<QRange<-16, 16>, 11> SnapshotNearX;
+typedef Quantized<QRange<-8, 8>, 10> SnapshotNearY;
+typedef QuantizedAngle<8> SnapshotOri;
+const uint8_t SNAPSHOT_ORIGIN_EPOCHS = 4;
+
+struct WorldBounds
+{
+  float minX = -16.f;
+  float minY = -8.f;
+  float maxX = 16.f;
+  float maxY = 8.f;
+};
+
+struct SnapshotWorld
+{
+  WorldBounds bounds;
+  QuantizedRange<SnapshotNearX::bits> x;
+  QuantizedRange<SnapshotNearY::bits> y;
+
+  void set(const WorldBounds &world_bounds);
+};
+
+struct SnapshotOrigin
+{
+  float x = 0.f;
+  float y = 0.f;
+  uint8_t epoch = 0;
+};
+
+// what a client needs to decode snapshots, filled by the world and origin messages
+struct SnapshotFrame
+{
+  SnapshotWorld world;
+  bool hasWorld = false;
+  SnapshotOrigin origins[SNAPSHOT_ORIGIN_EPOCHS];
+  bool hasOrigin[SNAPSHOT_ORIGIN_EPOCHS] = {};
+};
+
+// packed snapshot layout, low bits first: far flag, origin epoch, x, y, ori
+const int SNAPSHOT_FAR_SHIFT = 0;
+const int SNAPSHOT_EPOCH_SHIFT = 1;
+const int SNAPSHOT_X_SHIFT = 3;
+const int SNAPSHOT_Y_SHIFT = SNAPSHOT_X_SHIFT + SnapshotNearX::bits;
+const int SNAPSHOT_ORI_SHIFT = SNAPSHOT_Y_SHIFT + SnapshotNearY::bits;
+static_assert(SNAPSHOT_ORI_SHIFT + SnapshotOri::bits <= 32, "snapshot doesn't fit 32 bits");
+
+// type, eid, packed
+const size_t SNAPSHOT_PACKET_SIZE = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t);
+
+// Snapshots for one peer in one message: type, coding, entry count, then the entries
+// sorted by eid and split into byte planes (eid delta low/high, packed bytes 0-3) so
+// every plane keeps its own skew. Coded batches run the planes through rANS with the
+// tables the server trained on its first batches and sent at join.
+enum SnapshotBatchCoding : uint8_t
+{
+  E_SNAPSHOT_BATCH_RAW = 0,
+  E_SNAPSHOT_BATCH_RANS
+};
+struct SnapshotEntry
+{
+  uint16_t eid;
+  uint32_t packed;
+};
+const size_t SNAPSHOT_BATCH_PLANES = 6;
+const size_t SNAPSHOT_BATCH_HEADER_SIZE = sizeof(uint8_t) * 2 + sizeof(uint16_t);
+const size_t SNAPSHOT_ENTRY_SIZE = sizeof(uint16_t) + sizeof(uint32_t);
+// keeps a raw batch within one ENet fragment, bigger unsequenced packets go reliable
+const size_t SNAPSHOT_BATCH_MAX_ENTRIES = 192;
+
+// far positions and orientations, indexed like the entities; shared by every client
+struct SnapshotCodes
+{
+  std::vector<uint16_t> farX;
+  std::vector<uint16_t> farY;
+  std::vector<uint8_t> ori;
+};
+
+// Inputs go out once per client input tick, numbered, with the last few of them so a
+// lost packet is covered by the next one. Each input is thr and steer in sevenths as
+// 4 bit codes in a byte, so 0 and +-1 (all a keyboard gives) come back exact; code 0
+// is -8/7 and never sent. Older inputs are delta coded against the next newer one: a
+// bit mask says which differ and only those follow.
+//   type, eid, uint16 seq, uint8 count, uint8 changed mask, newest, changed older ones
+typedef BoundedInt<-8, 7> InputAxis;
+const float INPUT_AXIS_STEPS = 7.f;
+const size_t INPUT_REDUNDANCY = 8;
+const size_t INPUT_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint16_t) * 2 + sizeof(uint8_t) * 2;
+
+struct InputHistory
+{
+  uint16_t seq = 0; // of codes[0]
+  uint8_t count = 0;
+  uint8_t codes[INPUT_REDUNDANCY] = {}; // newest first
+};
+
+inline uint8_t pack_input(float thr, float steer)
+{
+  const int thrCode = int(roundf(clamp(thr, -1.f, 1.f) * INPUT_AXIS_STEPS));
+  const int steerCode = int(roundf(clamp(steer, -1.f, 1.f) * INPUT_AXIS_STEPS));
+  return uint8_t(InputAxis::encode(thrCode) << 4 | InputAxis::encode(steerCode));
+}
+
+inline void unpack_input(uint8_t code, float &thr, float &steer)
+{
+  thr = float(InputAxis::decode(code >> 4)) / INPUT_AXIS_STEPS;
+  steer = float(InputAxis::decode(code & 0x0f)) / INPUT_AXIS_STEPS;
+}
+
+// next input tick: numbers it and drops the oldest once the history is full
+void push_input(InputHistory &inputs, float thr, float steer);
+
+// enet_peer_send that also records the payload when a capture is running
+void peer_send(ENetPeer *peer, uint8_t channel, ENetPacket *packet);
+// channels the send_* helpers use, 0 and 1 unless the server's config moves them;
+// clients keep the defaults, a server always has at least those two channels open
+void set_channel_layout(uint8_t reliable, uint8_t unreliable);
+// the same packet to every peer: ENet only takes a reference per send, so the bytes are
+// built once however many peers get them; destroyed here if none of the sends took it
+void send_shared(ENetPeer *const *peers, size_t count, uint8_t channel, ENetPacket *packet);
+uint8_t reliable_channel();
+uint8_t unreliable_channel();
+// packets and bytes per message type both ways: peer_send counts what goes out,
+// received packets have to be passed to count_received
+void register_protocol_metrics();
+void count_received(const ENetPacket *packet);
 void send_join(ENetPeer *peer);
 void send_new_entity(ENetPeer *peer, const Entity &ent);
 void send_set_controlled_entity(ENetPeer *peer, uint16_t eid);
 void send_cipher_key(ENetPeer *peer, uint32_t key);
-void send_entity_input(ENetPeer *peer, uint16_t eid, float thr, float steer);
-void send_snapshot(ENetPeer *peer, uint16_t eid, float x, float y, float ori);
+void send_entity_input(ENetPeer *peer, uint16_t eid, const InputHistory &inputs);
+void send_snapshot(ENetPeer *peer, uint16_t eid, uint32_t packed);
+void send_despawn(ENetPeer *peer, const uint16_t *eids, uint16_t count);
+void send_world(ENetPeer *peer, const WorldBounds &bounds);
+void send_origin(ENetPeer *peer, const SnapshotOrigin &origin);
+// build packets without sending them, safe to call from job threads
+ENetPacket *create_snapshot_packet(uint16_t eid, uint32_t packed);
+ENetPacket *create_origin_packet(const SnapshotOrigin &origin);
+ENetPacket *create_new_entity_packet(const Entity &ent);
+ENetPacket *create_despawn_packet(const uint16_t *eids, uint16_t count);
+ENetPacket *create_entropy_tables_packet(const EntropyTable *tables);
+// sorts entries by eid, codes them if tables are given and that comes out smaller
+ENetPacket *create_snapshot_batch_packet(SnapshotEntry *entries, size_t count,
+                                         const EntropyTable *tables);
+void send_entropy_tables(ENetPeer *peer, const EntropyTable *tables);
+
+// entries (sorted by eid) as byte planes, count * SNAPSHOT_ENTRY_SIZE bytes
+void snapshot_batch_planes(const SnapshotEntry *entries, size_t count, uint8_t *planes);
+// adds the planes of a raw batch to counts[SNAPSHOT_BATCH_PLANES][256], coded ones are skipped
+void count_snapshot_batch_symbols(const ENetPacket *packet, uint32_t (*counts)[256]);
+
+// quantizes the shared part of entities [from, to) into codes (already sized), safe to
+// run chunks in parallel
+void quantize_snapshots(const std::vector<Entity> &entities, size_t from, size_t to,
+                        const SnapshotWorld &world, SnapshotCodes &codes);
+// entity `idx` as seen by one client: near offsets from `origin` if there is one and
+// the entity is inside its window, the tick's far codes otherwise
+uint32_t pack_snapshot(const SnapshotCodes &codes, size_t idx, float x, float y,
+                       const SnapshotOrigin *origin);
+// false if the snapshot refers to a world or origin the client doesn't have yet
+bool unpack_snapshot(uint32_t packed, const SnapshotFrame &frame, float &x, float &y, float &ori);
 
-MessageType get_packet_type(ENetPacket *packet);
+// E_MESSAGE_TYPE_COUNT for an empty packet, an unknown type or a size its type can't have
+MessageType get_packet_type(const ENetPacket *packet);
+// malformed packets by the type they claim, exported with the protocol metrics
+void count_rejected(const ENetPacket *packet);
 
-void deserialize_new_entity(ENetPacket *packet, Entity &ent);
-void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid);
-void deserialize_entity_input(ENetPacket *packet, uint16_t &eid, float &thr, float &steer);
-void deserialize_snapshot(ENetPacket *packet, uint16_t &eid, float &x, float &y, float &ori);
-void deserialize_and_set_key(ENetPacket *packet);
+// all false if the packet is malformed, the outputs may be partly written then
+bool deserialize_new_entity(ENetPacket *packet, Entity &ent);
+bool deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid);
+bool deserialize_entity_input(ENetPacket *packet, uint16_t &eid, InputHistory &inputs);
+bool deserialize_snapshot(ENetPacket *packet, uint16_t &eid, uint32_t &packed);
+bool deserialize_and_set_key(ENetPacket *packet);
+bool deserialize_despawn(ENetPacket *packet, std::vector<uint16_t> &eids);
+bool deserialize_world(ENetPacket *packet, WorldBounds &bounds);
+bool deserialize_origin(ENetPacket *packet, SnapshotOrigin &origin);
+// tables is nullptr until the client got them; false if the batch can't be read
+bool deserialize_snapshot_batch(ENetPacket *packet, const EntropyTable *tables,
+                                std::vector<SnapshotEntry> &entries);
+// false if the tables don't add up
+bool deserialize_entropy_tables(ENetPacket *packet, EntropyTable *tables);
 
+// corrupts a random byte of every input sent, off unless the client asks for it; the
+// link conditioner's --corrupt does the same to whole datagrams
+void set_input_fuzzing(bool enabled);
 void cipher_data(ENetPacket *packet);
-void decipher_data(ENetPacket *packet, ENetPeer *peer);
+void decipher_data(ENetPacket *packet, uint32_t key);
 
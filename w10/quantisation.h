@@ -1,6 +1,17 @@
 #pragma once
 #include "mathUtils.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define QUANTISATION_SSE 1
+#else
+#define QUANTISATION_SSE 0
+#endif
 
 template<typename T>
 T pack_float(float v, float lo, float hi, int num_bits)
@@ -30,3 +41,333 @@ struct PackedFloat
 
 typedef PackedFloat<uint8_t, 4> float4bitsQuantized;
 
+// Compile time codecs. Everything derived from the range and bit count (code count,
+// scale and its reciprocal) is a constant, encode and decode are a clamp and one
+// multiply-add. Ranges are types since float template arguments need C++20:
+// QRange<-16, 16> is [-16, 16], QRange<-1, 1, 2> is [-0.5, 0.5].
+template<int Lo, int Hi, int Den = 1>
+struct QRange
+{
+  static_assert(Lo < Hi && Den > 0, "empty range");
+  static constexpr float lo = float(Lo) / Den;
+  static constexpr float hi = float(Hi) / Den;
+};
+
+// smallest unsigned type holding `bits` bits
+template<int bits>
+using quant_storage_t =
+  typename std::conditional<(bits <= 8), uint8_t,
+  typename std::conditional<(bits <= 16), uint16_t,
+  typename std::conditional<(bits <= 32), uint32_t, uint64_t>::type>::type>::type;
+
+constexpr int quant_bits_for(uint32_t max_value)
+{
+  return max_value == 0 ? 0 : 1 + quant_bits_for(max_value >> 1);
+}
+
+namespace quant_detail
+{
+#if QUANTISATION_SSE
+// four int32 codes, each known to fit T, to/from memory
+inline void store4(__m128i v, uint8_t *out)
+{
+  v = _mm_packs_epi32(v, v);
+  v = _mm_packus_epi16(v, v);
+  int32_t packed = _mm_cvtsi128_si32(v);
+  memcpy(out, &packed, sizeof(packed));
+}
+
+inline void store4(__m128i v, uint16_t *out)
+{
+  // sign extend the low halves so the saturating pack keeps codes above 0x7fff intact
+  v = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+  _mm_storel_epi64((__m128i*)out, _mm_packs_epi32(v, v));
+}
+
+inline void store4(__m128i v, uint32_t *out) { _mm_storeu_si128((__m128i*)out, v); }
+
+inline __m128i load4(const uint8_t *in)
+{
+  int32_t packed;
+  memcpy(&packed, in, sizeof(packed));
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+  return _mm_unpacklo_epi16(v, zero);
+}
+
+inline __m128i load4(const uint16_t *in)
+{
+  return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)in), _mm_setzero_si128());
+}
+
+inline __m128i load4(const uint32_t *in) { return _mm_loadu_si128((const __m128i*)in); }
+#endif
+
+// (clamp(v, lo, hi) - lo) * scale rounded, four lanes at a time where there is SSE2
+template<typename T>
+void encode_linear(const float *v, T *out, size_t count, float lo, float hi, float scale)
+{
+  size_t i = 0;
+#if QUANTISATION_SSE
+  const __m128 loV = _mm_set1_ps(lo);
+  const __m128 hiV = _mm_set1_ps(hi);
+  const __m128 scaleV = _mm_set1_ps(scale);
+  const __m128 half = _mm_set1_ps(0.5f);
+  for (; i + 4 <= count; i += 4)
+  {
+    // max first, so NaN ends up at lo like it would in the scalar clamp
+    __m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(v + i), loV), hiV);
+    c = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(c, loV), scaleV), half);
+    store4(_mm_cvttps_epi32(c), out + i);
+  }
+#endif
+  for (; i < count; ++i)
+    out[i] = T((clamp(v[i], lo, hi) - lo) * scale + 0.5f);
+}
+
+template<typename T>
+void decode_linear(const T *c, float *out, size_t count, float lo, float step)
+{
+  size_t i = 0;
+#if QUANTISATION_SSE
+  const __m128 loV = _mm_set1_ps(lo);
+  const __m128 stepV = _mm_set1_ps(step);
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 v = _mm_cvtepi32_ps(load4(c + i));
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(v, stepV), loV));
+  }
+#endif
+  for (; i < count; ++i)
+    out[i] = float(c[i]) * step + lo;
+}
+}
+
+// float in [lo, hi] as an unsigned Bits wide code, both ends representable
+template<typename Range, int Bits>
+struct Quantized
+{
+  // codes go through float and int32 in the batch paths
+  static_assert(Bits > 0 && Bits <= 24, "1 to 24 bits");
+  typedef quant_storage_t<Bits> storage_t;
+
+  static constexpr int bits = Bits;
+  static constexpr float lo = Range::lo;
+  static constexpr float hi = Range::hi;
+  static constexpr uint32_t max_code = (1u << Bits) - 1;
+  static constexpr float scale = max_code / (hi - lo);
+  static constexpr float step = (hi - lo) / max_code;
+
+  static storage_t encode(float v) { return storage_t((clamp(v, lo, hi) - lo) * scale + 0.5f); }
+  static float decode(storage_t c) { return float(c) * step + lo; }
+
+  static void encode_batch(const float *v, storage_t *out, size_t count)
+  {
+    quant_detail::encode_linear(v, out, count, lo, hi, scale);
+  }
+  static void decode_batch(const storage_t *c, float *out, size_t count)
+  {
+    quant_detail::decode_linear(c, out, count, lo, step);
+  }
+};
+
+// Quantized with the range known only at runtime (world bounds, say), scale and step
+// are computed once when the range is set
+template<int Bits>
+struct QuantizedRange
+{
+  static_assert(Bits > 0 && Bits <= 24, "1 to 24 bits");
+  typedef quant_storage_t<Bits> storage_t;
+
+  static constexpr int bits = Bits;
+  static constexpr uint32_t max_code = (1u << Bits) - 1;
+
+  float lo = 0.f;
+  float hi = 1.f;
+  float scale = max_code;
+  float step = 1.f / max_code;
+
+  QuantizedRange() = default;
+  QuantizedRange(float range_lo, float range_hi) { set(range_lo, range_hi); }
+
+  void set(float range_lo, float range_hi)
+  {
+    lo = range_lo;
+    hi = range_hi;
+    scale = max_code / (hi - lo);
+    step = (hi - lo) / max_code;
+  }
+
+  storage_t encode(float v) const { return storage_t((clamp(v, lo, hi) - lo) * scale + 0.5f); }
+  float decode(storage_t c) const { return float(c) * step + lo; }
+
+  void encode_batch(const float *v, storage_t *out, size_t count) const
+  {
+    quant_detail::encode_linear(v, out, count, lo, hi, scale);
+  }
+  void decode_batch(const storage_t *c, float *out, size_t count) const
+  {
+    quant_detail::decode_linear(c, out, count, lo, step);
+  }
+};
+
+// angle of any magnitude, wrapped to [-PI, PI); the range is periodic so all 2^Bits
+// codes are distinct angles instead of -PI and PI taking one each
+template<int Bits>
+struct QuantizedAngle
+{
+  static_assert(Bits > 0 && Bits <= 24, "1 to 24 bits");
+  typedef quant_storage_t<Bits> storage_t;
+
+  static constexpr int bits = Bits;
+  static constexpr uint32_t mask = (1u << Bits) - 1;
+  static constexpr float scale = (1u << Bits) / (2.f * PI);
+  static constexpr float step = (2.f * PI) / (1u << Bits);
+
+  static storage_t encode(float a)
+  {
+    return storage_t(int32_t(floorf((a + PI) * scale + 0.5f)) & mask);
+  }
+  static float decode(storage_t c) { return float(c) * step - PI; }
+
+  static void encode_batch(const float *a, storage_t *out, size_t count)
+  {
+    size_t i = 0;
+#if QUANTISATION_SSE
+    const __m128 piV = _mm_set1_ps(PI);
+    const __m128 scaleV = _mm_set1_ps(scale);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i maskV = _mm_set1_epi32(int32_t(mask));
+    for (; i + 4 <= count; i += 4)
+    {
+      __m128 t = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(a + i), piV), scaleV), half);
+      // floor without SSE4.1: truncate, then step down where that rounded up
+      __m128i c = _mm_cvttps_epi32(t);
+      c = _mm_add_epi32(c, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(c), t)));
+      quant_detail::store4(_mm_and_si128(c, maskV), out + i);
+    }
+#endif
+    for (; i < count; ++i)
+      out[i] = encode(a[i]);
+  }
+
+  static void decode_batch(const storage_t *c, float *out, size_t count)
+  {
+    size_t i = 0;
+#if QUANTISATION_SSE
+    const __m128 piV = _mm_set1_ps(PI);
+    const __m128 stepV = _mm_set1_ps(step);
+    for (; i + 4 <= count; i += 4)
+    {
+      __m128 v = _mm_cvtepi32_ps(quant_detail::load4(c + i));
+      _mm_storeu_ps(out + i, _mm_sub_ps(_mm_mul_ps(v, stepV), piV));
+    }
+#endif
+    for (; i < count; ++i)
+      out[i] = decode(c[i]);
+  }
+};
+
+// per axis codecs packed into one integer, x in the low bits
+template<typename CodecX, typename CodecY>
+struct QuantizedVec2
+{
+  typedef quant_storage_t<CodecX::bits + CodecY::bits> storage_t;
+  static constexpr int bits = CodecX::bits + CodecY::bits;
+
+  static storage_t encode(float x, float y)
+  {
+    return storage_t(storage_t(CodecX::encode(x)) | storage_t(CodecY::encode(y)) << CodecX::bits);
+  }
+  static void decode(storage_t c, float &x, float &y)
+  {
+    x = CodecX::decode(typename CodecX::storage_t(c & ((storage_t(1) << CodecX::bits) - 1)));
+    y = CodecY::decode(typename CodecY::storage_t(c >> CodecX::bits));
+  }
+};
+
+template<typename Codec>
+struct QuantizedVec3
+{
+  typedef quant_storage_t<Codec::bits * 3> storage_t;
+  static constexpr int bits = Codec::bits * 3;
+  static constexpr storage_t axis_mask = (storage_t(1) << Codec::bits) - 1;
+
+  static storage_t encode(float x, float y, float z)
+  {
+    return storage_t(storage_t(Codec::encode(x)) |
+                     storage_t(Codec::encode(y)) << Codec::bits |
+                     storage_t(Codec::encode(z)) << (Codec::bits * 2));
+  }
+  static void decode(storage_t c, float &x, float &y, float &z)
+  {
+    x = Codec::decode(typename Codec::storage_t(c & axis_mask));
+    y = Codec::decode(typename Codec::storage_t((c >> Codec::bits) & axis_mask));
+    z = Codec::decode(typename Codec::storage_t((c >> (Codec::bits * 2)) & axis_mask));
+  }
+};
+
+// Unit quaternion {x, y, z, w} as "smallest three": the index of the largest
+// component in 2 bits, the other three in Bits each. q and -q are the same rotation,
+// so the largest is made positive and rebuilt from the unit length on decode; the
+// other three can't exceed 1/sqrt(2) in magnitude.
+template<int Bits>
+struct QuantizedQuat
+{
+  struct ComponentRange
+  {
+    static constexpr float lo = -0.707106781f;
+    static constexpr float hi = 0.707106781f;
+  };
+  typedef Quantized<ComponentRange, Bits> Component;
+  typedef quant_storage_t<2 + Bits * 3> storage_t;
+  static constexpr int bits = 2 + Bits * 3;
+  static constexpr storage_t component_mask = (storage_t(1) << Bits) - 1;
+
+  static storage_t encode(const float q[4])
+  {
+    int largest = 0;
+    for (int i = 1; i < 4; ++i)
+      if (fabsf(q[i]) > fabsf(q[largest]))
+        largest = i;
+    const float sgn = q[largest] < 0.f ? -1.f : 1.f;
+    storage_t c = storage_t(largest);
+    int shift = 2;
+    for (int i = 0; i < 4; ++i)
+    {
+      if (i == largest)
+        continue;
+      c |= storage_t(Component::encode(q[i] * sgn)) << shift;
+      shift += Bits;
+    }
+    return c;
+  }
+
+  static void decode(storage_t c, float q[4])
+  {
+    const int largest = int(c & 3);
+    float sumSq = 0.f;
+    int shift = 2;
+    for (int i = 0; i < 4; ++i)
+    {
+      if (i == largest)
+        continue;
+      q[i] = Component::decode(typename Component::storage_t((c >> shift) & component_mask));
+      sumSq += q[i] * q[i];
+      shift += Bits;
+    }
+    q[largest] = sqrtf(sumSq < 1.f ? 1.f - sumSq : 0.f);
+  }
+};
+
+// integer in [Lo, Hi] in just enough bits for the span
+template<int Lo, int Hi>
+struct BoundedInt
+{
+  static_assert(Lo <= Hi, "empty range");
+  static constexpr int bits = quant_bits_for(uint32_t(int64_t(Hi) - Lo));
+  typedef quant_storage_t<bits> storage_t;
+
+  static storage_t encode(int v) { return storage_t(int64_t(v < Lo ? Lo : v > Hi ? Hi : v) - Lo); }
+  static int decode(storage_t c) { return int(int64_t(c) + Lo); }
+};
@@ -0,0 +1,184 @@
+// Round trip and speed of the codecs snapshots and inputs go through. Every codec has
+// its ends, zero, values past the range and NaN checked against the scalar and the
+// batch path, then random values have to come back within half a step and the batch
+// path has to give the same codes as the scalar one. Fails on any mismatch.
+//
+// build with: quantisation_bench.cpp (header only codecs) + enet headers
+// usage: quantisation_bench [values] [rounds]
+#include "protocol.h"
+#include "quantisation.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+
+static size_t failures = 0;
+
+static void expect(bool ok, const char *codec, const char *what, float v)
+{
+  if (ok)
+    return;
+  printf("%s: %s (value %g)\n", codec, what, v);
+  ++failures;
+}
+
+// scalar and batch codes for one value, the batch one taken from a lane of a full
+// SSE block so the vector path is the one checked
+template<typename Codec>
+static typename Codec::storage_t encode_both(const Codec &codec, float v, const char *name)
+{
+  typedef typename Codec::storage_t storage_t;
+  const float in[4] = {v, v, v, v};
+  storage_t out[4];
+  codec.encode_batch(in, out, 4);
+  const storage_t c = codec.encode(v);
+  expect(out[0] == c && out[3] == c, name, "batch encode differs from scalar", v);
+  float back[4];
+  codec.decode_batch(out, back, 4);
+  expect(back[0] == codec.decode(c), name, "batch decode differs from scalar", v);
+  return c;
+}
+
+template<typename Codec>
+static void check_linear(const Codec &codec, const char *name, std::mt19937 &gen)
+{
+  const float tolerance = codec.step * 0.5f + (codec.hi - codec.lo) * 1e-6f;
+  expect(encode_both(codec, codec.lo, name) == 0, name, "lo isn't code 0", codec.lo);
+  expect(codec.decode(0) == codec.lo, name, "code 0 isn't lo", codec.lo);
+  expect(encode_both(codec, codec.hi, name) == Codec::max_code, name, "hi isn't the top code", codec.hi);
+  expect(fabsf(codec.decode(Codec::max_code) - codec.hi) <= tolerance, name, "top code isn't hi",
+         codec.hi);
+  if (codec.lo <= 0.f && codec.hi >= 0.f)
+    expect(fabsf(codec.decode(encode_both(codec, 0.f, name))) <= tolerance, name,
+           "zero is off by more than half a step", 0.f);
+  const float span = codec.hi - codec.lo;
+  expect(encode_both(codec, codec.lo - span, name) == 0, name, "below lo doesn't clamp", codec.lo - span);
+  expect(encode_both(codec, codec.hi + span, name) == Codec::max_code, name, "above hi doesn't clamp",
+         codec.hi + span);
+  expect(encode_both(codec, -std::numeric_limits<float>::infinity(), name) == 0, name,
+         "-inf doesn't clamp", -std::numeric_limits<float>::infinity());
+  expect(encode_both(codec, std::numeric_limits<float>::infinity(), name) == Codec::max_code, name,
+         "inf doesn't clamp", std::numeric_limits<float>::infinity());
+  expect(encode_both(codec, std::numeric_limits<float>::quiet_NaN(), name) == 0, name,
+         "NaN isn't code 0", std::numeric_limits<float>::quiet_NaN());
+
+  std::uniform_real_distribution<float> inRange(codec.lo, codec.hi);
+  for (int i = 0; i < 10000; ++i)
+  {
+    const float v = inRange(gen);
+    if (fabsf(codec.decode(encode_both(codec, v, name)) - v) > tolerance)
+    {
+      expect(false, name, "round trip is off by more than half a step", v);
+      break;
+    }
+  }
+}
+
+template<typename Codec>
+static void check_angle(const char *name, std::mt19937 &gen)
+{
+  const Codec codec;
+  const float tolerance = Codec::step * 0.5f + 1e-5f;
+  // distance on the circle, so -PI and PI are the same place
+  auto angle_error = [](float a, float b) { return fabsf(remainderf(a - b, 2.f * PI)); };
+  expect(encode_both(codec, -PI, name) == 0, name, "-PI isn't code 0", -PI);
+  expect(encode_both(codec, PI, name) == 0, name, "PI doesn't wrap to -PI", PI);
+  expect(codec.decode(0) == -PI, name, "code 0 isn't -PI", -PI);
+  expect(angle_error(codec.decode(Codec::mask), PI - Codec::step) <= 1e-5f, name,
+         "top code isn't one step short of PI", PI);
+  expect(angle_error(codec.decode(encode_both(codec, 0.f, name)), 0.f) <= tolerance, name,
+         "zero is off by more than half a step", 0.f);
+  for (float v : {3.f * PI, -3.f * PI, 10.f, -10.f, 100.f})
+    expect(angle_error(codec.decode(encode_both(codec, v, name)), v) <= tolerance + fabsf(v) * 1e-6f,
+           name, "out of range angle doesn't wrap", v);
+
+  std::uniform_real_distribution<float> inRange(-PI, PI);
+  for (int i = 0; i < 10000; ++i)
+  {
+    const float v = inRange(gen);
+    if (angle_error(codec.decode(encode_both(codec, v, name)), v) > tolerance)
+    {
+      expect(false, name, "round trip is off by more than half a step", v);
+      break;
+    }
+  }
+}
+
+static void check_input_axis()
+{
+  const char *name = "InputAxis";
+  for (int v = -8; v <= 7; ++v)
+    expect(InputAxis::decode(InputAxis::encode(v)) == v, name, "in range value doesn't come back", float(v));
+  expect(InputAxis::encode(-8) == 0, name, "lo isn't code 0", -8.f);
+  expect(InputAxis::encode(7) == (1 << InputAxis::bits) - 1, name, "hi isn't the top code", 7.f);
+  expect(InputAxis::decode(InputAxis::encode(-100)) == -8, name, "below lo doesn't clamp", -100.f);
+  expect(InputAxis::decode(InputAxis::encode(100)) == 7, name, "above hi doesn't clamp", 100.f);
+}
+
+template<typename Codec>
+static void time_codec(const Codec &codec, const char *name, const std::vector<float> &values,
+                       int rounds)
+{
+  std::vector<typename Codec::storage_t> codes(values.size());
+  std::vector<float> decoded(values.size());
+  double scalarNs = 0.0;
+  double batchNs = 0.0;
+  for (int r = 0; r < rounds; ++r)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < values.size(); ++i)
+      codes[i] = codec.encode(values[i]);
+    for (size_t i = 0; i < values.size(); ++i)
+      decoded[i] = codec.decode(codes[i]);
+    scalarNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    codec.encode_batch(values.data(), codes.data(), values.size());
+    codec.decode_batch(codes.data(), decoded.data(), values.size());
+    batchNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  }
+  const double perValue = double(values.size()) * rounds;
+  printf("%-14s %2d bits, encode + decode scalar %.2f ns, batch %.2f ns per value\n", name,
+         Codec::bits, scalarNs / perValue, batchNs / perValue);
+}
+
+int main(int argc, const char **argv)
+{
+  const size_t valueCount = argc > 1 ? size_t(atoi(argv[1])) : 4096;
+  const int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+
+  std::mt19937 gen(42);
+  // the entropy bench's world, far positions are coded against it
+  WorldBounds bounds = {-256.f, -128.f, 256.f, 128.f};
+  const QuantizedRange<SnapshotNearX::bits> farX(bounds.minX, bounds.maxX);
+  const QuantizedRange<SnapshotNearY::bits> farY(bounds.minY, bounds.maxY);
+
+  check_linear(SnapshotNearX(), "SnapshotNearX", gen);
+  check_linear(SnapshotNearY(), "SnapshotNearY", gen);
+  check_linear(farX, "far x", gen);
+  check_linear(farY, "far y", gen);
+  check_angle<SnapshotOri>("SnapshotOri", gen);
+  check_input_axis();
+  if (failures)
+  {
+    printf("%zu checks failed\n", failures);
+    return 1;
+  }
+  printf("round trips, ends, zero and out of range values all check out\n");
+
+  std::uniform_real_distribution<float> unit(-1.f, 1.f);
+  std::vector<float> values(valueCount);
+  for (float &v : values)
+    v = unit(gen) * 20.f;
+  time_codec(SnapshotNearX(), "SnapshotNearX", values, rounds);
+  time_codec(SnapshotNearY(), "SnapshotNearY", values, rounds);
+  for (float &v : values)
+    v = unit(gen) * bounds.maxX;
+  time_codec(farX, "far x", values, rounds);
+  for (float &v : values)
+    v = unit(gen) * 4.f;
+  time_codec(SnapshotOri(), "SnapshotOri", values, rounds);
+  return 0;
+}
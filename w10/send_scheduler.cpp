@@ -0,0 +1,146 @@
+#include "send_scheduler.h"
+#include "mathUtils.h"
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+
+const float MAX_BYTES_PER_SECOND = 64.f * 1024.f;
+const float MIN_BYTES_PER_SECOND = 2.f * 1024.f;
+const float BUDGET_RECOVERY = 8.f * 1024.f; // bytes/s regained per second on a clean link
+const float MAX_BURST_SECONDS = 0.25f;
+
+static float minSendInterval = 0.01f; // 1 / send rate, at most the server loop rate
+const float MAX_SEND_INTERVAL = 0.1f;
+const float GOOD_RTT_MS = 80.f;
+
+const float CONTROLLED_WEIGHT = 1000.f;
+const float NEAR_RADIUS = 4.f;
+
+void scheduler_set_max_rate(uint32_t sends_per_second)
+{
+  minSendInterval = 1.f / float(sends_per_second);
+}
+
+void scheduler_reset(PeerSendState &state)
+{
+  state = PeerSendState();
+  state.bytesPerSecond = MAX_BYTES_PER_SECOND;
+  state.tokens = MAX_BYTES_PER_SECOND * minSendInterval;
+  state.sendInterval = minSendInterval;
+}
+
+bool scheduler_update(PeerSendState &state, const ENetPeer &peer, float dt)
+{
+  float throttle = float(peer.packetThrottle) / ENET_PEER_PACKET_THROTTLE_SCALE;
+  float loss = float(peer.packetLoss) / ENET_PEER_PACKET_LOSS_SCALE;
+  float rtt = float(peer.roundTripTime);
+
+  // drop right away when the link complains, grow back slowly
+  float target = MAX_BYTES_PER_SECOND * clamp(throttle, 0.f, 1.f) * (1.f - clamp(loss * 5.f, 0.f, 0.8f));
+  if (peer.incomingBandwidth > 0)
+    target = std::min(target, float(peer.incomingBandwidth));
+  target = clamp(target, MIN_BYTES_PER_SECOND, MAX_BYTES_PER_SECOND);
+  if (target < state.bytesPerSecond)
+    state.bytesPerSecond = target;
+  else
+    state.bytesPerSecond = move_to(state.bytesPerSecond, target, dt, BUDGET_RECOVERY);
+
+  float slowdown = 1.f + std::max(rtt - GOOD_RTT_MS, 0.f) / 50.f + loss * 20.f;
+  state.sendInterval = clamp(minSendInterval * slowdown, minSendInterval,
+                             std::max(minSendInterval, MAX_SEND_INTERVAL));
+
+  state.tokens = std::min(state.tokens + state.bytesPerSecond * dt,
+                          state.bytesPerSecond * MAX_BURST_SECONDS);
+
+  state.statTime += dt;
+  if (state.statTime >= 1.f)
+  {
+    state.effectiveBytesPerSecond = state.statBytes / state.statTime;
+    state.effectiveSnapshotRate = state.statSnapshots / state.statTime;
+    state.statTime = 0.f;
+    state.statBytes = 0;
+    state.statSnapshots = 0;
+  }
+
+  state.sinceLastSend += dt;
+  if (state.sinceLastSend < state.sendInterval)
+    return false;
+  state.sinceLastSend = 0.f;
+  return true;
+}
+
+static size_t messages_for(size_t count, size_t max_entries)
+{
+  return (count + max_entries - 1) / max_entries;
+}
+
+size_t scheduler_select(PeerSendState &state, const std::vector<Entity> &entities,
+                        uint16_t controlled_eid, size_t entry_bytes, size_t header_bytes,
+                        size_t max_entries, std::vector<size_t> &selected)
+{
+  selected.clear();
+  state.priority.resize(entities.size(), 0.f);
+
+  const Entity *viewer = nullptr;
+  for (const Entity &e : entities)
+    if (e.eid == controlled_eid)
+      viewer = &e;
+
+  for (size_t i = 0; i < entities.size(); ++i)
+  {
+    const Entity &e = entities[i];
+    float weight = 1.f;
+    if (e.eid == controlled_eid)
+      weight = CONTROLLED_WEIGHT;
+    else if (viewer)
+    {
+      float dx = e.x - viewer->x;
+      float dy = e.y - viewer->y;
+      weight = 1.f / (1.f + sqrtf(dx * dx + dy * dy) / NEAR_RADIUS);
+    }
+    state.priority[i] += weight;
+  }
+
+  // every message pays the header and the send overhead, full ones first
+  const size_t overhead = header_bytes + ENET_SEND_OVERHEAD;
+  const size_t fullMessage = overhead + max_entries * entry_bytes;
+  const size_t budget = state.tokens > 0.f ? size_t(state.tokens) : 0;
+  const size_t left = budget % fullMessage;
+  size_t fits = budget / fullMessage * max_entries;
+  if (left > overhead)
+    fits += (left - overhead) / entry_bytes;
+  size_t count = std::min(fits, entities.size());
+  if (count == 0)
+    return 0;
+
+  selected.resize(entities.size());
+  std::iota(selected.begin(), selected.end(), size_t(0));
+  std::partial_sort(selected.begin(), selected.begin() + count, selected.end(),
+                    [&state](size_t a, size_t b) { return state.priority[a] > state.priority[b]; });
+  selected.resize(count);
+
+  for (size_t idx : selected)
+    state.priority[idx] = 0.f;
+  const size_t cost = messages_for(count, max_entries) * overhead + count * entry_bytes;
+  state.tokens -= float(cost);
+  state.statBytes += uint32_t(cost);
+  ++state.statSnapshots;
+  return cost;
+}
+
+void scheduler_settle(PeerSendState &state, size_t charged, size_t sent)
+{
+  state.tokens += float(charged) - float(sent);
+  if (sent >= charged)
+    state.statBytes += uint32_t(sent - charged);
+  else
+    state.statBytes -= std::min(state.statBytes, uint32_t(charged - sent));
+}
+
+void scheduler_report(const PeerSendState &state, const ENetPeer &peer)
+{
+  printf("%x:%u rtt %u ms, loss %.1f%%, budget %.0f B/s, sent %.0f B/s at %.1f Hz\n",
+         peer.address.host, peer.address.port, peer.roundTripTime,
+         100.f * peer.packetLoss / ENET_PEER_PACKET_LOSS_SCALE,
+         state.bytesPerSecond, state.effectiveBytesPerSecond, state.effectiveSnapshotRate);
+}
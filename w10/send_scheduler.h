@@ -0,0 +1,46 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+
+const size_t ENET_SEND_OVERHEAD = 8; // unsequenced send command header
+
+// Per-peer congestion aware snapshot scheduling. Every peer owns a byte budget
+// (token bucket) that follows ENet's throttle, loss and RTT estimates, and a snapshot
+// interval that stretches on bad links. Entities compete for the budget through
+// priority accumulators, so the controlled and nearby ones go out first and the far
+// ones still get their turn eventually.
+struct PeerSendState
+{
+  float bytesPerSecond = 0.f;
+  float tokens = 0.f;
+  float sendInterval = 0.f;
+  float sinceLastSend = 0.f;
+  std::vector<float> priority; // indexed like the entities vector
+
+  // stats over the current report window
+  float statTime = 0.f;
+  uint32_t statBytes = 0;
+  uint32_t statSnapshots = 0;
+  float effectiveBytesPerSecond = 0.f;
+  float effectiveSnapshotRate = 0.f;
+};
+
+// snapshots per second a peer gets on a good link, set once before any session opens
+void scheduler_set_max_rate(uint32_t sends_per_second);
+void scheduler_reset(PeerSendState &state);
+// adapts the budget and the interval to the link, returns true if a snapshot is due
+bool scheduler_update(PeerSendState &state, const ENetPeer &peer, float dt);
+// fills `selected` with entity indices to send this time, highest priority first,
+// and charges them to the budget; `entry_bytes` is the payload of one entity update,
+// `header_bytes` what each message carrying them adds, a message carries at most
+// `max_entries`. Returns the bytes charged
+size_t scheduler_select(PeerSendState &state, const std::vector<Entity> &entities,
+                        uint16_t controlled_eid, size_t entry_bytes, size_t header_bytes,
+                        size_t max_entries, std::vector<size_t> &selected);
+// squares what scheduler_select charged with what went out, each packet's data plus
+// ENET_SEND_OVERHEAD: gives back what compression saved, takes anything over
+void scheduler_settle(PeerSendState &state, size_t charged, size_t sent);
+
+void scheduler_report(const PeerSendState &state, const ENetPeer &peer);
@@ -3,25 +3,118 @@
 #include "entity.h"
 #include "protocol.h"
 #include "mathUtils.h"
+#include "job_system.h"
+#include "peer_session.h"
+#include "eid_allocator.h"
+#include "capture.h"
+#include "metrics.h"
+#include "lobby_link.h"
+#include "server_config.h"
+#include "crc32c.h"
 #include <stdlib.h>
+#include <csignal>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 #include <vector>
-#include <map>
 #include <random>
 
 static std::vector<Entity> entities;
-static std::map<uint16_t, ENetPeer*> controlledMap;
+static EidAllocator eidAllocator;
+// eid_index -> position in entities, keeps lookups O(1) while removals swap-and-pop
+static std::vector<uint32_t> entitySlot(EID_INDEX_MASK, UINT32_MAX);
+static std::vector<uint16_t> pendingDespawns;
+static SnapshotWorld world;
+// quantized once per tick, every peer's snapshots copy from here
+static SnapshotCodes snapshotCodes;
+// the first batches go out raw and train the tables, later ones are coded
+static bool entropyCoding = true;
+static bool entropyReady = false;
+static EntropyTable entropyTables[SNAPSHOT_BATCH_PLANES];
+static uint32_t entropyCounts[SNAPSHOT_BATCH_PLANES][256];
+static size_t entropyTrainedBytes = 0;
 
-void on_join(ENetPacket *packet, ENetPeer *peer, ENetHost *host)
+static MetricHistogram tickDuration; // us
+static MetricGauge entityCount;
+static MetricGauge peerCount;
+static MetricGauge sessionsUsed;
+static MetricGauge sessionsSize;
+static MetricGauge eidsUsed;
+static MetricGauge eidsSize;
+static std::vector<MetricGauge> peerRtt; // ms, by incomingPeerID
+static std::vector<MetricGauge> peerLoss; // ENET_PEER_PACKET_LOSS_SCALE
+static MetricCounter inputsReceived;
+static MetricCounter inputsLost;
+static MetricCounter inputPacketsStale;
+
+const size_t SIMULATE_GRAIN = 256;
+
+static WorldBounds worldBounds;
+// a peer's origin follows its entity once it is this far off, half the near window
+const float ORIGIN_RECENTER_X = SnapshotNearX::hi * 0.5f;
+const float ORIGIN_RECENTER_Y = SnapshotNearY::hi * 0.5f;
+// and no more often than this, so the peer has the previous origin before its epoch
+// comes round again
+const float ORIGIN_MIN_INTERVAL = 0.25f;
+const size_t ENTROPY_TRAIN_BYTES = 256 * 1024;
+
+// every connected peer, for the messages that go out the same to all of them
+static const std::vector<ENetPeer*> &connected_peers()
+{
+  static std::vector<ENetPeer*> peers;
+  peers.clear();
+  for (size_t i = 0; i < session_count(); ++i)
+    peers.push_back(session_at(i).peer);
+  return peers;
+}
+
+Entity *find_entity(uint16_t eid)
 {
+  uint32_t slot = entitySlot[eid_index(eid)];
+  if (slot >= entities.size() || entities[slot].eid != eid)
+    return nullptr;
+  return &entities[slot];
+}
+
+void spawn_entity(const Entity &ent)
+{
+  entitySlot[eid_index(ent.eid)] = uint32_t(entities.size());
+  entities.push_back(ent);
+}
+
+void remove_entity(uint16_t eid)
+{
+  uint32_t slot = entitySlot[eid_index(eid)];
+  if (!find_entity(eid))
+    return;
+  uint32_t last = uint32_t(entities.size() - 1);
+  entities[slot] = entities[last];
+  entitySlot[eid_index(entities[slot].eid)] = slot;
+  entities.pop_back();
+  entitySlot[eid_index(eid)] = UINT32_MAX;
+  // per entity session state follows the same swap
+  for (size_t i = 0; i < session_count(); ++i)
+    session_remove_entity(session_at(i), slot, last);
+}
+
+void on_join(ENetPacket *packet, ENetPeer *peer)
+{
+  send_world(peer, worldBounds);
+  if (entropyReady)
+  {
+    send_entropy_tables(peer, entropyTables);
+    get_session(peer)->hasEntropyTables = true;
+  }
   // send all entities
   for (const Entity &ent : entities)
     send_new_entity(peer, ent);
 
-  // find max eid
-  uint16_t maxEid = entities.empty() ? invalid_entity : entities[0].eid;
-  for (const Entity &e : entities)
-    maxEid = std::max(maxEid, e.eid);
-  uint16_t newEid = maxEid + 1;
+  uint16_t newEid = eidAllocator.allocate();
+  if (newEid == invalid_entity)
+  {
+    printf("Out of eids, %x:%u stays a spectator\n", peer->address.host, peer->address.port);
+    return;
+  }
   uint32_t color = 0xff000000 +
                    0x00440000 * (rand() % 5) +
                    0x00004400 * (rand() % 5) +
@@ -29,35 +122,146 @@ void on_join(ENetPacket *packet, ENetPeer *peer, ENetHost *host)
   float x = (rand() % 4) * 2.f;
   float y = (rand() % 4) * 2.f;
   Entity ent = {color, x, y, 0.f, (rand() / RAND_MAX) * 3.141592654f, 0.f, 0.f, newEid};
-  entities.push_back(ent);
-
-  controlledMap[newEid] = peer;
+  spawn_entity(ent);
 
+  PeerSession *session = get_session(peer);
+  session->controlledEid = newEid;
+  session->origin.x = x;
+  session->origin.y = y;
+  session->hasOrigin = true;
+  send_origin(peer, session->origin);
 
   // send info about new entity to everyone
-  for (size_t i = 0; i < host->peerCount; ++i)
-    send_new_entity(&host->peers[i], ent);
+  const std::vector<ENetPeer*> &peers = connected_peers();
+  send_shared(peers.data(), peers.size(), reliable_channel(), create_new_entity_packet(ent));
   // send info about controlled entity
   send_set_controlled_entity(peer, newEid);
-  uint32_t *keyPtr = (uint32_t*)peer->data;
   std::random_device rd;  //Will be used to obtain a seed for the random number engine
   std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
   std::uniform_int_distribution<uint32_t> distrib(0);
-  *keyPtr = distrib(gen);
-  send_cipher_key(peer, *keyPtr);
+  session->cipherKey = distrib(gen);
+  send_cipher_key(peer, session->cipherKey);
+}
+
+// queued until the end of the event loop, so one message covers every despawn of a tick
+void despawn_entity(uint16_t eid)
+{
+  if (eidAllocator.is_alive(eid))
+    pendingDespawns.push_back(eid);
 }
 
-void on_input(ENetPacket *packet)
+void flush_despawns()
 {
+  if (pendingDespawns.empty())
+    return;
+  for (uint16_t eid : pendingDespawns)
+  {
+    remove_entity(eid);
+    eidAllocator.free(eid);
+  }
+  const std::vector<ENetPeer*> &peers = connected_peers();
+  send_shared(peers.data(), peers.size(), reliable_channel(),
+              create_despawn_packet(pendingDespawns.data(), uint16_t(pendingDespawns.size())));
+  pendingDespawns.clear();
+}
+
+// recenters the peer's origin on its entity, the new origin has to be sent before any
+// snapshot that uses it can be decoded
+void update_origin(PeerSession &session, float dt)
+{
+  session.sinceOriginMove += dt;
+  const Entity *e = find_entity(session.controlledEid);
+  if (!e || !session.hasOrigin || session.sinceOriginMove < ORIGIN_MIN_INTERVAL)
+    return;
+  if (fabsf(e->x - session.origin.x) < ORIGIN_RECENTER_X &&
+      fabsf(e->y - session.origin.y) < ORIGIN_RECENTER_Y)
+    return;
+  session.origin.x = e->x;
+  session.origin.y = e->y;
+  session.origin.epoch = (session.origin.epoch + 1) % SNAPSHOT_ORIGIN_EPOCHS;
+  session.sinceOriginMove = 0.f;
+  if (session.outgoingOrigin)
+    enet_packet_destroy(session.outgoingOrigin);
+  session.outgoingOrigin = create_origin_packet(session.origin);
+}
+
+void train_entropy(const ENetPacket *packet)
+{
+  count_snapshot_batch_symbols(packet, entropyCounts);
+  entropyTrainedBytes += packet->dataLength;
+  if (entropyTrainedBytes < ENTROPY_TRAIN_BYTES)
+    return;
+  for (size_t p = 0; p < SNAPSHOT_BATCH_PLANES; ++p)
+    entropy_build_table(entropyTables[p], entropyCounts[p]);
+  entropyReady = true;
+  printf("Entropy tables trained on %zu bytes of snapshots\n", entropyTrainedBytes);
+  const std::vector<ENetPeer*> &peers = connected_peers();
+  send_shared(peers.data(), peers.size(), reliable_channel(), create_entropy_tables_packet(entropyTables));
+  for (size_t i = 0; i < session_count(); ++i)
+    session_at(i).hasEntropyTables = true;
+}
+
+void register_server_metrics(size_t max_peers)
+{
+  register_protocol_metrics();
+  metrics_register(tickDuration, "server_tick_duration_seconds", "Time spent on a tick, sleep excluded.",
+                   "", 1e-6);
+  metrics_register(entityCount, "server_entities", "Simulated entities.");
+  metrics_register(peerCount, "server_peers", "Connected peers.");
+  metrics_register(inputsReceived, "server_inputs_total", "Distinct client inputs received.");
+  metrics_register(inputsLost, "server_inputs_lost_total", "Client inputs missing from every packet that arrived.");
+  metrics_register(inputPacketsStale, "server_input_packets_stale_total", "Input packets holding nothing newer than seen.");
+  metrics_register(sessionsUsed, "server_pool_used", "Pool slots in use.", "pool=\"sessions\"");
+  metrics_register(eidsUsed, "server_pool_used", "Pool slots in use.", "pool=\"eids\"");
+  sessionsSize.set(int64_t(max_peers));
+  eidsSize.set(EID_INDEX_MASK);
+  metrics_register(sessionsSize, "server_pool_size", "Pool capacity.", "pool=\"sessions\"");
+  metrics_register(eidsSize, "server_pool_size", "Pool capacity.", "pool=\"eids\"");
+  peerRtt = std::vector<MetricGauge>(max_peers);
+  peerLoss = std::vector<MetricGauge>(max_peers);
+  for (size_t i = 0; i < max_peers; ++i)
+  {
+    const std::string peer = "peer=\"" + std::to_string(i) + "\"";
+    metrics_register(peerRtt[i], "server_peer_rtt_seconds", "Round trip time ENet measures.", peer, 1e-3);
+    metrics_register(peerLoss[i], "server_peer_packet_loss_ratio", "Packet loss ENet measures.", peer,
+                     1.0 / ENET_PEER_PACKET_LOSS_SCALE);
+  }
+}
+
+void on_input(ENetPacket *packet, PeerSession *session)
+{
+  decipher_data(packet, session->cipherKey);
   uint16_t eid = invalid_entity;
-  float thr = 0.f; float steer = 0.f;
-  deserialize_entity_input(packet, eid, thr, steer);
-  for (Entity &e : entities)
-    if (e.eid == eid)
-    {
-      e.thr = thr;
-      e.steer = steer;
-    }
+  InputHistory inputs;
+  // peers only steer their own entity
+  if (!deserialize_entity_input(packet, eid, inputs) || eid != session->controlledEid)
+  {
+    count_rejected(packet);
+    return;
+  }
+  // unsequenced, an older packet can arrive after a newer one; its inputs are known
+  const int16_t ahead = int16_t(uint16_t(inputs.seq - session->lastInputSeq));
+  if (ahead <= 0)
+  {
+    inputPacketsStale.add();
+    return;
+  }
+  session->lastInputSeq = inputs.seq;
+  // inputs between the last seen and the oldest one in this packet are gone for good
+  const uint32_t covered = std::min<uint32_t>(uint32_t(ahead), inputs.count);
+  session->inputsReceived += covered;
+  inputsReceived.add(covered);
+  inputsLost.add(uint32_t(ahead) - covered);
+  // the entity holds a control state rather than a queue of commands, the newest wins
+  if (Entity *e = find_entity(eid))
+    unpack_input(inputs.codes[0], e->thr, e->steer);
+}
+
+static volatile std::sig_atomic_t running = 1;
+
+static void on_stop_signal(int)
+{
+  running = 0;
 }
 
 int main(int argc, const char **argv)
@@ -67,22 +271,70 @@ int main(int argc, const char **argv)
     printf("Cannot init ENet");
     return 1;
   }
+  // w10_server [--config file] [--key value ...] [--raw] [--capture file]
+  // every server_config.h key is a flag too, e.g. --port 10132 --max-peers 64;
+  // --lobby host:port registers with a w2 lobby's control port and reports load to it,
+  // metrics are served on 127.0.0.1:metrics-port and/or rewritten to metrics-file every
+  // second, --raw turns off entropy coding of snapshot batches, --capture records all traffic
+  ServerConfig config;
+  std::vector<const char*> args;
+  if (!server_config_parse_args(config, argc, argv, args) || !server_config_validate(config))
+    return 1;
+  for (size_t i = 0; i < args.size(); ++i)
+  {
+    if (strcmp(args[i], "--raw") == 0)
+      entropyCoding = false;
+    else if (strcmp(args[i], "--capture") == 0 && i + 1 < args.size())
+    {
+      const char *path = args[++i];
+      if (!capture_open(path, "w10"))
+        printf("Cannot open capture file %s\n", path);
+    }
+    else
+      printf("Unknown argument %s\n", args[i]);
+  }
+  server_config_print(config);
+  worldBounds = {config.worldMinX, config.worldMinY, config.worldMaxX, config.worldMaxY};
+  set_channel_layout(config.reliableChannel, config.unreliableChannel);
+  scheduler_set_max_rate(config.sendRate ? config.sendRate : config.tickRate);
+
   ENetAddress address;
 
   address.host = ENET_HOST_ANY;
-  address.port = 10131;
+  address.port = config.port;
 
-  ENetHost *server = enet_host_create(&address, 32, 2, 0, 0);
+  ENetHost *server = enet_host_create(&address, config.maxPeers, config.channels,
+                                      config.incomingBandwidth, config.outgoingBandwidth);
 
   if (!server)
   {
     printf("Cannot create ENet server\n");
     return 1;
   }
+  // clients set the same, ENet drops datagrams that don't match before we see them
+  server->checksum = checksum_crc32c;
+  printf("CRC32C checksums %s\n", crc32c_hardware() ? "with SSE4.2" : "from a table");
+
+  jobs_init();
+  printf("Running with %zu job workers\n", jobs_worker_count());
+  sessions_init(server);
+  world.set(worldBounds);
+  register_server_metrics(config.maxPeers);
+  const char *metricsFile = config.metricsFile.empty() ? nullptr : config.metricsFile.c_str();
+  if ((config.metricsPort || metricsFile) && !metrics_start(config.metricsPort, metricsFile))
+    printf("Cannot start metrics on port %u\n", config.metricsPort);
+  if (!config.lobby.empty() &&
+      !lobby_link_start(config.lobby.c_str(), E_LOBBY_GAME_W10, config.port, uint16_t(config.maxPeers)))
+    printf("Cannot reach lobby %s\n", config.lobby.c_str());
 
   uint32_t lastTime = enet_time_get();
-  while (true)
+  uint32_t lastReportTime = lastTime;
+  // Ctrl+C or a kill ends the loop so the capture and metrics get closed properly
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+  while (running)
   {
+    auto tickStart = std::chrono::steady_clock::now();
     uint32_t curTime = enet_time_get();
     float dt = (curTime - lastTime) * 0.001f;
     lastTime = curTime;
@@ -93,47 +345,141 @@ int main(int argc, const char **argv)
       {
       case ENET_EVENT_TYPE_CONNECT:
         printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        event.peer->data = new uint32_t;
-        *(uint32_t*)event.peer->data = 0;
+        capture_record(E_CAPTURE_CONNECT, event.peer->incomingPeerID, 0, nullptr, 0);
+        session_open(event.peer);
         break;
       case ENET_EVENT_TYPE_DISCONNECT:
         printf("Disconnected %x:%u \n", event.peer->address.host, event.peer->address.port);
-        delete event.peer->data;
+        capture_record(E_CAPTURE_DISCONNECT, event.peer->incomingPeerID, 0, nullptr, 0);
+        peerRtt[event.peer->incomingPeerID].set(0);
+        peerLoss[event.peer->incomingPeerID].set(0);
+        if (PeerSession *session = get_session(event.peer))
+          despawn_entity(session->controlledEid);
+        session_close(event.peer);
         break;
       case ENET_EVENT_TYPE_RECEIVE:
+      {
+        capture_record(E_CAPTURE_IN, event.peer->incomingPeerID, event.channelID,
+                       event.packet->data, event.packet->dataLength);
+        count_received(event.packet);
+        PeerSession *session = get_session(event.peer);
+        ++session->packetsIn;
+        session->bytesIn += event.packet->dataLength;
         switch (get_packet_type(event.packet))
         {
           case E_CLIENT_TO_SERVER_JOIN:
-            on_join(event.packet, event.peer, server);
+            on_join(event.packet, event.peer);
             break;
           case E_CLIENT_TO_SERVER_INPUT:
-            decipher_data(event.packet, event.peer);
-            on_input(event.packet);
+            on_input(event.packet, session);
+            break;
+          default:
+            count_rejected(event.packet);
             break;
         };
         enet_packet_destroy(event.packet);
         break;
+      }
       default:
         break;
       };
     }
-    static int t = 0;
-    for (Entity &e : entities)
+    flush_despawns();
+    // simulate
+    snapshotCodes.farX.resize(entities.size());
+    snapshotCodes.farY.resize(entities.size());
+    snapshotCodes.ori.resize(entities.size());
+    parallel_for(0, entities.size(), SIMULATE_GRAIN, [dt](size_t from, size_t to)
+    {
+      for (size_t i = from; i < to; ++i)
+      {
+        Entity &e = entities[i];
+        simulate_entity(e, dt);
+        e.x = clamp(e.x, worldBounds.minX, worldBounds.maxX);
+        e.y = clamp(e.y, worldBounds.minY, worldBounds.maxY);
+      }
+      quantize_snapshots(entities, from, to, world, snapshotCodes);
+    });
+    // serialize, one job per connected peer, each within its own budget
+    parallel_for(0, session_count(), 1, [dt](size_t from, size_t to)
+    {
+      thread_local std::vector<size_t> selected;
+      thread_local std::vector<SnapshotEntry> batch;
+      for (size_t i = from; i < to; ++i)
+      {
+        PeerSession &session = session_at(i);
+        update_origin(session, dt);
+        if (!scheduler_update(session.send, *session.peer, dt))
+          continue;
+        const size_t charged = scheduler_select(session.send, entities, session.controlledEid,
+                                                SNAPSHOT_ENTRY_SIZE, SNAPSHOT_BATCH_HEADER_SIZE,
+                                                SNAPSHOT_BATCH_MAX_ENTRIES, selected);
+        if (selected.empty())
+          continue;
+        const SnapshotOrigin *origin = session.hasOrigin ? &session.origin : nullptr;
+        batch.clear();
+        for (size_t idx : selected)
+        {
+          const Entity &e = entities[idx];
+          batch.push_back({e.eid, pack_snapshot(snapshotCodes, idx, e.x, e.y, origin)});
+        }
+        const EntropyTable *tables = session.hasEntropyTables ? entropyTables : nullptr;
+        size_t sentBytes = 0;
+        for (size_t first = 0; first < batch.size(); first += SNAPSHOT_BATCH_MAX_ENTRIES)
+        {
+          size_t count = std::min(SNAPSHOT_BATCH_MAX_ENTRIES, batch.size() - first);
+          ENetPacket *packet = create_snapshot_batch_packet(batch.data() + first, count, tables);
+          sentBytes += packet->dataLength + ENET_SEND_OVERHEAD;
+          session.outgoing.push_back(packet);
+        }
+        scheduler_settle(session.send, charged, sentBytes);
+      }
+    });
+    // send, enet host isn't thread safe
+    for (size_t i = 0; i < session_count(); ++i)
+    {
+      PeerSession &session = session_at(i);
+      if (session.outgoingOrigin)
+      {
+        peer_send(session.peer, reliable_channel(), session.outgoingOrigin);
+        session.outgoingOrigin = nullptr;
+      }
+      for (ENetPacket *packet : session.outgoing)
+      {
+        if (entropyCoding && !entropyReady)
+          train_entropy(packet);
+        ++session.packetsOut;
+        session.bytesOut += packet->dataLength;
+        peer_send(session.peer, unreliable_channel(), packet);
+      }
+      session.outgoing.clear();
+    }
+    if (curTime - lastReportTime >= 1000)
     {
-      // simulate
-      simulate_entity(e, dt);
-      // send
-      for (size_t i = 0; i < server->peerCount; ++i)
+      lastReportTime = curTime;
+      for (size_t i = 0; i < session_count(); ++i)
       {
-        ENetPeer *peer = &server->peers[i];
-        // skip this here in this implementation
-        //if (controlledMap[e.eid] != peer)
-        send_snapshot(peer, e.eid, e.x, e.y, e.ori);
+        const ENetPeer &peer = *session_at(i).peer;
+        scheduler_report(session_at(i).send, peer);
+        peerRtt[peer.incomingPeerID].set(peer.roundTripTime);
+        peerLoss[peer.incomingPeerID].set(peer.packetLoss);
       }
     }
-    usleep(10000);
+    entityCount.set(int64_t(entities.size()));
+    peerCount.set(int64_t(server->connectedPeers));
+    sessionsUsed.set(int64_t(session_count()));
+    eidsUsed.set(int64_t(eidAllocator.alive_count()));
+    const uint64_t tickUs = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - tickStart).count());
+    tickDuration.record(tickUs);
+    lobby_link_update(uint16_t(server->connectedPeers), uint32_t(entities.size()), uint32_t(tickUs));
+    usleep(useconds_t(1000000 / config.tickRate));
   }
 
+  jobs_shutdown();
+  lobby_link_stop();
+  metrics_stop();
+  capture_close();
   enet_host_destroy(server);
 
   atexit(enet_deinitialize);
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Everything that differs between shards and the boxes they run on. The defaults are
+// the built in values, a `key = value` file and then `--key value` flags override them
+// (--max-peers for max_peers), and the result is validated once before the host is
+// created; nothing is re-read while running.
+struct ServerConfig
+{
+  uint16_t port = 10131;
+  uint16_t metricsPort = 0; // 127.0.0.1, 0 - none
+  std::string metricsFile;
+  std::string lobby; // host:port of a w2 lobby's control port, empty - standalone
+
+  size_t maxPeers = 32; // sizes the ENet peer table and everything indexed by peer id
+  size_t channels = 2;
+  uint8_t reliableChannel = 0; // joins, spawns, despawns, origins
+  uint8_t unreliableChannel = 1; // snapshots, inputs
+  uint32_t incomingBandwidth = 0; // bytes/s for the whole host, 0 - unlimited
+  uint32_t outgoingBandwidth = 0;
+
+  uint32_t tickRate = 100; // Hz
+  uint32_t sendRate = 0; // snapshots per second a peer gets at most, 0 - every tick
+
+  float worldMinX = -256.f;
+  float worldMinY = -128.f;
+  float worldMaxX = 256.f;
+  float worldMaxY = 128.f;
+};
+
+// '#' starts a comment; unknown keys and malformed values are errors
+bool server_config_load(ServerConfig &config, const char *path);
+// `--config file` first wherever it is, then every `--key value`; the arguments that
+// aren't config are left in `rest` in order for the server's own flags
+bool server_config_parse_args(ServerConfig &config, int argc, const char **argv,
+                              std::vector<const char*> &rest);
+// prints every problem, not just the first
+bool server_config_validate(const ServerConfig &config);
+void server_config_print(const ServerConfig &config);
@@ -0,0 +1,5 @@
+vec4 v_color0 : COLOR0 = vec4(1.0, 1.0, 1.0, 1.0);
+
+vec3 a_position : POSITION;
+vec4 i_data0    : TEXCOORD7;
+vec4 i_data1    : TEXCOORD6;
@@ -1,28 +1,114 @@
+// build with: client.cpp protocol.cpp ../w10/crc32c.cpp + enet
 #include <enet/enet.h>
-#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "protocol.h"
+#include "../w10/crc32c.h"
 
-void send_fragmented_packet(ENetPeer *peer)
+enum ClientAction
 {
-  const char *baseMsg = "Stay awhile and listen. ";
-  const size_t msgLen = strlen(baseMsg);
+  E_ACTION_QUEUE = 0,
+  E_ACTION_LIST,
+  E_ACTION_CREATE,
+  E_ACTION_JOIN
+};
 
-  const size_t sendSize = 2500;
-  char *hugeMessage = new char[sendSize];
-  for (size_t i = 0; i < sendSize; ++i)
-    hugeMessage[i] = baseMsg[i % msgLen];
-  hugeMessage[sendSize-1] = '\0';
+static ClientAction action = E_ACTION_QUEUE;
+static std::string roomName;
+static uint8_t roomSize = 4;
+static uint32_t roomId = 0;
+static uint32_t startAfter = 0; // ms, 0 - wait for the room to fill
+static uint32_t listed = 0;
+static GameId game = E_GAME_W10;
 
-  ENetPacket *packet = enet_packet_create(hugeMessage, sendSize, ENET_PACKET_FLAG_RELIABLE);
-  enet_peer_send(peer, 0, packet);
+static bool parse_address(const char *host_port, ENetAddress &address)
+{
+  const char *colon = strrchr(host_port, ':');
+  if (enet_address_set_host(&address, std::string(host_port, colon ? colon : host_port + strlen(host_port)).c_str()) != 0)
+    return false;
+  if (colon)
+    address.port = uint16_t(atoi(colon + 1));
+  return true;
+}
 
-  delete[] hugeMessage;
+static void on_lobby_connected(ENetPeer *lobby, const std::string &name, uint16_t skill)
+{
+  send_login(lobby, name, skill, game);
+  switch (action)
+  {
+  case E_ACTION_LIST:
+    send_list_rooms(lobby, 0);
+    break;
+  case E_ACTION_CREATE:
+    send_create_room(lobby, roomName, roomSize);
+    break;
+  case E_ACTION_JOIN:
+    send_join_room(lobby, roomId);
+    break;
+  default:
+    send_queue(lobby);
+    break;
+  };
 }
 
-void send_micro_packet(ENetPeer *peer)
+// false once there is nothing left to wait for
+static bool on_lobby_packet(ENetPacket *packet, ENetPeer *lobby, MatchInfo &match)
 {
-  const char *msg = "dv/dt";
-  ENetPacket *packet = enet_packet_create(msg, strlen(msg) + 1, ENET_PACKET_FLAG_UNSEQUENCED);
-  enet_peer_send(peer, 1, packet);
+  switch (get_lobby_packet_type(packet))
+  {
+  case E_LOBBY_TO_CLIENT_ROOM_LIST:
+  {
+    uint32_t total = 0;
+    std::vector<RoomInfo> rooms;
+    if (!deserialize_room_list(packet, total, rooms))
+      return false;
+    for (const RoomInfo &room : rooms)
+      printf("room %u '%s' %u/%u\n", room.id, room.name.c_str(), room.players, room.maxPlayers);
+    listed += uint32_t(rooms.size());
+    if (listed < total && !rooms.empty())
+    {
+      send_list_rooms(lobby, listed);
+      return true;
+    }
+    printf("%u rooms\n", total);
+    return false;
+  }
+  case E_LOBBY_TO_CLIENT_ROOM:
+  {
+    RoomInfo room;
+    bool owner = false;
+    if (!deserialize_room(packet, room, owner))
+      return false;
+    if (room.id)
+      printf("In room %u '%s' %u/%u%s\n", room.id, room.name.c_str(), room.players, room.maxPlayers,
+             owner ? ", owner" : "");
+    return room.id != 0;
+  }
+  case E_LOBBY_TO_CLIENT_QUEUED:
+  {
+    uint8_t skillBucket = 0, latencyBucket = 0;
+    if (!deserialize_queued(packet, skillBucket, latencyBucket))
+      return false;
+    printf("Queued, skill bucket %u, latency bucket %u\n", skillBucket, latencyBucket);
+    return true;
+  }
+  case E_LOBBY_TO_CLIENT_MATCH_START:
+    if (!deserialize_match_start(packet, match))
+      match.matchId = 0;
+    return false;
+  case E_LOBBY_TO_CLIENT_ERROR:
+  {
+    LobbyError error = E_LOBBY_ERROR_COUNT;
+    deserialize_error(packet, error);
+    printf("Lobby: %s\n", lobby_error_name(error));
+    return false;
+  }
+  default:
+    return true;
+  };
 }
 
 int main(int argc, const char **argv)
@@ -32,62 +118,150 @@ int main(int argc, const char **argv)
     printf("Cannot init ENet");
     return 1;
   }
+  // client [--lobby host:port] [--name name] [--skill n] [--game w4|w10]
+  //        [--queue | --list | --create name [--size n] [--start-after ms] | --join id]
+  // waits for a match, then connects to the game server the lobby handed out
+  ENetAddress lobbyAddress;
+  enet_address_set_host(&lobbyAddress, "localhost");
+  lobbyAddress.port = LOBBY_PORT;
+  std::string name = "player";
+  uint16_t skill = 1000;
+  for (int i = 1; i < argc; ++i)
+  {
+    const bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--lobby") == 0 && hasValue)
+    {
+      if (!parse_address(argv[++i], lobbyAddress))
+      {
+        printf("Bad lobby address %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--name") == 0 && hasValue)
+      name = argv[++i];
+    else if (strcmp(argv[i], "--skill") == 0 && hasValue)
+      skill = uint16_t(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--game") == 0 && hasValue)
+    {
+      if (!parse_game(argv[++i], game))
+      {
+        printf("Unknown game %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--queue") == 0)
+      action = E_ACTION_QUEUE;
+    else if (strcmp(argv[i], "--list") == 0)
+      action = E_ACTION_LIST;
+    else if (strcmp(argv[i], "--create") == 0 && hasValue)
+    {
+      action = E_ACTION_CREATE;
+      roomName = argv[++i];
+    }
+    else if (strcmp(argv[i], "--size") == 0 && hasValue)
+      roomSize = uint8_t(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--start-after") == 0 && hasValue)
+      startAfter = uint32_t(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--join") == 0 && hasValue)
+    {
+      action = E_ACTION_JOIN;
+      roomId = uint32_t(atoi(argv[++i]));
+    }
+  }
 
-  ENetHost *client = enet_host_create(nullptr, 1, 2, 0, 0);
-  if (!client)
+  ENetHost *client = enet_host_create(nullptr, 1, 1, 0, 0);
+  // its own host, the checksum is per host and the lobby doesn't use one
+  ENetHost *gameClient = enet_host_create(nullptr, 1, 2, 0, 0);
+  if (!client || !gameClient)
   {
     printf("Cannot create ENet client\n");
     return 1;
   }
+  // w10 servers drop every datagram without a CRC32C
+  if (game == E_GAME_W10)
+    gameClient->checksum = checksum_crc32c;
 
-  ENetAddress address;
-  enet_address_set_host(&address, "localhost");
-  address.port = 10887;
-
-  ENetPeer *lobbyPeer = enet_host_connect(client, &address, 2, 0);
+  ENetPeer *lobbyPeer = enet_host_connect(client, &lobbyAddress, 1, 0);
   if (!lobbyPeer)
   {
     printf("Cannot connect to lobby");
     return 1;
   }
 
-  uint32_t timeStart = enet_time_get();
-  uint32_t lastFragmentedSendTime = timeStart;
-  uint32_t lastMicroSendTime = timeStart;
-  bool connected = false;
-  while (true)
+  MatchInfo match;
+  ENetPeer *gamePeer = nullptr;
+  char gameHost[64] = "";
+  uint32_t connectTime = 0;
+  bool waiting = true;
+  while (waiting)
   {
-    ENetEvent event;
-    while (enet_host_service(client, &event, 10) > 0)
+    for (ENetHost *host : {client, gameClient})
     {
-      switch (event.type)
+      // waits on the host in use, the lobby one only gets its goodbye out once there is a match
+      const enet_uint32 timeout = (host == gameClient) == (gamePeer != nullptr) ? 10 : 0;
+      ENetEvent event;
+      while (waiting && enet_host_service(host, &event, timeout) > 0)
       {
-      case ENET_EVENT_TYPE_CONNECT:
-        printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        connected = true;
-        break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        printf("Packet received '%s'\n", event.packet->data);
-        enet_packet_destroy(event.packet);
-        break;
-      default:
-        break;
-      };
+        switch (event.type)
+        {
+        case ENET_EVENT_TYPE_CONNECT:
+          printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
+          if (event.peer == lobbyPeer)
+          {
+            on_lobby_connected(lobbyPeer, name, skill);
+            connectTime = enet_time_get();
+          }
+          else
+          {
+            // the game client takes it from here, this only checks the handoff works
+            printf("In match %u, play with --server %s:%u\n", match.matchId, gameHost, match.server.port);
+            enet_peer_disconnect_now(event.peer, 0);
+            waiting = false;
+          }
+          break;
+        case ENET_EVENT_TYPE_RECEIVE:
+          if (event.peer == lobbyPeer && !on_lobby_packet(event.packet, lobbyPeer, match))
+          {
+            if (match.matchId)
+            {
+              enet_address_get_host_ip(&match.server, gameHost, sizeof(gameHost));
+              printf("Match %u on %s:%u\n", match.matchId, gameHost, match.server.port);
+              // done with the lobby, the game server is next
+              enet_peer_disconnect_later(lobbyPeer, 0);
+              gamePeer = enet_host_connect(gameClient, &match.server, 2, 0);
+            }
+            waiting = gamePeer != nullptr;
+          }
+          enet_packet_destroy(event.packet);
+          break;
+        case ENET_EVENT_TYPE_DISCONNECT:
+          if (event.peer == gamePeer)
+          {
+            printf("Cannot reach the game server\n");
+            waiting = false;
+          }
+          else if (!gamePeer)
+          {
+            printf("Lost the lobby\n");
+            waiting = false;
+          }
+          break;
+        default:
+          break;
+        };
+      }
     }
-    if (connected)
+    if (action == E_ACTION_CREATE && startAfter && connectTime && enet_time_get() - connectTime > startAfter)
     {
-      uint32_t curTime = enet_time_get();
-      if (curTime - lastFragmentedSendTime > 1000)
-      {
-        lastFragmentedSendTime = curTime;
-        send_fragmented_packet(lobbyPeer);
-      }
-      if (curTime - lastMicroSendTime > 100)
-      {
-        lastMicroSendTime = curTime;
-        send_micro_packet(lobbyPeer);
-      }
+      send_start_room(lobbyPeer);
+      startAfter = 0;
     }
   }
+  enet_host_flush(client);
+  enet_host_flush(gameClient);
+  enet_host_destroy(gameClient);
+  enet_host_destroy(client);
+
+  atexit(enet_deinitialize);
   return 0;
 }
@@ -1,5 +1,559 @@
 #include <enet/enet.h>
-#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+#include "protocol.h"
+
+// ENet's peer ids are 12 bits. Every peer slot is allocated up front and the lobby only
+// does work when a packet comes in or matchmaking is due, so idle peers cost their
+// slot and ENet's keepalive pings, nothing more.
+const size_t LOBBY_MAX_PEERS = 4095;
+// ENet pings twice a second by default, lobby peers don't need the RTT that fresh
+const enet_uint32 LOBBY_PING_INTERVAL = 5000;
+
+const uint32_t MATCHMAKING_INTERVAL = 250; // ms
+const size_t MATCH_PLAYERS = 4;
+const uint16_t SKILL_BUCKET_WIDTH = 200;
+const size_t CONTROL_MAX_PEERS = 64;
+// a server that stops reporting for this long gets no new matches
+const uint32_t LOAD_REPORT_TIMEOUT = LOAD_REPORT_INTERVAL * 3;
+// how long a handed out player may take to show up in the server's reports
+const uint32_t PENDING_PLAYERS_WINDOW = 5000;
+// RTT upper bounds in ms, anything slower goes in one last bucket
+const uint32_t LATENCY_BUCKET_LIMITS[] = {50, 100, 200};
+// each this long in the queue lets a player match one more skill bucket away
+const uint32_t QUEUE_WIDEN_INTERVAL = 10000;
+const uint32_t QUEUE_MAX_WIDEN = 3;
+
+struct LobbyPlayer
+{
+  bool loggedIn = false;
+  std::string name;
+  uint16_t skill = 0;
+  GameId game = E_GAME_W10;
+  uint32_t roomId = 0;
+  bool queued = false;
+};
+
+struct Room
+{
+  uint32_t id = 0;
+  std::string name;
+  GameId game = E_GAME_W10; // the owner's, only players of it can join
+  uint8_t maxPlayers = 0;
+  std::vector<ENetPeer*> members; // the first one owns the room
+};
+
+struct QueueEntry
+{
+  ENetPeer *peer;
+  GameId game;
+  uint8_t skillBucket;
+  uint8_t latencyBucket;
+  uint32_t since;
+};
+
+struct GameServer
+{
+  ENetAddress address;
+  ENetPeer *control = nullptr; // nullptr - listed on the command line, never reports
+  GameId game = E_GAME_W10;
+  uint16_t maxPeers = 0;
+  ServerLoad load;
+  uint32_t lastReport = 0;
+  bool draining = false;
+  // players sent there lately, counted against it until its reports can include them
+  std::deque<std::pair<uint32_t, size_t>> pending; // time, players
+  uint32_t matches = 0;
+};
+
+static ENetHost *host = nullptr;
+static std::vector<LobbyPlayer> players; // by index in the host's peer table
+static std::vector<Room> rooms; // by id, ids only grow so creation order is sorted
+static uint32_t nextRoomId = 1;
+static std::vector<QueueEntry> queue; // oldest first
+static std::vector<GameServer> gameServers;
+static ENetHost *controlHost = nullptr;
+// tick p99 a server is drained at, it gets matches again below 3/4 of it
+static uint32_t drainTickUs = 20000;
+static uint32_t nextMatchId = 1;
+
+static LobbyPlayer &get_player(ENetPeer *peer)
+{
+  return players[peer - host->peers];
+}
+
+static Room *find_room(uint32_t id)
+{
+  auto it = std::lower_bound(rooms.begin(), rooms.end(), id,
+                             [](const Room &room, uint32_t room_id) { return room.id < room_id; });
+  return it != rooms.end() && it->id == id ? &*it : nullptr;
+}
+
+static RoomInfo room_info(const Room &room)
+{
+  RoomInfo info;
+  info.id = room.id;
+  info.players = uint8_t(room.members.size());
+  info.maxPlayers = room.maxPlayers;
+  info.name = room.name;
+  return info;
+}
+
+static void broadcast_room(const Room &room)
+{
+  const RoomInfo info = room_info(room);
+  for (ENetPeer *member : room.members)
+    send_room(member, info, member == room.members.front());
+}
+
+static size_t pending_players(GameServer &server, uint32_t now)
+{
+  while (!server.pending.empty() && now - server.pending.front().first > PENDING_PLAYERS_WINDOW)
+    server.pending.pop_front();
+  size_t players = 0;
+  for (const auto &assigned : server.pending)
+    players += assigned.second;
+  return players;
+}
+
+// Only servers running the players' game. Registered ones first, the one filled least
+// by its last report plus whoever was sent there since; drained, silent and full ones
+// are skipped. Servers from the command line don't report, they only take matches
+// when no registered one can.
+static GameServer *pick_game_server(size_t players, GameId game)
+{
+  const uint32_t now = enet_time_get();
+  GameServer *best = nullptr;
+  float bestFill = 1.f;
+  for (GameServer &server : gameServers)
+  {
+    if (server.game != game || !server.control || server.draining ||
+        now - server.lastReport > LOAD_REPORT_TIMEOUT)
+      continue;
+    const size_t used = server.load.peers + pending_players(server, now) + players;
+    if (used > server.maxPeers)
+      continue;
+    const float fill = float(used) / float(server.maxPeers);
+    if (!best || fill < bestFill)
+    {
+      best = &server;
+      bestFill = fill;
+    }
+  }
+  if (best)
+    return best;
+  for (GameServer &server : gameServers)
+    if (server.game == game && !server.control && (!best || server.matches < best->matches))
+      best = &server;
+  return best;
+}
+
+// hands every player the game server's address and lets go of them, they connect to
+// it directly and the lobby is out of the way; rooms and the queue only ever group
+// players of one game
+static void start_match(const std::vector<ENetPeer*> &peers)
+{
+  const GameId game = get_player(peers.front()).game;
+  // out of their room or the queue either way, they can try again on an error
+  for (ENetPeer *peer : peers)
+  {
+    LobbyPlayer &player = get_player(peer);
+    player.roomId = 0;
+    player.queued = false;
+  }
+  GameServer *server = pick_game_server(peers.size(), game);
+  if (!server)
+  {
+    for (ENetPeer *peer : peers)
+      send_error(peer, E_LOBBY_ERROR_NO_GAME_SERVER);
+    return;
+  }
+  MatchInfo match;
+  match.matchId = nextMatchId++;
+  match.server = server->address;
+  ++server->matches;
+  server->pending.emplace_back(enet_time_get(), peers.size());
+  for (ENetPeer *peer : peers)
+    send_match_start(peer, match);
+  char ip[64];
+  enet_address_get_host_ip(&server->address, ip, sizeof(ip));
+  printf("Match %u: %zu players on %s %s:%u\n", match.matchId, peers.size(), game_name(game), ip,
+         server->address.port);
+}
+
+static void leave_room(ENetPeer *peer)
+{
+  LobbyPlayer &player = get_player(peer);
+  Room *room = find_room(player.roomId);
+  player.roomId = 0;
+  if (!room)
+    return;
+  room->members.erase(std::find(room->members.begin(), room->members.end(), peer));
+  if (room->members.empty())
+    rooms.erase(rooms.begin() + (room - rooms.data()));
+  else
+    broadcast_room(*room); // tells the next owner too
+}
+
+static void leave_queue(ENetPeer *peer)
+{
+  LobbyPlayer &player = get_player(peer);
+  if (!player.queued)
+    return;
+  player.queued = false;
+  queue.erase(std::find_if(queue.begin(), queue.end(),
+                           [peer](const QueueEntry &entry) { return entry.peer == peer; }));
+}
+
+static uint8_t latency_bucket(const ENetPeer *peer)
+{
+  uint8_t bucket = 0;
+  for (uint32_t limit : LATENCY_BUCKET_LIMITS)
+  {
+    if (peer->roundTripTime <= limit)
+      break;
+    ++bucket;
+  }
+  return bucket;
+}
+
+static void on_login(ENetPacket *packet, ENetPeer *peer)
+{
+  LobbyPlayer &player = get_player(peer);
+  std::string name;
+  uint16_t skill = 0;
+  GameId game = E_GAME_COUNT;
+  // no switching games from inside a room or the queue
+  if (player.roomId || player.queued || !deserialize_login(packet, name, skill, game))
+    return;
+  player.name = name;
+  player.skill = skill;
+  player.game = game;
+  player.loggedIn = true;
+  printf("%s logged in, skill %u, %s\n", player.name.c_str(), player.skill, game_name(player.game));
+}
+
+// only the rooms of the player's game, first and total count those
+static void on_list_rooms(ENetPacket *packet, ENetPeer *peer)
+{
+  uint32_t first = 0;
+  if (!deserialize_list_rooms(packet, first))
+    return;
+  const GameId game = get_player(peer).game;
+  std::vector<RoomInfo> page;
+  uint32_t total = 0;
+  for (const Room &room : rooms)
+  {
+    if (room.game != game)
+      continue;
+    if (total >= first && page.size() < LOBBY_ROOM_LIST_PAGE)
+      page.push_back(room_info(room));
+    ++total;
+  }
+  send_room_list(peer, total, page);
+}
+
+static void on_create_room(ENetPacket *packet, ENetPeer *peer)
+{
+  LobbyPlayer &player = get_player(peer);
+  Room room;
+  if (!deserialize_create_room(packet, room.name, room.maxPlayers))
+    return;
+  if (player.roomId || player.queued)
+  {
+    send_error(peer, E_LOBBY_ERROR_BUSY);
+    return;
+  }
+  room.id = nextRoomId++;
+  room.game = player.game;
+  room.members.push_back(peer);
+  player.roomId = room.id;
+  rooms.push_back(room);
+  broadcast_room(rooms.back());
+}
+
+static void on_join_room(ENetPacket *packet, ENetPeer *peer)
+{
+  LobbyPlayer &player = get_player(peer);
+  uint32_t roomId = 0;
+  if (!deserialize_join_room(packet, roomId))
+    return;
+  Room *room = find_room(roomId);
+  if (player.roomId || player.queued)
+    send_error(peer, E_LOBBY_ERROR_BUSY);
+  else if (!room)
+    send_error(peer, E_LOBBY_ERROR_NO_ROOM);
+  else if (room->game != player.game)
+    send_error(peer, E_LOBBY_ERROR_WRONG_GAME);
+  else if (room->members.size() >= room->maxPlayers)
+    send_error(peer, E_LOBBY_ERROR_ROOM_FULL);
+  else
+  {
+    room->members.push_back(peer);
+    player.roomId = room->id;
+    broadcast_room(*room);
+    // a full room starts by itself
+    if (room->members.size() == room->maxPlayers)
+    {
+      const std::vector<ENetPeer*> members = room->members;
+      rooms.erase(rooms.begin() + (room - rooms.data()));
+      start_match(members);
+    }
+  }
+}
+
+static void on_start_room(ENetPeer *peer)
+{
+  Room *room = find_room(get_player(peer).roomId);
+  if (!room || room->members.front() != peer)
+  {
+    send_error(peer, room ? E_LOBBY_ERROR_NOT_OWNER : E_LOBBY_ERROR_NO_ROOM);
+    return;
+  }
+  const std::vector<ENetPeer*> members = room->members;
+  rooms.erase(rooms.begin() + (room - rooms.data()));
+  start_match(members);
+}
+
+static void on_queue(ENetPeer *peer)
+{
+  LobbyPlayer &player = get_player(peer);
+  if (player.roomId || player.queued)
+  {
+    send_error(peer, E_LOBBY_ERROR_BUSY);
+    return;
+  }
+  QueueEntry entry;
+  entry.peer = peer;
+  entry.game = player.game;
+  entry.skillBucket = uint8_t(std::min(player.skill / SKILL_BUCKET_WIDTH, 255));
+  entry.latencyBucket = latency_bucket(peer);
+  entry.since = enet_time_get();
+  player.queued = true;
+  queue.push_back(entry);
+  send_queued(peer, entry.skillBucket, entry.latencyBucket);
+}
+
+// Oldest players first: everyone still waiting for the same game, in the same latency
+// bucket and within the oldest one's skill reach makes the match, oldest of them first.
+// The reach grows with time in the queue, so nobody waits forever for an exact skill
+// bucket.
+static void run_matchmaking()
+{
+  const uint32_t now = enet_time_get();
+  std::vector<bool> matched(queue.size(), false);
+  std::vector<size_t> picked;
+  for (size_t i = 0; i < queue.size(); ++i)
+  {
+    if (matched[i])
+      continue;
+    const QueueEntry &oldest = queue[i];
+    const uint32_t widen = std::min((now - oldest.since) / QUEUE_WIDEN_INTERVAL, QUEUE_MAX_WIDEN);
+    picked.clear();
+    for (size_t j = i; j < queue.size() && picked.size() < MATCH_PLAYERS; ++j)
+    {
+      const QueueEntry &other = queue[j];
+      if (!matched[j] && other.game == oldest.game && other.latencyBucket == oldest.latencyBucket &&
+          uint32_t(abs(int(other.skillBucket) - int(oldest.skillBucket))) <= widen)
+        picked.push_back(j);
+    }
+    if (picked.size() < MATCH_PLAYERS)
+      continue;
+    std::vector<ENetPeer*> peers;
+    for (size_t j : picked)
+    {
+      matched[j] = true;
+      peers.push_back(queue[j].peer);
+    }
+    start_match(peers);
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < queue.size(); ++i)
+    if (!matched[i])
+      queue[kept++] = queue[i];
+  queue.resize(kept);
+}
+
+static void on_receive(ENetPacket *packet, ENetPeer *peer)
+{
+  const LobbyMessageType type = get_lobby_packet_type(packet);
+  if (type != E_CLIENT_TO_LOBBY_LOGIN && !get_player(peer).loggedIn)
+  {
+    send_error(peer, E_LOBBY_ERROR_NOT_LOGGED_IN);
+    return;
+  }
+  switch (type)
+  {
+  case E_CLIENT_TO_LOBBY_LOGIN:
+    on_login(packet, peer);
+    break;
+  case E_CLIENT_TO_LOBBY_LIST_ROOMS:
+    on_list_rooms(packet, peer);
+    break;
+  case E_CLIENT_TO_LOBBY_CREATE_ROOM:
+    on_create_room(packet, peer);
+    break;
+  case E_CLIENT_TO_LOBBY_JOIN_ROOM:
+    on_join_room(packet, peer);
+    break;
+  case E_CLIENT_TO_LOBBY_LEAVE_ROOM:
+    leave_room(peer);
+    send_room(peer, RoomInfo(), false);
+    break;
+  case E_CLIENT_TO_LOBBY_START_ROOM:
+    on_start_room(peer);
+    break;
+  case E_CLIENT_TO_LOBBY_QUEUE:
+    on_queue(peer);
+    break;
+  case E_CLIENT_TO_LOBBY_CANCEL_QUEUE:
+    leave_queue(peer);
+    break;
+  default:
+    break;
+  };
+}
+
+static GameServer *find_game_server(const ENetPeer *control)
+{
+  for (GameServer &server : gameServers)
+    if (server.control == control)
+      return &server;
+  return nullptr;
+}
+
+static void on_register(ENetPacket *packet, ENetPeer *peer)
+{
+  GameId game = E_GAME_COUNT;
+  uint16_t gamePort = 0;
+  uint16_t maxPeers = 0;
+  if (!deserialize_register(packet, game, gamePort, maxPeers))
+    return;
+  GameServer *server = find_game_server(peer);
+  if (!server)
+  {
+    gameServers.emplace_back();
+    server = &gameServers.back();
+  }
+  // the control port is loopback only, players reach the server on the same host
+  server->address.host = peer->address.host;
+  server->address.port = gamePort;
+  server->control = peer;
+  server->game = game;
+  server->maxPeers = maxPeers;
+  server->lastReport = enet_time_get();
+  char ip[64];
+  enet_address_get_host_ip(&server->address, ip, sizeof(ip));
+  printf("Game server %s %s:%u registered, %u peers\n", game_name(game), ip, gamePort, maxPeers);
+}
+
+static void on_load(ENetPacket *packet, ENetPeer *peer)
+{
+  GameServer *server = find_game_server(peer);
+  ServerLoad load;
+  if (!server || !deserialize_load(packet, load))
+    return;
+  server->load = load;
+  server->lastReport = enet_time_get();
+  const bool overloaded = load.tickP99 > drainTickUs || load.peers >= server->maxPeers;
+  const bool recovered = load.tickP99 < drainTickUs / 4 * 3 && load.peers < server->maxPeers;
+  if (server->draining == overloaded || (server->draining && !recovered))
+    return;
+  server->draining = overloaded;
+  printf("Game server on port %u %s: %u peers, %u entities, tick p99 %u us\n", server->address.port,
+         overloaded ? "draining" : "back in rotation", load.peers, load.entities, load.tickP99);
+}
+
+static void on_control_packet(ENetPacket *packet, ENetPeer *peer)
+{
+  switch (get_control_packet_type(packet))
+  {
+  case E_SERVER_TO_LOBBY_REGISTER:
+    on_register(packet, peer);
+    break;
+  case E_SERVER_TO_LOBBY_LOAD:
+    on_load(packet, peer);
+    break;
+  default:
+    break;
+  };
+}
+
+static void service_control()
+{
+  ENetEvent event;
+  while (enet_host_service(controlHost, &event, 0) > 0)
+  {
+    switch (event.type)
+    {
+    case ENET_EVENT_TYPE_RECEIVE:
+      on_control_packet(event.packet, event.peer);
+      enet_packet_destroy(event.packet);
+      break;
+    case ENET_EVENT_TYPE_DISCONNECT:
+      if (GameServer *server = find_game_server(event.peer))
+      {
+        printf("Game server on port %u gone\n", server->address.port);
+        gameServers.erase(gameServers.begin() + (server - gameServers.data()));
+      }
+      break;
+    default:
+      break;
+    };
+  }
+}
+
+static void service_players()
+{
+  ENetEvent event;
+  while (enet_host_service(host, &event, 0) > 0)
+  {
+    switch (event.type)
+    {
+    case ENET_EVENT_TYPE_CONNECT:
+      enet_peer_ping_interval(event.peer, LOBBY_PING_INTERVAL);
+      get_player(event.peer) = LobbyPlayer();
+      break;
+    case ENET_EVENT_TYPE_RECEIVE:
+      on_receive(event.packet, event.peer);
+      enet_packet_destroy(event.packet);
+      break;
+    case ENET_EVENT_TYPE_DISCONNECT:
+      leave_room(event.peer);
+      leave_queue(event.peer);
+      get_player(event.peer) = LobbyPlayer();
+      break;
+    default:
+      break;
+    };
+  }
+}
+
+// [game@]host:port, w10 if the game is left out
+static bool add_game_server(const char *arg)
+{
+  GameServer server;
+  const char *host_port = arg;
+  if (const char *at = strchr(arg, '@'))
+  {
+    if (!parse_game(std::string(arg, at).c_str(), server.game))
+      return false;
+    host_port = at + 1;
+  }
+  const char *colon = strrchr(host_port, ':');
+  if (!colon)
+    return false;
+  if (enet_address_set_host(&server.address, std::string(host_port, colon).c_str()) != 0)
+    return false;
+  server.address.port = uint16_t(atoi(colon + 1));
+  gameServers.push_back(server);
+  return true;
+}
 
 int main(int argc, const char **argv)
 {
@@ -8,42 +562,74 @@ int main(int argc, const char **argv)
     printf("Cannot init ENet");
     return 1;
   }
-  ENetAddress address;
+  // lobby [--port port] [--control-port port] [--drain-tick-ms ms] [--game-server [w4@|w10@]host:port]...
+  // game servers register on 127.0.0.1:control-port (w10_server --lobby host:port) and
+  // are drained while their tick p99 is over drain-tick-ms; --game-server adds a fixed
+  // one that doesn't report, used only when no registered server of its game has room
+  uint16_t port = LOBBY_PORT;
+  uint16_t controlPort = LOBBY_CONTROL_PORT;
+  for (int i = 1; i + 1 < argc; ++i)
+  {
+    if (strcmp(argv[i], "--port") == 0)
+      port = uint16_t(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--control-port") == 0)
+      controlPort = uint16_t(atoi(argv[++i]));
+    else if (strcmp(argv[i], "--drain-tick-ms") == 0)
+      drainTickUs = uint32_t(atof(argv[++i]) * 1000.0);
+    else if (strcmp(argv[i], "--game-server") == 0 && !add_game_server(argv[++i]))
+    {
+      printf("Bad game server address %s\n", argv[i]);
+      return 1;
+    }
+  }
 
+  ENetAddress address;
   address.host = ENET_HOST_ANY;
-  address.port = 10887;
-
-  ENetHost *server = enet_host_create(&address, 32, 2, 0, 0);
+  address.port = port;
 
-  if (!server)
+  host = enet_host_create(&address, LOBBY_MAX_PEERS, 1, 0, 0);
+  if (!host)
   {
     printf("Cannot create ENet server\n");
     return 1;
   }
+  players.resize(host->peerCount);
 
+  ENetAddress controlAddress;
+  enet_address_set_host_ip(&controlAddress, "127.0.0.1");
+  controlAddress.port = controlPort;
+  controlHost = enet_host_create(&controlAddress, CONTROL_MAX_PEERS, 1, 0, 0);
+  if (!controlHost)
+  {
+    printf("Cannot create the control host on port %u\n", controlPort);
+    return 1;
+  }
+
+  uint32_t nextMatchmaking = enet_time_get();
   while (true)
   {
-    ENetEvent event;
-    while (enet_host_service(server, &event, 10) > 0)
+    const uint32_t now = enet_time_get();
+    if (int32_t(now - nextMatchmaking) >= 0)
     {
-      switch (event.type)
-      {
-      case ENET_EVENT_TYPE_CONNECT:
-        printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        printf("Packet received '%s'\n", event.packet->data);
-        enet_packet_destroy(event.packet);
-        break;
-      default:
-        break;
-      };
+      run_matchmaking();
+      // match starts out now, not when the next packet wakes us
+      enet_host_flush(host);
+      nextMatchmaking = now + MATCHMAKING_INTERVAL;
     }
+    // sleeps until either socket has a packet or matchmaking is due
+    ENetSocketSet readSet;
+    ENET_SOCKETSET_EMPTY(readSet);
+    ENET_SOCKETSET_ADD(readSet, host->socket);
+    ENET_SOCKETSET_ADD(readSet, controlHost->socket);
+    enet_socketset_select(std::max(host->socket, controlHost->socket), &readSet, nullptr,
+                          nextMatchmaking - now);
+    service_control();
+    service_players();
   }
 
-  enet_host_destroy(server);
+  enet_host_destroy(controlHost);
+  enet_host_destroy(host);
 
   atexit(enet_deinitialize);
   return 0;
 }
-
@@ -0,0 +1,301 @@
+#include "protocol.h"
+#include "packet_reader.h"
+#include <algorithm>
+#include <cstring> // memcpy, strcmp
+
+static const char *LOBBY_ERROR_NAMES[] = {
+  "not logged in", "already in a room or queued", "no such room", "room is full",
+  "only the owner can do that", "no game server available", "the room is for another game"
+};
+static_assert(sizeof(LOBBY_ERROR_NAMES) / sizeof(LOBBY_ERROR_NAMES[0]) == E_LOBBY_ERROR_COUNT,
+              "every error needs a name");
+
+const char *lobby_error_name(LobbyError error)
+{
+  return error < E_LOBBY_ERROR_COUNT ? LOBBY_ERROR_NAMES[error] : "unknown error";
+}
+
+static const char *GAME_NAMES[] = {"w4", "w10"};
+static_assert(sizeof(GAME_NAMES) / sizeof(GAME_NAMES[0]) == E_GAME_COUNT, "every game needs a name");
+
+const char *game_name(GameId game)
+{
+  return game < E_GAME_COUNT ? GAME_NAMES[game] : "unknown game";
+}
+
+bool parse_game(const char *name, GameId &game)
+{
+  for (uint8_t i = 0; i < E_GAME_COUNT; ++i)
+    if (strcmp(name, GAME_NAMES[i]) == 0)
+    {
+      game = GameId(i);
+      return true;
+    }
+  return false;
+}
+
+LobbyMessageType get_lobby_packet_type(const ENetPacket *packet)
+{
+  if (!packet->dataLength || *packet->data >= E_LOBBY_MESSAGE_TYPE_COUNT)
+    return E_LOBBY_MESSAGE_TYPE_COUNT;
+  return LobbyMessageType(*packet->data);
+}
+
+ControlMessageType get_control_packet_type(const ENetPacket *packet)
+{
+  if (!packet->dataLength || *packet->data >= E_CONTROL_MESSAGE_TYPE_COUNT)
+    return E_CONTROL_MESSAGE_TYPE_COUNT;
+  return ControlMessageType(*packet->data);
+}
+
+template<typename T>
+static void write(std::vector<uint8_t> &out, const T &val)
+{
+  const size_t at = out.size();
+  out.resize(at + sizeof(T));
+  memcpy(out.data() + at, &val, sizeof(T));
+}
+
+static void write_string(std::vector<uint8_t> &out, const std::string &str)
+{
+  const uint8_t size = uint8_t(std::min(str.size(), LOBBY_MAX_NAME));
+  write(out, size);
+  out.insert(out.end(), str.begin(), str.begin() + size);
+}
+
+static std::string read_string(PacketReader &reader)
+{
+  const uint8_t size = reader.read<uint8_t>();
+  if (size > LOBBY_MAX_NAME)
+  {
+    reader.read_bytes(reader.remaining() + 1); // fails the reader
+    return std::string();
+  }
+  const uint8_t *data = reader.read_bytes(size);
+  return data ? std::string((const char*)data, size) : std::string();
+}
+
+// everything in the lobby is reliable and small, one channel keeps it in order
+static void send_message(ENetPeer *peer, const std::vector<uint8_t> &data)
+{
+  enet_peer_send(peer, 0, enet_packet_create(data.data(), data.size(), ENET_PACKET_FLAG_RELIABLE));
+}
+
+static void send_type(ENetPeer *peer, LobbyMessageType type)
+{
+  send_message(peer, std::vector<uint8_t>(1, type));
+}
+
+void send_login(ENetPeer *peer, const std::string &name, uint16_t skill, GameId game)
+{
+  std::vector<uint8_t> data(1, E_CLIENT_TO_LOBBY_LOGIN);
+  write_string(data, name);
+  write(data, skill);
+  write(data, game);
+  send_message(peer, data);
+}
+
+void send_list_rooms(ENetPeer *peer, uint32_t first)
+{
+  std::vector<uint8_t> data(1, E_CLIENT_TO_LOBBY_LIST_ROOMS);
+  write(data, first);
+  send_message(peer, data);
+}
+
+void send_create_room(ENetPeer *peer, const std::string &name, uint8_t max_players)
+{
+  std::vector<uint8_t> data(1, E_CLIENT_TO_LOBBY_CREATE_ROOM);
+  write_string(data, name);
+  write(data, max_players);
+  send_message(peer, data);
+}
+
+void send_join_room(ENetPeer *peer, uint32_t room_id)
+{
+  std::vector<uint8_t> data(1, E_CLIENT_TO_LOBBY_JOIN_ROOM);
+  write(data, room_id);
+  send_message(peer, data);
+}
+
+void send_leave_room(ENetPeer *peer)
+{
+  send_type(peer, E_CLIENT_TO_LOBBY_LEAVE_ROOM);
+}
+
+void send_start_room(ENetPeer *peer)
+{
+  send_type(peer, E_CLIENT_TO_LOBBY_START_ROOM);
+}
+
+void send_queue(ENetPeer *peer)
+{
+  send_type(peer, E_CLIENT_TO_LOBBY_QUEUE);
+}
+
+void send_cancel_queue(ENetPeer *peer)
+{
+  send_type(peer, E_CLIENT_TO_LOBBY_CANCEL_QUEUE);
+}
+
+static void write_room(std::vector<uint8_t> &data, const RoomInfo &room)
+{
+  write(data, room.id);
+  write(data, room.players);
+  write(data, room.maxPlayers);
+  write_string(data, room.name);
+}
+
+static void read_room(PacketReader &reader, RoomInfo &room)
+{
+  reader.read(room.id);
+  reader.read(room.players);
+  reader.read(room.maxPlayers);
+  room.name = read_string(reader);
+}
+
+void send_room_list(ENetPeer *peer, uint32_t total, const std::vector<RoomInfo> &rooms)
+{
+  std::vector<uint8_t> data(1, E_LOBBY_TO_CLIENT_ROOM_LIST);
+  write(data, total);
+  write(data, uint8_t(rooms.size()));
+  for (const RoomInfo &room : rooms)
+    write_room(data, room);
+  send_message(peer, data);
+}
+
+void send_room(ENetPeer *peer, const RoomInfo &room, bool owner)
+{
+  std::vector<uint8_t> data(1, E_LOBBY_TO_CLIENT_ROOM);
+  write_room(data, room);
+  write(data, uint8_t(owner));
+  send_message(peer, data);
+}
+
+void send_queued(ENetPeer *peer, uint8_t skill_bucket, uint8_t latency_bucket)
+{
+  std::vector<uint8_t> data(1, E_LOBBY_TO_CLIENT_QUEUED);
+  write(data, skill_bucket);
+  write(data, latency_bucket);
+  send_message(peer, data);
+}
+
+void send_match_start(ENetPeer *peer, const MatchInfo &match)
+{
+  std::vector<uint8_t> data(1, E_LOBBY_TO_CLIENT_MATCH_START);
+  write(data, match.matchId);
+  write(data, match.server.host);
+  write(data, match.server.port);
+  send_message(peer, data);
+}
+
+void send_error(ENetPeer *peer, LobbyError error)
+{
+  std::vector<uint8_t> data(1, E_LOBBY_TO_CLIENT_ERROR);
+  write(data, error);
+  send_message(peer, data);
+}
+
+bool deserialize_login(ENetPacket *packet, std::string &name, uint16_t &skill, GameId &game)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  name = read_string(reader);
+  reader.read(skill);
+  reader.read(game);
+  return reader.done() && game < E_GAME_COUNT;
+}
+
+bool deserialize_list_rooms(ENetPacket *packet, uint32_t &first)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(first);
+  return reader.done();
+}
+
+bool deserialize_create_room(ENetPacket *packet, std::string &name, uint8_t &max_players)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  name = read_string(reader);
+  reader.read(max_players);
+  return reader.done() && max_players > 0 && max_players <= LOBBY_MAX_ROOM_PLAYERS;
+}
+
+bool deserialize_join_room(ENetPacket *packet, uint32_t &room_id)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(room_id);
+  return reader.done();
+}
+
+bool deserialize_room_list(ENetPacket *packet, uint32_t &total, std::vector<RoomInfo> &rooms)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(total);
+  const uint8_t count = reader.read<uint8_t>();
+  if (count > LOBBY_ROOM_LIST_PAGE)
+    return false;
+  rooms.resize(count);
+  for (RoomInfo &room : rooms)
+    read_room(reader, room);
+  return reader.done();
+}
+
+bool deserialize_room(ENetPacket *packet, RoomInfo &room, bool &owner)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  read_room(reader, room);
+  owner = reader.read<uint8_t>() != 0;
+  return reader.done();
+}
+
+bool deserialize_queued(ENetPacket *packet, uint8_t &skill_bucket, uint8_t &latency_bucket)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(skill_bucket);
+  reader.read(latency_bucket);
+  return reader.done();
+}
+
+bool deserialize_match_start(ENetPacket *packet, MatchInfo &match)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(match.matchId);
+  reader.read(match.server.host);
+  reader.read(match.server.port);
+  return reader.done();
+}
+
+bool deserialize_error(ENetPacket *packet, LobbyError &error)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(error);
+  return reader.done();
+}
+
+bool deserialize_register(ENetPacket *packet, GameId &game, uint16_t &game_port, uint16_t &max_peers)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(game);
+  reader.read(game_port);
+  reader.read(max_peers);
+  return reader.done() && game < E_GAME_COUNT && game_port && max_peers;
+}
+
+bool deserialize_load(ENetPacket *packet, ServerLoad &load)
+{
+  PacketReader reader(packet);
+  reader.read<uint8_t>();
+  reader.read(load.peers);
+  reader.read(load.entities);
+  reader.read(load.tickP99);
+  return reader.done();
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <enet/enet.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+const uint16_t LOBBY_PORT = 10887;
+
+enum LobbyMessageType : uint8_t
+{
+  E_CLIENT_TO_LOBBY_LOGIN = 0,
+  E_CLIENT_TO_LOBBY_LIST_ROOMS,
+  E_CLIENT_TO_LOBBY_CREATE_ROOM,
+  E_CLIENT_TO_LOBBY_JOIN_ROOM,
+  E_CLIENT_TO_LOBBY_LEAVE_ROOM,
+  E_CLIENT_TO_LOBBY_START_ROOM,
+  E_CLIENT_TO_LOBBY_QUEUE,
+  E_CLIENT_TO_LOBBY_CANCEL_QUEUE,
+  E_LOBBY_TO_CLIENT_ROOM_LIST,
+  E_LOBBY_TO_CLIENT_ROOM,
+  E_LOBBY_TO_CLIENT_QUEUED,
+  E_LOBBY_TO_CLIENT_MATCH_START,
+  E_LOBBY_TO_CLIENT_ERROR,
+  E_LOBBY_MESSAGE_TYPE_COUNT
+};
+
+enum LobbyError : uint8_t
+{
+  E_LOBBY_ERROR_NOT_LOGGED_IN = 0,
+  E_LOBBY_ERROR_BUSY,          // already in a room or the queue
+  E_LOBBY_ERROR_NO_ROOM,
+  E_LOBBY_ERROR_ROOM_FULL,
+  E_LOBBY_ERROR_NOT_OWNER,
+  E_LOBBY_ERROR_NO_GAME_SERVER,
+  E_LOBBY_ERROR_WRONG_GAME,    // the room is for another game
+  E_LOBBY_ERROR_COUNT
+};
+const char *lobby_error_name(LobbyError error);
+
+// The game a server runs and a player plays. w4 and w10 don't speak each other's
+// protocol, so players only ever share rooms, queues and servers with their own game.
+enum GameId : uint8_t
+{
+  E_GAME_W4 = 0,
+  E_GAME_W10,
+  E_GAME_COUNT
+};
+const char *game_name(GameId game);
+// "w4" or "w10"
+bool parse_game(const char *name, GameId &game);
+
+// names are length prefixed, anything longer is cut
+const size_t LOBBY_MAX_NAME = 32;
+const uint8_t LOBBY_MAX_ROOM_PLAYERS = 16;
+// a room list never gets fragmented, clients page through with `first`
+const size_t LOBBY_ROOM_LIST_PAGE = 32;
+
+struct RoomInfo
+{
+  uint32_t id = 0;
+  uint8_t players = 0;
+  uint8_t maxPlayers = 0;
+  std::string name;
+};
+
+struct MatchInfo
+{
+  uint32_t matchId = 0;
+  ENetAddress server = {0, 0}; // host in network order, as ENet keeps it
+};
+
+// Game servers register on a second, loopback only port and report their load every
+// LOAD_REPORT_INTERVAL. The servers' side is lobby_link in w4 and w10, which has to
+// write exactly this:
+//   register: type, uint8 game id, uint16 game port, uint16 max peers
+//   load: type, uint16 peers, uint32 entities, uint32 tick p99 (us)
+const uint16_t LOBBY_CONTROL_PORT = 10888;
+const uint32_t LOAD_REPORT_INTERVAL = 2000; // ms
+
+enum ControlMessageType : uint8_t
+{
+  E_SERVER_TO_LOBBY_REGISTER = 0,
+  E_SERVER_TO_LOBBY_LOAD,
+  E_CONTROL_MESSAGE_TYPE_COUNT
+};
+
+struct ServerLoad
+{
+  uint16_t peers = 0;
+  uint32_t entities = 0;
+  uint32_t tickP99 = 0; // us, over the last report interval
+};
+
+LobbyMessageType get_lobby_packet_type(const ENetPacket *packet);
+ControlMessageType get_control_packet_type(const ENetPacket *packet);
+
+void send_login(ENetPeer *peer, const std::string &name, uint16_t skill, GameId game);
+void send_list_rooms(ENetPeer *peer, uint32_t first);
+void send_create_room(ENetPeer *peer, const std::string &name, uint8_t max_players);
+void send_join_room(ENetPeer *peer, uint32_t room_id);
+void send_leave_room(ENetPeer *peer);
+void send_start_room(ENetPeer *peer);
+void send_queue(ENetPeer *peer);
+void send_cancel_queue(ENetPeer *peer);
+
+// total is every room there is, rooms just the page
+void send_room_list(ENetPeer *peer, uint32_t total, const std::vector<RoomInfo> &rooms);
+// the room the peer is in now, id 0 - none any more
+void send_room(ENetPeer *peer, const RoomInfo &room, bool owner);
+void send_queued(ENetPeer *peer, uint8_t skill_bucket, uint8_t latency_bucket);
+void send_match_start(ENetPeer *peer, const MatchInfo &match);
+void send_error(ENetPeer *peer, LobbyError error);
+
+// all false if the packet is malformed, the outputs may be partly written then
+bool deserialize_login(ENetPacket *packet, std::string &name, uint16_t &skill, GameId &game);
+bool deserialize_list_rooms(ENetPacket *packet, uint32_t &first);
+bool deserialize_create_room(ENetPacket *packet, std::string &name, uint8_t &max_players);
+bool deserialize_join_room(ENetPacket *packet, uint32_t &room_id);
+bool deserialize_room_list(ENetPacket *packet, uint32_t &total, std::vector<RoomInfo> &rooms);
+bool deserialize_room(ENetPacket *packet, RoomInfo &room, bool &owner);
+bool deserialize_queued(ENetPacket *packet, uint8_t &skill_bucket, uint8_t &latency_bucket);
+bool deserialize_match_start(ENetPacket *packet, MatchInfo &match);
+bool deserialize_error(ENetPacket *packet, LobbyError &error);
+bool deserialize_register(ENetPacket *packet, GameId &game, uint16_t &game_port, uint16_t &max_peers);
+bool deserialize_load(ENetPacket *packet, ServerLoad &load);
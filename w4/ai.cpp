@@ -0,0 +1,166 @@
+#include "ai.h"
+#include <cmath>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AI_SSE 1
+#else
+#define AI_SSE 0
+#endif
+
+static inline uint32_t rotl(uint32_t v, int k)
+{
+  return (v << k) | (v >> (32 - k));
+}
+
+void Xoshiro128::seed(uint64_t seed)
+{
+  // splitmix64 to spread the seed over the whole state
+  for (uint32_t &word : s)
+  {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    word = uint32_t(z ^ (z >> 31));
+  }
+}
+
+uint32_t Xoshiro128::next()
+{
+  const uint32_t result = s[0] + s[3];
+  const uint32_t t = s[1] << 9;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 11);
+  return result;
+}
+
+Xoshiro128 &thread_rng()
+{
+  thread_local Xoshiro128 rng = []()
+  {
+    std::random_device rd;
+    Xoshiro128 r;
+    r.seed((uint64_t(rd()) << 32) | rd());
+    return r;
+  }();
+  return rng;
+}
+
+void bots_add(BotSwarm &bots, uint32_t entity_idx)
+{
+  Xoshiro128 &rng = thread_rng();
+  bots.entityIdx.push_back(entity_idx);
+  bots.x.push_back(0.f);
+  bots.y.push_back(0.f);
+  bots.targetX.push_back(rng.uniform(bots.targetLo, bots.targetHi));
+  bots.targetY.push_back(rng.uniform(bots.targetLo, bots.targetHi));
+}
+
+void bots_on_entity_moved(BotSwarm &bots, uint32_t from, uint32_t to)
+{
+  for (uint32_t &idx : bots.entityIdx)
+    if (idx == from)
+      idx = to;
+}
+
+static void find_arrived(BotSwarm &bots)
+{
+  const size_t n = bots.x.size();
+  const float *x = bots.x.data();
+  const float *y = bots.y.data();
+  const float *tx = bots.targetX.data();
+  const float *ty = bots.targetY.data();
+  bots.arrived.clear();
+  size_t i = 0;
+#if AI_SSE
+  const __m128 one = _mm_set1_ps(1.f);
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(tx + i), _mm_loadu_ps(x + i));
+    __m128 dy = _mm_sub_ps(_mm_loadu_ps(ty + i), _mm_loadu_ps(y + i));
+    __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+    int mask = _mm_movemask_ps(_mm_cmplt_ps(d2, one));
+    if (!mask)
+      continue;
+    for (int lane = 0; lane < 4; ++lane)
+      if (mask & (1 << lane))
+        bots.arrived.push_back(uint32_t(i + lane));
+  }
+#endif
+  for (; i < n; ++i)
+  {
+    float dx = tx[i] - x[i];
+    float dy = ty[i] - y[i];
+    if (dx * dx + dy * dy < 1.f)
+      bots.arrived.push_back(uint32_t(i));
+  }
+}
+
+static void steer(BotSwarm &bots, float step)
+{
+  const size_t n = bots.x.size();
+  float *x = bots.x.data();
+  float *y = bots.y.data();
+  const float *tx = bots.targetX.data();
+  const float *ty = bots.targetY.data();
+  size_t i = 0;
+#if AI_SSE
+  const __m128 stepV = _mm_set1_ps(step);
+  const __m128 zero = _mm_setzero_ps();
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 px = _mm_loadu_ps(x + i);
+    __m128 py = _mm_loadu_ps(y + i);
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(tx + i), px);
+    __m128 dy = _mm_sub_ps(_mm_loadu_ps(ty + i), py);
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    // a bot sitting exactly on its target doesn't move, same as Vector2Normalize of zero
+    __m128 k = _mm_and_ps(_mm_div_ps(stepV, len), _mm_cmpgt_ps(len, zero));
+    _mm_storeu_ps(x + i, _mm_add_ps(px, _mm_mul_ps(dx, k)));
+    _mm_storeu_ps(y + i, _mm_add_ps(py, _mm_mul_ps(dy, k)));
+  }
+#endif
+  for (; i < n; ++i)
+  {
+    float dx = tx[i] - x[i];
+    float dy = ty[i] - y[i];
+    float len = sqrtf(dx * dx + dy * dy);
+    float k = len > 0.f ? step / len : 0.f;
+    x[i] += dx * k;
+    y[i] += dy * k;
+  }
+}
+
+void bots_steer(BotSwarm &bots, std::vector<Entity> &entities, float step)
+{
+  const size_t n = bots.entityIdx.size();
+  // positions change outside of the ai too (collisions, teleports), gather every tick
+  for (size_t i = 0; i < n; ++i)
+  {
+    const Entity &e = entities[bots.entityIdx[i]];
+    bots.x[i] = e.pos.x;
+    bots.y[i] = e.pos.y;
+  }
+
+  find_arrived(bots);
+  Xoshiro128 &rng = thread_rng();
+  for (uint32_t i : bots.arrived)
+  {
+    bots.targetX[i] = rng.uniform(bots.targetLo, bots.targetHi);
+    bots.targetY[i] = rng.uniform(bots.targetLo, bots.targetHi);
+  }
+
+  steer(bots, step);
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    Entity &e = entities[bots.entityIdx[i]];
+    e.pos.x = bots.x[i];
+    e.pos.y = bots.y[i];
+  }
+}
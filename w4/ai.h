@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+
+// xoshiro128+, small and fast enough to draw targets for thousands of bots per tick
+struct Xoshiro128
+{
+  uint32_t s[4];
+
+  void seed(uint64_t seed);
+  uint32_t next();
+  float uniform(float lo, float hi) { return lo + (next() >> 8) * (1.f / 16777216.f) * (hi - lo); }
+};
+
+// per thread generator, seeded from std::random_device on first use
+Xoshiro128 &thread_rng();
+
+// Bots steered as one batch. Targets and a gathered copy of positions live in SoA
+// arrays, the entities themselves stay in the server's vector.
+struct BotSwarm
+{
+  std::vector<uint32_t> entityIdx;
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> targetX;
+  std::vector<float> targetY;
+  std::vector<uint32_t> arrived; // scratch, indices of bots that need a new target
+
+  float targetLo = -600.f;
+  float targetHi = 600.f;
+};
+
+void bots_add(BotSwarm &bots, uint32_t entity_idx);
+// the entity store moved an entity from one slot to another (swap-and-pop removal)
+void bots_on_entity_moved(BotSwarm &bots, uint32_t from, uint32_t to);
+// moves every bot `step` units toward its target, bots closer than 1 unit get a new one first
+void bots_steer(BotSwarm &bots, std::vector<Entity> &entities, float step);
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// Traffic capture. Every payload sent or received (time, peer, channel, bytes) is
+// appended to an in-memory chunk, full chunks are written out by a background thread
+// so the tick never waits on the disk. Nothing is recorded until capture_open.
+//
+// File: "NETCAP1\0", 8 byte protocol tag, then records of
+//   varint time delta (us), uint8 kind << 6 | channel, uint16 peer, varint size, bytes
+enum CaptureKind : uint8_t
+{
+  E_CAPTURE_IN = 0,
+  E_CAPTURE_OUT,
+  E_CAPTURE_CONNECT,
+  E_CAPTURE_DISCONNECT
+};
+// the channel only gets the low 6 bits of a record's kind byte
+const size_t CAPTURE_MAX_CHANNELS = 64;
+
+bool capture_open(const char *path, const char *protocol_tag);
+// writes out everything recorded so far and stops the writer
+void capture_close();
+bool capture_enabled();
+void capture_record(CaptureKind kind, uint16_t peer, uint8_t channel, const uint8_t *data,
+                    size_t size);
+// records that didn't fit while the writer was behind
+uint64_t capture_dropped();
+
+struct CaptureRecord
+{
+  uint64_t timeUs = 0; // since capture_open
+  CaptureKind kind = E_CAPTURE_IN;
+  uint16_t peer = 0;
+  uint8_t channel = 0;
+  std::vector<uint8_t> data;
+};
+
+struct CaptureReader
+{
+  FILE *file = nullptr;
+  char protocol[9] = {};
+  uint64_t timeUs = 0;
+};
+
+bool capture_reader_open(CaptureReader &reader, const char *path);
+// false at the end of the file or on a truncated record
+bool capture_read(CaptureReader &reader, CaptureRecord &record);
+void capture_reader_close(CaptureReader &reader);
@@ -0,0 +1,219 @@
+#include "client_net.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "protocol.h"
+#include "spsc_queue.h"
+
+// several frames of snapshots with room to spare, what doesn't fit waits on the
+// network thread until the render loop catches up
+const size_t CLIENT_EVENT_QUEUE_SIZE = 4096;
+
+static SpscQueue<ClientEvent, CLIENT_EVENT_QUEUE_SIZE> events;
+// events the queue had no room for, kept in order in front of any new ones
+static std::deque<ClientEvent> backlog;
+// x and y bits, one word so the pair is always read together; nothing is sent until
+// the render loop sets a position
+static std::atomic<uint64_t> state{0};
+static std::atomic<bool> hasState{false};
+
+static ENetHost *client = nullptr;
+static ENetPeer *serverPeer = nullptr;
+static std::thread thread;
+static std::atomic<bool> running{false};
+static uint32_t stateRate = CLIENT_STATE_RATE;
+
+// network thread only
+static uint16_t controlledEid = invalid_entity;
+
+static void emit(ClientEventType type, const Entity &entity)
+{
+  const ClientEvent event = {type, entity};
+  if (backlog.empty() && events.push(event))
+    return;
+  backlog.push_back(event);
+}
+
+static void flush_backlog()
+{
+  while (!backlog.empty() && events.push(backlog.front()))
+    backlog.pop_front();
+}
+
+static void emit_eid(ClientEventType type, uint16_t eid)
+{
+  Entity entity;
+  entity.eid = eid;
+  emit(type, entity);
+}
+
+static void on_receive(ENetPacket *packet)
+{
+  switch (get_packet_type(packet))
+  {
+  case E_SERVER_TO_CLIENT_NEW_ENTITY:
+  {
+    Entity newEntity;
+    deserialize_new_entity(packet, newEntity);
+    emit(E_CLIENT_EVENT_NEW_ENTITY, newEntity);
+    printf("new entity\n");
+    break;
+  }
+  case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
+    deserialize_set_controlled_entity(packet, controlledEid);
+    emit_eid(E_CLIENT_EVENT_CONTROLLED_ENTITY, controlledEid);
+    break;
+  case E_SERVER_TO_CLIENT_SNAPSHOT:
+  {
+    Entity entity;
+    deserialize_snapshot(packet, entity.eid, entity.pos, entity.size);
+    emit(E_CLIENT_EVENT_SNAPSHOT, entity);
+    break;
+  }
+  case E_SERVER_TO_CLIENT_SNAPSHOT_BATCH:
+  {
+    static std::vector<Entity> batch;
+    deserialize_snapshot_batch(packet, batch);
+    // the controlled entity moves here first, the server's copy of it is older
+    for (const Entity &entity : batch)
+      if (entity.eid != controlledEid)
+        emit(E_CLIENT_EVENT_SNAPSHOT, entity);
+    break;
+  }
+  case E_SERVER_TO_CLIENT_DESPAWN:
+  {
+    std::vector<uint16_t> eids;
+    deserialize_despawn(packet, eids);
+    for (uint16_t eid : eids)
+    {
+      if (eid == controlledEid)
+        controlledEid = invalid_entity;
+      emit_eid(E_CLIENT_EVENT_DESPAWN, eid);
+    }
+    break;
+  }
+  default:
+    break;
+  };
+}
+
+static void on_event(const ENetEvent &event)
+{
+  switch (event.type)
+  {
+  case ENET_EVENT_TYPE_CONNECT:
+    printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
+    send_join(serverPeer);
+    break;
+  case ENET_EVENT_TYPE_RECEIVE:
+    on_receive(event.packet);
+    enet_packet_destroy(event.packet);
+    break;
+  default:
+    break;
+  };
+}
+
+static void send_state()
+{
+  if (controlledEid == invalid_entity || !hasState.load(std::memory_order_acquire))
+    return;
+  const uint64_t bits = state.load(std::memory_order_relaxed);
+  const uint32_t xBits = uint32_t(bits);
+  const uint32_t yBits = uint32_t(bits >> 32);
+  Vector2 pos;
+  memcpy(&pos.x, &xBits, sizeof(float));
+  memcpy(&pos.y, &yBits, sizeof(float));
+  send_entity_state(serverPeer, controlledEid, pos);
+  // out now rather than on the next service call
+  enet_host_flush(client);
+}
+
+static void net_loop()
+{
+  typedef std::chrono::steady_clock clock;
+  const auto period = std::chrono::microseconds(1000000 / stateRate);
+  auto nextSend = clock::now();
+  while (running.load(std::memory_order_relaxed))
+  {
+    flush_backlog();
+    auto now = clock::now();
+    if (now >= nextSend)
+    {
+      send_state();
+      nextSend += period;
+      // a stalled thread doesn't make up for the ticks it missed with a burst
+      if (nextSend <= now)
+        nextSend = now + period;
+    }
+    // sleep in the socket until a packet arrives or it's time for the next send
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(nextSend - clock::now());
+    const enet_uint32 timeout = wait.count() > 0 ? enet_uint32((wait.count() + 999) / 1000) : 0;
+    ENetEvent event;
+    if (enet_host_service(client, &event, timeout) > 0)
+    {
+      on_event(event);
+      while (enet_host_service(client, &event, 0) > 0)
+        on_event(event);
+    }
+  }
+}
+
+bool client_net_start(const char *host, uint16_t port, uint32_t state_rate)
+{
+  if (running || !state_rate)
+    return false;
+  client = enet_host_create(nullptr, 1, 2, 0, 0);
+  if (!client)
+  {
+    printf("Cannot create ENet client\n");
+    return false;
+  }
+
+  ENetAddress address;
+  enet_address_set_host(&address, host);
+  address.port = port;
+  // the server's channel limit cuts this down to the layout it was configured with
+  serverPeer = enet_host_connect(client, &address, ENET_PROTOCOL_MAXIMUM_CHANNEL_COUNT, 0);
+  if (!serverPeer)
+  {
+    printf("Cannot connect to server");
+    enet_host_destroy(client);
+    client = nullptr;
+    return false;
+  }
+  stateRate = state_rate;
+  running = true;
+  thread = std::thread(net_loop);
+  return true;
+}
+
+void client_net_stop()
+{
+  if (!running)
+    return;
+  running = false;
+  thread.join();
+  enet_peer_disconnect_now(serverPeer, 0);
+  enet_host_destroy(client);
+  client = nullptr;
+  serverPeer = nullptr;
+}
+
+bool client_net_poll(ClientEvent &event)
+{
+  return events.pop(event);
+}
+
+void client_net_set_state(Vector2 pos)
+{
+  uint32_t xBits, yBits;
+  memcpy(&xBits, &pos.x, sizeof(float));
+  memcpy(&yBits, &pos.y, sizeof(float));
+  state.store(uint64_t(xBits) | (uint64_t(yBits) << 32), std::memory_order_relaxed);
+  hasState.store(true, std::memory_order_release);
+}
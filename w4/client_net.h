@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+#include "entity.h"
+
+// Client networking on its own thread. The thread owns the ENet host, decodes whatever
+// the server sends into events for the render loop and sends the latest position of
+// the controlled entity at a fixed rate, so neither receive latency nor the send rate
+// follow the frame time.
+enum ClientEventType : uint8_t
+{
+  E_CLIENT_EVENT_NEW_ENTITY = 0,   // entity
+  E_CLIENT_EVENT_CONTROLLED_ENTITY, // entity.eid
+  E_CLIENT_EVENT_SNAPSHOT,         // entity.eid, pos, size
+  E_CLIENT_EVENT_DESPAWN           // entity.eid
+};
+
+struct ClientEvent
+{
+  ClientEventType type;
+  Entity entity;
+};
+
+const uint32_t CLIENT_STATE_RATE = 60; // sends per second
+
+// connects and starts the thread, false if the host can't be created or connected
+bool client_net_start(const char *host, uint16_t port, uint32_t state_rate = CLIENT_STATE_RATE);
+void client_net_stop();
+
+// render loop side: the next event in the order the packets came, false when drained
+bool client_net_poll(ClientEvent &event);
+// position of the controlled entity, the network thread sends whatever was set last
+void client_net_set_state(Vector2 pos);
@@ -0,0 +1,377 @@
+#include "collision.h"
+#include "job_system.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COLLISION_SSE 1
+#else
+#define COLLISION_SSE 0
+#endif
+
+// sweep_toi has to round like the SSE lanes, a fused multiply-add in it would change
+// tois; GCC and Clang get -ffp-contract=off for this file from CMakeLists.txt
+#if defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+// big enough that most entities touch a handful of cells, pairs are tested per cell
+const float COLLISION_CELL_SIZE = 128.f;
+const size_t CELL_GRAIN = 64; // cells per job
+const size_t SCAN_GRAIN = 256; // entities per job when scanning against controlled ones
+
+const float MAX_SIZE = 300.f;
+const float MIN_SIZE = 20.f;
+const float TOI_MISS = 2.f;
+
+static float maxStep = INFINITY;
+
+void collisions_set_max_step(float max_step)
+{
+  maxStep = max_step;
+}
+
+static bool contact_less(const CollisionContact &a, const CollisionContact &b)
+{
+  if (a.toi != b.toi)
+    return a.toi < b.toi;
+  return a.eater != b.eater ? a.eater < b.eater : a.eaten < b.eaten;
+}
+
+// a circle over the tick, the capsule it covers is what the broad phase boxes
+struct Sweep
+{
+  Vector2 from;
+  Vector2 to;
+  float size;
+};
+
+static Sweep sweep_of(const Entity &e, const PositionHistory::View &previous, const TeleportMarks &teleported,
+                      size_t idx)
+{
+  Sweep sweep = {e.pos, e.pos, e.size};
+  if (idx < teleported.size() && teleported[idx])
+    return sweep;
+  float previousSize = 0.f;
+  previous.get(e.eid, sweep.from, previousSize);
+  const float dx = sweep.to.x - sweep.from.x;
+  const float dy = sweep.to.y - sweep.from.y;
+  if (dx * dx + dy * dy > maxStep * maxStep)
+    sweep.from = sweep.to;
+  return sweep;
+}
+
+// where a player's view had the entity, standing still; its own sweep if the view
+// doesn't have it
+static Sweep rewound_sweep(const Entity &e, const Sweep &current, const PositionHistory::View &view)
+{
+  Sweep sweep = current;
+  if (view.get(e.eid, sweep.from, sweep.size))
+    sweep.to = sweep.from;
+  return sweep;
+}
+
+// first time in [0, 1] two swept circles touch, from where b is relative to a and how
+// it moves relative to a; TOI_MISS if they don't. The batch path below has to do the
+// very same float ops in the same order, detection is checked against this one bit for bit
+static float sweep_toi(float dx, float dy, float vx, float vy, float r)
+{
+  const float c = dx * dx + dy * dy - r * r;
+  const float a = vx * vx + vy * vy;
+  const float b = dx * vx + dy * vy;
+  const float disc = b * b - a * c;
+  if (c < 0.f)
+    return 0.f;
+  // closing in and the closest approach is near enough
+  if (!(a > 0.f) || !(b < 0.f) || !(disc >= 0.f))
+    return TOI_MISS;
+  const float t = (-b - std::sqrt(std::max(disc, 0.f))) / a;
+  return t <= 1.f ? t : TOI_MISS;
+}
+
+// candidate pairs as SoA, the eater's sweep against the eaten one's
+struct SweepBatch
+{
+  std::vector<float> dx, dy, vx, vy, r;
+  std::vector<float> toi;
+  std::vector<CollisionContact> contacts;
+
+  void clear()
+  {
+    dx.clear(); dy.clear(); vx.clear(); vy.clear(); r.clear();
+    contacts.clear();
+  }
+
+  void push(const Sweep &eater, const Sweep &eaten, const CollisionContact &contact)
+  {
+    dx.push_back(eaten.from.x - eater.from.x);
+    dy.push_back(eaten.from.y - eater.from.y);
+    vx.push_back((eaten.to.x - eaten.from.x) - (eater.to.x - eater.from.x));
+    vy.push_back((eaten.to.y - eaten.from.y) - (eater.to.y - eater.from.y));
+    r.push_back(eater.size + eaten.size);
+    contacts.push_back(contact);
+  }
+
+  // narrow phase over every candidate, the hits go to `out`
+  void solve(std::vector<CollisionContact> &out);
+};
+
+void SweepBatch::solve(std::vector<CollisionContact> &out)
+{
+  const size_t count = contacts.size();
+  toi.resize(count);
+  size_t i = 0;
+#if COLLISION_SSE
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 miss = _mm_set1_ps(TOI_MISS);
+  const __m128 sign = _mm_set1_ps(-0.f);
+  for (; i + 4 <= count; i += 4)
+  {
+    const __m128 dxV = _mm_loadu_ps(dx.data() + i);
+    const __m128 dyV = _mm_loadu_ps(dy.data() + i);
+    const __m128 vxV = _mm_loadu_ps(vx.data() + i);
+    const __m128 vyV = _mm_loadu_ps(vy.data() + i);
+    const __m128 rV = _mm_loadu_ps(r.data() + i);
+    const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(dxV, dxV), _mm_mul_ps(dyV, dyV)), _mm_mul_ps(rV, rV));
+    const __m128 a = _mm_add_ps(_mm_mul_ps(vxV, vxV), _mm_mul_ps(vyV, vyV));
+    const __m128 b = _mm_add_ps(_mm_mul_ps(dxV, vxV), _mm_mul_ps(dyV, vyV));
+    const __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+    const __m128 t = _mm_div_ps(_mm_sub_ps(_mm_xor_ps(b, sign), _mm_sqrt_ps(_mm_max_ps(disc, zero))), a);
+    // ordered compares are false on NaN like the scalar ones
+    const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(a, zero), _mm_cmplt_ps(b, zero)),
+                                  _mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_cmple_ps(t, one)));
+    __m128 result = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, miss));
+    result = _mm_andnot_ps(_mm_cmplt_ps(c, zero), result); // touching already, 0
+    _mm_storeu_ps(toi.data() + i, result);
+  }
+#endif
+  for (; i < count; ++i)
+    toi[i] = sweep_toi(dx[i], dy[i], vx[i], vy[i], r[i]);
+  for (i = 0; i < count; ++i)
+  {
+    if (toi[i] == TOI_MISS)
+      continue;
+    out.push_back(contacts[i]);
+    out.back().toi = toi[i];
+  }
+}
+
+// `a` eats `b` as the pair's controller saw it, see collision.h
+static float eat_toi(const Entity &a, const Entity &b, const PositionHistory::View &previous,
+                     const RewindViews &rewound, const TeleportMarks &teleported, size_t a_idx,
+                     size_t b_idx)
+{
+  Sweep aSweep = sweep_of(a, previous, teleported, a_idx);
+  Sweep bSweep = sweep_of(b, previous, teleported, b_idx);
+  if (const PositionHistory::View *view = rewound[a_idx])
+    bSweep = rewound_sweep(b, bSweep, *view);
+  else if (const PositionHistory::View *view = rewound[b_idx])
+    aSweep = rewound_sweep(a, aSweep, *view);
+  if (!(aSweep.size > bSweep.size))
+    return TOI_MISS;
+  return sweep_toi(bSweep.from.x - aSweep.from.x, bSweep.from.y - aSweep.from.y,
+                   (bSweep.to.x - bSweep.from.x) - (aSweep.to.x - aSweep.from.x),
+                   (bSweep.to.y - bSweep.from.y) - (aSweep.to.y - aSweep.from.y),
+                   aSweep.size + bSweep.size);
+}
+
+void collisions_detect_serial(const std::vector<Entity> &entities, const PositionHistory::View &previous,
+                              const RewindViews &rewound, const TeleportMarks &teleported,
+                              std::vector<CollisionContact> &contacts)
+{
+  contacts.clear();
+  for (size_t i = 0; i < entities.size(); ++i)
+    for (size_t j = 0; j < entities.size(); ++j)
+    {
+      if (i == j)
+        continue;
+      const float toi = eat_toi(entities[i], entities[j], previous, rewound, teleported, i, j);
+      if (toi != TOI_MISS)
+        contacts.push_back({entities[i].eid, entities[j].eid, uint32_t(i), uint32_t(j), toi});
+    }
+  std::sort(contacts.begin(), contacts.end(), contact_less);
+}
+
+struct CellEntry
+{
+  uint64_t cell;
+  uint32_t idx;
+};
+
+struct Box
+{
+  float minX, minY, maxX, maxY;
+};
+
+// far outside the world every entity lands in the same edge cell, the exact test still decides
+static int32_t cell_coord(float v)
+{
+  const float CELL_LIMIT = float(1 << 30);
+  return int32_t(std::clamp(std::floor(v / COLLISION_CELL_SIZE), -CELL_LIMIT, CELL_LIMIT));
+}
+
+static uint64_t cell_key(int32_t cx, int32_t cy)
+{
+  return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy);
+}
+
+// scratch kept between ticks, detection runs on the main thread only
+static std::vector<Sweep> sweeps; // by slot
+static std::vector<Box> boxes;
+static std::vector<CellEntry> cellEntries;
+static std::vector<size_t> cellStarts; // into cellEntries, one past the last cell at the end
+static std::vector<uint32_t> controlledIdx;
+static std::vector<std::vector<CollisionContact>> chunkContacts;
+
+// bot pairs that share the cell; every overlapping pair shares several, it is only
+// a candidate in the one holding the min corner of the boxes' intersection
+static void gather_cell(size_t cell, SweepBatch &batch)
+{
+  const size_t from = cellStarts[cell];
+  const size_t to = cellStarts[cell + 1];
+  const uint64_t key = cellEntries[from].cell;
+  for (size_t a = from; a < to; ++a)
+  {
+    const uint32_t i = cellEntries[a].idx;
+    for (size_t b = a + 1; b < to; ++b)
+    {
+      const uint32_t j = cellEntries[b].idx;
+      const Box &bi = boxes[i];
+      const Box &bj = boxes[j];
+      if (bi.maxX < bj.minX || bj.maxX < bi.minX || bi.maxY < bj.minY || bj.maxY < bi.minY)
+        continue;
+      if (cell_key(cell_coord(std::max(bi.minX, bj.minX)), cell_coord(std::max(bi.minY, bj.minY))) != key)
+        continue;
+      const Sweep &si = sweeps[i];
+      const Sweep &sj = sweeps[j];
+      if (si.size > sj.size)
+        batch.push(si, sj, {invalid_entity, invalid_entity, i, j});
+      else if (sj.size > si.size)
+        batch.push(sj, si, {invalid_entity, invalid_entity, j, i});
+    }
+  }
+}
+
+// every entity against the controlled ones: the controlled one eating it, and a bot
+// eating the controlled one, both judged from the controlled one's rewind tick; a
+// controlled one eating another controlled one is found in the eater's own pass
+static void gather_controlled(const std::vector<Entity> &entities, const RewindViews &rewound,
+                              size_t from, size_t to, SweepBatch &batch)
+{
+  for (size_t j = from; j < to; ++j)
+  {
+    for (uint32_t i : controlledIdx)
+    {
+      if (i == j)
+        continue;
+      const Sweep &c = sweeps[i];
+      const Sweep other = rewound_sweep(entities[j], sweeps[j], *rewound[i]);
+      if (c.size > other.size)
+        batch.push(c, other, {invalid_entity, invalid_entity, i, uint32_t(j)});
+      else if (!rewound[j] && other.size > c.size)
+        batch.push(other, c, {invalid_entity, invalid_entity, uint32_t(j), i});
+    }
+  }
+}
+
+static void solve_into(const std::vector<Entity> &entities, SweepBatch &batch,
+                       std::vector<CollisionContact> &out)
+{
+  for (CollisionContact &contact : batch.contacts)
+  {
+    contact.eater = entities[contact.eaterIdx].eid;
+    contact.eaten = entities[contact.eatenIdx].eid;
+  }
+  batch.solve(out);
+}
+
+void collisions_detect(const std::vector<Entity> &entities, const PositionHistory::View &previous,
+                       const RewindViews &rewound, const TeleportMarks &teleported,
+                       std::vector<CollisionContact> &contacts)
+{
+  // broad phase: every bot into each cell its swept box touches, sorted so a cell is one run
+  sweeps.resize(entities.size());
+  boxes.resize(entities.size());
+  cellEntries.clear();
+  controlledIdx.clear();
+  for (size_t i = 0; i < entities.size(); ++i)
+  {
+    const Sweep &sweep = sweeps[i] = sweep_of(entities[i], previous, teleported, i);
+    if (rewound[i])
+    {
+      controlledIdx.push_back(uint32_t(i));
+      continue;
+    }
+    // NaN or infinite positions never touch anything, they'd only blow up the cell range
+    if (!std::isfinite(sweep.from.x) || !std::isfinite(sweep.from.y) ||
+        !std::isfinite(sweep.to.x) || !std::isfinite(sweep.to.y))
+      continue;
+    Box &box = boxes[i];
+    box = {std::min(sweep.from.x, sweep.to.x) - sweep.size, std::min(sweep.from.y, sweep.to.y) - sweep.size,
+           std::max(sweep.from.x, sweep.to.x) + sweep.size, std::max(sweep.from.y, sweep.to.y) + sweep.size};
+    for (int32_t cx = cell_coord(box.minX); cx <= cell_coord(box.maxX); ++cx)
+      for (int32_t cy = cell_coord(box.minY); cy <= cell_coord(box.maxY); ++cy)
+        cellEntries.push_back({cell_key(cx, cy), uint32_t(i)});
+  }
+  std::sort(cellEntries.begin(), cellEntries.end(), [](const CellEntry &a, const CellEntry &b)
+  {
+    return a.cell != b.cell ? a.cell < b.cell : a.idx < b.idx;
+  });
+  cellStarts.clear();
+  for (size_t i = 0; i < cellEntries.size(); ++i)
+    if (i == 0 || cellEntries[i].cell != cellEntries[i - 1].cell)
+      cellStarts.push_back(i);
+  const size_t cellCount = cellStarts.size();
+  cellStarts.push_back(cellEntries.size());
+
+  // narrow phase: cells and controlled scans are independent, each job gathers its
+  // candidates, sweeps them as a batch and writes its own list
+  const size_t cellChunks = (cellCount + CELL_GRAIN - 1) / CELL_GRAIN;
+  const size_t scanChunks = controlledIdx.empty() ? 0 : (entities.size() + SCAN_GRAIN - 1) / SCAN_GRAIN;
+  if (chunkContacts.size() < cellChunks + scanChunks)
+    chunkContacts.resize(cellChunks + scanChunks);
+  for (size_t c = 0; c < cellChunks + scanChunks; ++c)
+    chunkContacts[c].clear();
+  parallel_for(0, cellCount, CELL_GRAIN, [&entities](size_t from, size_t to)
+  {
+    thread_local SweepBatch batch;
+    batch.clear();
+    for (size_t cell = from; cell < to; ++cell)
+      gather_cell(cell, batch);
+    solve_into(entities, batch, chunkContacts[from / CELL_GRAIN]);
+  });
+  if (scanChunks)
+    parallel_for(0, entities.size(), SCAN_GRAIN, [&entities, &rewound, cellChunks](size_t from, size_t to)
+    {
+      thread_local SweepBatch batch;
+      batch.clear();
+      gather_controlled(entities, rewound, from, to, batch);
+      solve_into(entities, batch, chunkContacts[cellChunks + from / SCAN_GRAIN]);
+    });
+
+  contacts.clear();
+  for (size_t c = 0; c < cellChunks + scanChunks; ++c)
+    contacts.insert(contacts.end(), chunkContacts[c].begin(), chunkContacts[c].end());
+  std::sort(contacts.begin(), contacts.end(), contact_less);
+}
+
+void collisions_resolve(std::vector<Entity> &entities, const std::vector<CollisionContact> &contacts,
+                        std::vector<CollisionContact> &applied)
+{
+  static std::vector<uint8_t> eaten; // by slot
+  eaten.assign(entities.size(), 0);
+  applied.clear();
+  for (const CollisionContact &contact : contacts)
+  {
+    if (eaten[contact.eaterIdx] || eaten[contact.eatenIdx])
+      continue;
+    Entity &eater = entities[contact.eaterIdx];
+    Entity &food = entities[contact.eatenIdx];
+    eater.size = std::min(eater.size + food.size / 2.f, MAX_SIZE);
+    food.size = std::max(food.size / 2.f, MIN_SIZE);
+    eaten[contact.eatenIdx] = 1;
+    applied.push_back(contact);
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+#include "position_history.h"
+
+// Eating in two phases. Detection only reads the state the tick started and ended
+// with and lists every (eater, eaten) contact; resolution then applies them one at a
+// time in time of impact order, ties in (eater, eaten) eid order. Neither the order of
+// the entity vector nor how detection was split over threads can change the outcome.
+//
+// Entities are circles swept from where the previous tick left them to where they
+// are now, so a pair that passes through each other within a tick still meets; the
+// contact's toi is the fraction of the tick at which they first touched.
+//
+// A contact is judged the way its controlling player saw it: if the eater is
+// controlled, the eaten entity is taken from the eater's controller's rewind tick,
+// else if the eaten entity is controlled, the eater is taken from that one's, and
+// the rewound one stands still; bot vs bot uses the current sweeps.
+struct CollisionContact
+{
+  uint16_t eater = invalid_entity;
+  uint16_t eaten = invalid_entity;
+  uint32_t eaterIdx = 0; // slots in the entity vector
+  uint32_t eatenIdx = 0;
+  float toi = 0.f; // [0, 1], 0 - already touching when the tick started
+};
+
+// by entity slot: the history row its controller was looking at, nullptr for bots
+typedef std::vector<const PositionHistory::View*> RewindViews;
+// by entity slot, nonzero for entities put down where they are rather than moved there
+// (respawned); slots past the end aren't marked
+typedef std::vector<uint8_t> TeleportMarks;
+
+// distance per tick past which a move counts as a teleport too (a client jumping),
+// unlimited until set
+void collisions_set_max_step(float max_step);
+
+// `previous` is the row recorded at the end of the last tick, entities missing from
+// it (spawned since) don't sweep, nor do teleported ones: they only touch what is
+// around them at the end of the tick
+// reference: every ordered pair, one thread, one pair at a time
+void collisions_detect_serial(const std::vector<Entity> &entities, const PositionHistory::View &previous,
+                              const RewindViews &rewound, const TeleportMarks &teleported,
+                              std::vector<CollisionContact> &contacts);
+// the same contacts in the same order: bot pairs are found over grid cells, controlled
+// entities are checked against everyone, both spread over the job pool, and the
+// candidates' sweeps are tested four at a time
+void collisions_detect(const std::vector<Entity> &entities, const PositionHistory::View &previous,
+                       const RewindViews &rewound, const TeleportMarks &teleported,
+                       std::vector<CollisionContact> &contacts);
+
+// eater grows by half the eaten size, the eaten one halves; an entity eaten earlier in
+// the tick is gone from where it was, so later contacts involving it are skipped.
+// `applied` gets the contacts that took effect, in order; respawning the eaten is the
+// caller's
+void collisions_resolve(std::vector<Entity> &entities, const std::vector<CollisionContact> &contacts,
+                        std::vector<CollisionContact> &applied);
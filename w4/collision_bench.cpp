@@ -0,0 +1,166 @@
+// Runs the serial reference and the grid/job collision detection on the same worlds
+// tick after tick, fails on the first tick their contacts differ, and reports the time
+// each takes. Controlled entities get lag compensated against a recorded history,
+// entities move up to `speed` units a tick, fast enough to pass through each other.
+// Eaten entities respawn marked as teleported, and an eaten controlled one jumps back
+// to where it was eaten for a tick and then to its respawn point again, like a player
+// whose states predate the respawn. Before that, an entity teleporting across a row of
+// smaller ones has to eat none of them.
+// usage: w4_collision_bench [entities] [controlled] [ticks] [workers] [speed]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "collision.h"
+#include "job_system.h"
+#include "ai.h"
+
+static double us_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// a big entity moved from one end of a row of small ones to the other: it sweeps
+// through all of them unless the move is a teleport, by mark or by length
+static bool check_teleport()
+{
+  std::vector<Entity> row(11);
+  for (uint16_t i = 0; i < row.size(); ++i)
+  {
+    row[i].eid = i;
+    row[i].pos = {-500.f + 100.f * i, 0.f};
+    row[i].size = 20.f;
+  }
+  row[0].size = 40.f;
+  PositionHistory history;
+  history.record(0, row);
+  row[0].pos = {600.f, 0.f};
+  const PositionHistory::View previous = history.at(0);
+  const RewindViews rewound(row.size(), nullptr);
+  TeleportMarks marks(row.size(), 0);
+  std::vector<CollisionContact> serial, parallel;
+  collisions_detect_serial(row, previous, rewound, marks, serial);
+  const size_t swept = serial.size();
+  marks[0] = 1;
+  collisions_detect_serial(row, previous, rewound, marks, serial);
+  collisions_detect(row, previous, rewound, marks, parallel);
+  const size_t marked = serial.size() + parallel.size();
+  marks[0] = 0;
+  collisions_set_max_step(100.f);
+  collisions_detect_serial(row, previous, rewound, marks, serial);
+  collisions_detect(row, previous, rewound, marks, parallel);
+  const size_t tooFar = serial.size() + parallel.size();
+  printf("teleport across a row: %zu eaten swept, %zu marked, %zu past the max step\n", swept, marked,
+         tooFar);
+  return swept > 0 && marked == 0 && tooFar == 0;
+}
+
+int main(int argc, const char **argv)
+{
+  const uint16_t entityCount = argc > 1 ? atoi(argv[1]) : 2000;
+  const uint16_t controlledCount = argc > 2 ? atoi(argv[2]) : 32;
+  const int ticks = argc > 3 ? atoi(argv[3]) : 100;
+  const size_t workers = argc > 4 ? atoi(argv[4]) : 0;
+  const float speed = argc > 5 ? float(atof(argv[5])) : 5.f;
+  jobs_init(workers);
+  if (!check_teleport())
+  {
+    printf("teleported entity still sweeps\n");
+    jobs_shutdown();
+    return 1;
+  }
+  // a random step is at most speed * sqrt(2)
+  collisions_set_max_step(speed * 1.5f);
+
+  Xoshiro128 rng;
+  rng.seed(42);
+  std::vector<Entity> entities(entityCount);
+  for (uint16_t i = 0; i < entityCount; ++i)
+  {
+    entities[i].eid = i;
+    entities[i].pos = {rng.uniform(-600.f, 600.f), rng.uniform(-600.f, 600.f)};
+    entities[i].size = rng.uniform(20.f, 50.f);
+  }
+
+  PositionHistory history;
+  std::vector<PositionHistory::View> views(controlledCount);
+  RewindViews rewound;
+  TeleportMarks teleported;
+  std::vector<CollisionContact> serial, parallel, applied;
+  // eaten controlled ones, slot with where it was eaten and where it respawned
+  struct Jump
+  {
+    uint32_t idx;
+    Vector2 eatenAt;
+    Vector2 respawnAt;
+  };
+  std::vector<Jump> staleJumps, backJumps;
+  size_t respawnCount = 0;
+  double serialUs = 0.0;
+  double parallelUs = 0.0;
+  size_t contactCount = 0;
+  for (int tick = 0; tick < ticks; ++tick)
+  {
+    for (Entity &e : entities)
+    {
+      e.pos.x += rng.uniform(-speed, speed);
+      e.pos.y += rng.uniform(-speed, speed);
+    }
+    // the stale state puts it back where it was eaten, the next one where it respawned
+    for (const Jump &jump : backJumps)
+      entities[jump.idx].pos = jump.respawnAt;
+    for (const Jump &jump : staleJumps)
+      entities[jump.idx].pos = jump.eatenAt;
+    backJumps.swap(staleJumps);
+    staleJumps.clear();
+    // recorded at the end of the last tick, like the server does
+    const PositionHistory::View previous = history.at(uint32_t(tick - 1));
+    // the first ones are players, each a few ticks behind
+    rewound.assign(entities.size(), nullptr);
+    for (uint16_t c = 0; c < controlledCount && c < entityCount; ++c)
+    {
+      views[c] = history.at(uint32_t(tick) - 1 - c % 8);
+      rewound[c] = &views[c];
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    collisions_detect_serial(entities, previous, rewound, teleported, serial);
+    serialUs += us_since(start);
+    start = std::chrono::steady_clock::now();
+    collisions_detect(entities, previous, rewound, teleported, parallel);
+    parallelUs += us_since(start);
+
+    bool same = serial.size() == parallel.size();
+    for (size_t i = 0; same && i < serial.size(); ++i)
+      same = serial[i].eater == parallel[i].eater && serial[i].eaten == parallel[i].eaten &&
+             serial[i].eaterIdx == parallel[i].eaterIdx && serial[i].eatenIdx == parallel[i].eatenIdx &&
+             serial[i].toi == parallel[i].toi;
+    if (!same)
+    {
+      printf("tick %d: serial found %zu contacts, grid %zu, they differ\n", tick, serial.size(), parallel.size());
+      jobs_shutdown();
+      return 1;
+    }
+    contactCount += serial.size();
+
+    collisions_resolve(entities, parallel, applied);
+    teleported.assign(entities.size(), 0);
+    for (const CollisionContact &contact : applied)
+    {
+      Entity &eaten = entities[contact.eatenIdx];
+      const Vector2 eatenAt = eaten.pos;
+      eaten.pos = {rng.uniform(-600.f, 600.f), rng.uniform(-600.f, 600.f)};
+      teleported[contact.eatenIdx] = 1;
+      if (contact.eatenIdx < controlledCount)
+        staleJumps.push_back({contact.eatenIdx, eatenAt, eaten.pos});
+    }
+    respawnCount += applied.size();
+    history.record(uint32_t(tick), entities);
+  }
+  printf("%u entities, %u controlled, %d ticks, %zu contacts, %zu respawns, all identical\n",
+         entityCount, controlledCount, ticks, contactCount, respawnCount);
+  printf("serial %.1f us/tick, grid on %zu workers %.1f us/tick\n",
+         serialUs / ticks, jobs_worker_count(), parallelUs / ticks);
+  jobs_shutdown();
+  return 0;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Open addressing hash map for uint16_t eids: linear probing over one flat array,
+// power of two capacity kept at most half full, 0xffff (invalid_entity) marks an
+// empty slot. Meant for the per-tick lookups that used to go through std::map.
+template<typename T>
+class EidMap
+{
+public:
+  static constexpr uint16_t EMPTY = 0xffff;
+
+  EidMap() { rehash(16); }
+
+  bool contains(uint16_t eid) const { return find_slot(eid) != npos; }
+
+  T *find(uint16_t eid)
+  {
+    size_t slot = find_slot(eid);
+    return slot == npos ? nullptr : &values[slot];
+  }
+
+  const T *find(uint16_t eid) const
+  {
+    size_t slot = find_slot(eid);
+    return slot == npos ? nullptr : &values[slot];
+  }
+
+  T &operator[](uint16_t eid)
+  {
+    size_t slot = find_slot(eid);
+    if (slot != npos)
+      return values[slot];
+    if ((count + 1) * 2 > keys.size())
+      rehash(keys.size() * 2);
+    slot = home(eid);
+    while (keys[slot] != EMPTY)
+      slot = (slot + 1) & mask;
+    keys[slot] = eid;
+    values[slot] = T();
+    ++count;
+    return values[slot];
+  }
+
+  bool erase(uint16_t eid)
+  {
+    size_t slot = find_slot(eid);
+    if (slot == npos)
+      return false;
+    // backward shift: pull later members of the probe run into the hole, no tombstones
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; keys[next] != EMPTY; next = (next + 1) & mask)
+    {
+      size_t want = home(keys[next]);
+      if (((next - want) & mask) >= ((next - hole) & mask))
+      {
+        keys[hole] = keys[next];
+        values[hole] = values[next];
+        hole = next;
+      }
+    }
+    keys[hole] = EMPTY;
+    values[hole] = T();
+    --count;
+    return true;
+  }
+
+  void clear()
+  {
+    std::fill(keys.begin(), keys.end(), EMPTY);
+    std::fill(values.begin(), values.end(), T());
+    count = 0;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  template<typename Fn>
+  void for_each(Fn fn)
+  {
+    for (size_t i = 0; i < keys.size(); ++i)
+      if (keys[i] != EMPTY)
+        fn(keys[i], values[i]);
+  }
+
+private:
+  static constexpr size_t npos = size_t(-1);
+
+  // fibonacci hashing, spreads both sequential eids and ones differing in high bits
+  size_t home(uint16_t eid) const { return (uint32_t(eid) * 2654435769u) >> (32 - shift); }
+
+  size_t find_slot(uint16_t eid) const
+  {
+    if (eid == EMPTY)
+      return npos;
+    for (size_t slot = home(eid); keys[slot] != EMPTY; slot = (slot + 1) & mask)
+      if (keys[slot] == eid)
+        return slot;
+    return npos;
+  }
+
+  void rehash(size_t new_capacity)
+  {
+    std::vector<uint16_t> oldKeys(new_capacity, EMPTY);
+    std::vector<T> oldValues(new_capacity);
+    oldKeys.swap(keys);
+    oldValues.swap(values);
+    mask = new_capacity - 1;
+    shift = 0;
+    while ((size_t(1) << shift) < new_capacity)
+      ++shift;
+    count = 0;
+    for (size_t i = 0; i < oldKeys.size(); ++i)
+      if (oldKeys[i] != EMPTY)
+        (*this)[oldKeys[i]] = oldValues[i];
+  }
+
+  std::vector<uint16_t> keys;
+  std::vector<T> values;
+  size_t mask = 0;
+  unsigned shift = 0;
+  size_t count = 0;
+};
@@ -0,0 +1,112 @@
+// Replays the lookups w4_server does per tick against std::map and EidMap:
+// controller lookup per (entity, peer), target lookups per AI entity and
+// controller lookups per collision pair.
+// usage: w4_eid_map_bench [entities] [bots] [peers] [ticks]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include "eid_map.h"
+
+struct Vec2
+{
+  float x = 0.f;
+  float y = 0.f;
+};
+
+static uintptr_t sink = 0;
+
+template<typename Fn>
+static double ns_per_tick(int ticks, Fn tick)
+{
+  tick(); // warm up
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < ticks; ++t)
+    tick();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / ticks;
+}
+
+int main(int argc, const char **argv)
+{
+  const uint16_t entityCount = argc > 1 ? atoi(argv[1]) : 1000;
+  const uint16_t botCount = argc > 2 ? atoi(argv[2]) : 900;
+  const size_t peerCount = argc > 3 ? atoi(argv[3]) : 32;
+  const int ticks = argc > 4 ? atoi(argv[4]) : 200;
+
+  std::vector<uint16_t> eids(entityCount);
+  for (uint16_t i = 0; i < entityCount; ++i)
+    eids[i] = i;
+  std::vector<int> peers(peerCount);
+
+  std::map<uint16_t, int*> treeControlled;
+  std::map<uint16_t, Vec2> treeTargets;
+  EidMap<int*> flatControlled;
+  EidMap<Vec2> flatTargets;
+  for (uint16_t i = 0; i < botCount; ++i)
+  {
+    treeTargets[i] = {float(i), 0.f};
+    flatTargets[i] = {float(i), 0.f};
+  }
+  for (uint16_t i = botCount, p = 0; i < entityCount && p < peerCount; ++i, ++p)
+  {
+    treeControlled[i] = &peers[p];
+    flatControlled[i] = &peers[p];
+  }
+
+  double tree = ns_per_tick(ticks, [&]()
+  {
+    for (uint16_t a : eids)
+    {
+      for (uint16_t b : eids)
+        if (a != b)
+        {
+          if (treeControlled.contains(a))
+            sink += uintptr_t(treeControlled[a]);
+          else if (treeControlled.contains(b))
+            sink += uintptr_t(treeControlled[b]);
+        }
+      if (treeTargets.contains(a))
+      {
+        if (treeTargets[a].x < 0.f)
+          treeTargets[a].y += 1.f;
+        sink += uintptr_t(treeTargets[a].x);
+      }
+      for (int &peer : peers)
+        if (!treeControlled.contains(a) || treeControlled[a] != &peer)
+          ++sink;
+    }
+  });
+
+  double flat = ns_per_tick(ticks, [&]()
+  {
+    for (uint16_t a : eids)
+    {
+      for (uint16_t b : eids)
+        if (a != b)
+        {
+          if (int **peer = flatControlled.find(a))
+            sink += uintptr_t(*peer);
+          else if (int **peer = flatControlled.find(b))
+            sink += uintptr_t(*peer);
+        }
+      if (Vec2 *target = flatTargets.find(a))
+      {
+        if (target->x < 0.f)
+          target->y += 1.f;
+        sink += uintptr_t(target->x);
+      }
+      int **controller = flatControlled.find(a);
+      for (int &peer : peers)
+        if (!controller || *controller != &peer)
+          ++sink;
+    }
+  });
+
+  printf("%u entities, %u bots, %zu peers, %d ticks\n", entityCount, botCount, peerCount, ticks);
+  printf("std::map  %12.0f ns/tick\n", tree);
+  printf("EidMap    %12.0f ns/tick\n", flat);
+  printf("saving    %12.0f ns/tick (x%.1f)\n", tree - flat, tree / flat);
+  return sink == 42 ? 1 : 0;
+}
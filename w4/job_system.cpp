@@ -0,0 +1,163 @@
+#include "job_system.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job
+{
+  const range_job_t *fn = nullptr;
+  size_t begin = 0;
+  size_t end = 0;
+  std::atomic<size_t> *pending = nullptr;
+};
+
+struct WorkerQueue
+{
+  std::mutex mutex;
+  std::deque<Job> jobs;
+};
+
+// queue 0 belongs to whichever non-worker thread calls parallel_for (the server main loop)
+static std::unique_ptr<WorkerQueue[]> queues;
+static size_t queueCount = 1;
+static std::vector<std::thread> workers;
+static std::atomic<bool> running{false};
+static std::atomic<size_t> queuedJobs{0};
+static std::mutex sleepMutex;
+static std::condition_variable wakeCv;
+
+static thread_local size_t queueIdx = 0;
+
+static void push_job(const Job &job)
+{
+  WorkerQueue &q = queues[queueIdx];
+  std::lock_guard<std::mutex> lock(q.mutex);
+  q.jobs.push_back(job);
+  queuedJobs.fetch_add(1, std::memory_order_release);
+}
+
+static bool pop_job(Job &job)
+{
+  // own work first, newest chunk is the one most likely still in cache
+  {
+    WorkerQueue &q = queues[queueIdx];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (!q.jobs.empty())
+    {
+      job = q.jobs.back();
+      q.jobs.pop_back();
+      queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  // steal the oldest (biggest remaining) chunks from the others
+  for (size_t i = 1; i < queueCount; ++i)
+  {
+    WorkerQueue &q = queues[(queueIdx + i) % queueCount];
+    std::unique_lock<std::mutex> lock(q.mutex, std::try_to_lock);
+    if (!lock.owns_lock() || q.jobs.empty())
+      continue;
+    job = q.jobs.front();
+    q.jobs.pop_front();
+    queuedJobs.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+static void run_job(const Job &job)
+{
+  (*job.fn)(job.begin, job.end);
+  job.pending->fetch_sub(1, std::memory_order_acq_rel);
+}
+
+static void worker_loop(size_t idx)
+{
+  queueIdx = idx;
+  while (running.load(std::memory_order_acquire))
+  {
+    Job job;
+    if (pop_job(job))
+    {
+      run_job(job);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    wakeCv.wait(lock, []()
+    {
+      return !running.load(std::memory_order_acquire) ||
+             queuedJobs.load(std::memory_order_acquire) > 0;
+    });
+  }
+}
+
+void jobs_init(size_t num_workers)
+{
+  if (running)
+    return;
+  if (num_workers == 0)
+  {
+    unsigned hw = std::thread::hardware_concurrency();
+    num_workers = hw > 1 ? hw - 1 : 0;
+  }
+  queueCount = num_workers + 1;
+  queues.reset(new WorkerQueue[queueCount]);
+  running = true;
+  for (size_t i = 1; i < queueCount; ++i)
+    workers.emplace_back(worker_loop, i);
+}
+
+void jobs_shutdown()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    running = false;
+  }
+  wakeCv.notify_all();
+  for (std::thread &w : workers)
+    w.join();
+  workers.clear();
+  queues.reset();
+  queueCount = 1;
+}
+
+size_t jobs_worker_count()
+{
+  return workers.size();
+}
+
+void parallel_for(size_t begin, size_t end, size_t grain, const range_job_t &job)
+{
+  if (begin >= end)
+    return;
+  grain = grain ? grain : 1;
+  // no pool or nothing to split - don't pay for the queues
+  if (!running || end - begin <= grain)
+  {
+    job(begin, end);
+    return;
+  }
+
+  std::atomic<size_t> pending{(end - begin + grain - 1) / grain};
+  for (size_t from = begin; from < end; from += grain)
+    push_job({&job, from, std::min(from + grain, end), &pending});
+  {
+    // a worker may be between its predicate check and the wait, don't lose the wakeup
+    std::lock_guard<std::mutex> lock(sleepMutex);
+  }
+  wakeCv.notify_all();
+
+  while (pending.load(std::memory_order_acquire) > 0)
+  {
+    Job other;
+    if (pop_job(other))
+      run_job(other);
+    else
+      std::this_thread::yield();
+  }
+}
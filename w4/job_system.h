@@ -0,0 +1,16 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+// Work-stealing job pool. Every thread (workers and the one calling parallel_for)
+// owns a deque: the owner pushes/pops at the back, idle threads steal from the front.
+void jobs_init(size_t num_workers = 0); // 0 - one worker per spare hardware thread
+void jobs_shutdown();
+size_t jobs_worker_count();
+
+typedef std::function<void(size_t, size_t)> range_job_t;
+
+// Splits [begin, end) into chunks of at most `grain` items, runs them on the pool
+// and returns when every chunk is done, so two calls in a row act as a barrier.
+// The calling thread works on its own chunks while it waits.
+void parallel_for(size_t begin, size_t end, size_t grain, const range_job_t &job);
@@ -0,0 +1,141 @@
+#include "lobby_link.h"
+#include <enet/enet.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// has to match w2/protocol.h
+enum ControlMessageType : uint8_t
+{
+  E_SERVER_TO_LOBBY_REGISTER = 0,
+  E_SERVER_TO_LOBBY_LOAD
+};
+const uint32_t LOAD_REPORT_INTERVAL = 2000; // ms
+const uint32_t LOBBY_RECONNECT_INTERVAL = 5000; // ms
+
+static ENetHost *controlHost = nullptr;
+static ENetPeer *lobby = nullptr;
+static ENetAddress lobbyAddress;
+static bool connected = false;
+static LobbyGame lobbyGame = E_LOBBY_GAME_W10;
+static uint16_t gamePort = 0;
+static uint16_t maxPeers = 0;
+static uint32_t lastReport = 0;
+static uint32_t lastConnect = 0;
+static std::vector<uint32_t> tickTimes; // us, since the last report
+
+static void send_control(const uint8_t *data, size_t size)
+{
+  enet_peer_send(lobby, 0, enet_packet_create(data, size, ENET_PACKET_FLAG_RELIABLE));
+}
+
+static void send_register()
+{
+  uint8_t data[2 + sizeof(uint16_t) * 2];
+  uint8_t *ptr = data;
+  *ptr = E_SERVER_TO_LOBBY_REGISTER; ptr += sizeof(uint8_t);
+  *ptr = lobbyGame; ptr += sizeof(uint8_t);
+  memcpy(ptr, &gamePort, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  memcpy(ptr, &maxPeers, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  send_control(data, sizeof(data));
+}
+
+static void send_load(uint16_t peers, uint32_t entities, uint32_t tick_p99)
+{
+  uint8_t data[1 + sizeof(uint16_t) + sizeof(uint32_t) * 2];
+  uint8_t *ptr = data;
+  *ptr = E_SERVER_TO_LOBBY_LOAD; ptr += sizeof(uint8_t);
+  memcpy(ptr, &peers, sizeof(uint16_t)); ptr += sizeof(uint16_t);
+  memcpy(ptr, &entities, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &tick_p99, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  send_control(data, sizeof(data));
+}
+
+static void connect_lobby()
+{
+  lastConnect = enet_time_get();
+  lobby = enet_host_connect(controlHost, &lobbyAddress, 1, 0);
+}
+
+bool lobby_link_start(const char *lobby_host_port, LobbyGame game, uint16_t game_port, uint16_t max_peers)
+{
+  if (controlHost)
+    return false;
+  const char *colon = strrchr(lobby_host_port, ':');
+  if (!colon || enet_address_set_host(&lobbyAddress, std::string(lobby_host_port, colon).c_str()) != 0)
+    return false;
+  lobbyAddress.port = uint16_t(atoi(colon + 1));
+  controlHost = enet_host_create(nullptr, 1, 1, 0, 0);
+  if (!controlHost)
+    return false;
+  lobbyGame = game;
+  gamePort = game_port;
+  maxPeers = max_peers;
+  connect_lobby();
+  return true;
+}
+
+void lobby_link_stop()
+{
+  if (!controlHost)
+    return;
+  if (lobby && connected)
+    enet_peer_disconnect_now(lobby, 0);
+  enet_host_destroy(controlHost);
+  controlHost = nullptr;
+  lobby = nullptr;
+  connected = false;
+}
+
+void lobby_link_update(uint16_t peers, uint32_t entities, uint32_t tick_us)
+{
+  if (!controlHost)
+    return;
+  tickTimes.push_back(tick_us);
+  ENetEvent event;
+  while (enet_host_service(controlHost, &event, 0) > 0)
+  {
+    switch (event.type)
+    {
+    case ENET_EVENT_TYPE_CONNECT:
+      printf("Registered with the lobby\n");
+      connected = true;
+      send_register();
+      break;
+    case ENET_EVENT_TYPE_DISCONNECT:
+      if (connected)
+        printf("Lost the lobby\n");
+      connected = false;
+      lobby = nullptr;
+      break;
+    case ENET_EVENT_TYPE_RECEIVE:
+      enet_packet_destroy(event.packet);
+      break;
+    default:
+      break;
+    };
+  }
+
+  const uint32_t now = enet_time_get();
+  if (!lobby && now - lastConnect >= LOBBY_RECONNECT_INTERVAL)
+    connect_lobby();
+  if (now - lastReport < LOAD_REPORT_INTERVAL)
+    return;
+  lastReport = now;
+  uint32_t tickP99 = 0;
+  if (!tickTimes.empty())
+  {
+    auto p99 = tickTimes.begin() + (tickTimes.size() - 1) * 99 / 100;
+    std::nth_element(tickTimes.begin(), p99, tickTimes.end());
+    tickP99 = *p99;
+    tickTimes.clear();
+  }
+  if (connected)
+  {
+    send_load(peers, entities, tickP99);
+    enet_host_flush(controlHost);
+  }
+}
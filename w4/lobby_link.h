@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+
+// Registration with the w2 lobby. The server keeps an ENet connection to the lobby's
+// control port, tells it the port players connect to and how many it takes, then
+// reports its load every couple of seconds; the lobby spreads matches over every
+// server registered this way and stops sending players to overloaded ones. A lost
+// lobby is reconnected to, the game keeps running meanwhile.
+// has to match GameId in w2/protocol.h, the lobby only sends a server players of its game
+enum LobbyGame : uint8_t
+{
+  E_LOBBY_GAME_W4 = 0,
+  E_LOBBY_GAME_W10
+};
+
+bool lobby_link_start(const char *lobby_host_port, LobbyGame game, uint16_t game_port, uint16_t max_peers);
+void lobby_link_stop();
+
+// once per tick from the server loop, never blocks: services the control connection
+// and sends a report when one is due; tick_us goes into the next report's p99
+void lobby_link_update(uint16_t peers, uint32_t entities, uint32_t tick_us);
@@ -3,47 +3,91 @@
 #include "raylib.h"
 #include <enet/enet.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 
 #include <vector>
 #include "entity.h"
 #include "protocol.h"
+#include "eid_allocator.h"
 #include "bitstream.h"
+#include "client_net.h"
 
 static std::vector<Entity> entities;
 static uint16_t my_entity = invalid_entity;
 
-void on_new_entity_packet(ENetPacket *packet)
+void on_new_entity(const Entity &newEntity)
 {
-  Entity newEntity;
-  deserialize_new_entity(packet, newEntity);
   // TODO: Direct adressing, of course!
-  for (const Entity &e : entities)
+  for (Entity &e : entities)
+  {
     if (e.eid == newEntity.eid)
       return; // don't need to do anything, we already have entity
+    // index recycled by the server, what we hold is a leftover of its previous owner
+    if (eid_index(e.eid) == eid_index(newEntity.eid))
+    {
+      e = newEntity;
+      return;
+    }
+  }
   entities.push_back(newEntity);
-  printf("new entity\n");
 }
 
-void on_set_controlled_entity(ENetPacket *packet)
+void on_snapshot(const Entity &snapshot)
 {
-  deserialize_set_controlled_entity(packet, my_entity);
+  // TODO: Direct adressing, of course!
+  for (Entity &e : entities)
+    if (e.eid == snapshot.eid)
+    {
+      e.pos = snapshot.pos;
+      e.size = snapshot.size;
+    }
 }
 
-void on_snapshot(ENetPacket *packet)
+void on_despawn(uint16_t eid)
 {
-  uint16_t eid = invalid_entity;
-  Vector2 pos;
-  float size;
-  deserialize_snapshot(packet, eid, pos, size);
-  // TODO: Direct adressing, of course!
-  for (Entity &e : entities)
-    if (e.eid == eid)
+  if (eid == my_entity)
+    my_entity = invalid_entity;
+  for (size_t i = 0; i < entities.size(); ++i)
+    if (entities[i].eid == eid)
     {
-      e.pos = pos;
-      e.size = size;
+      entities[i] = entities.back();
+      entities.pop_back();
+      break;
     }
 }
 
+// one white circle, entities are drawn as tinted quads of it: raylib batches those into
+// a handful of draw calls, DrawCircle builds a 36 segment fan with trig per entity
+const int CIRCLE_TEXTURE_SIZE = 64;
+
+static Texture2D make_circle_texture()
+{
+  Image image = GenImageColor(CIRCLE_TEXTURE_SIZE, CIRCLE_TEXTURE_SIZE, BLANK);
+  ImageDrawCircle(&image, CIRCLE_TEXTURE_SIZE / 2, CIRCLE_TEXTURE_SIZE / 2, CIRCLE_TEXTURE_SIZE / 2 - 1, WHITE);
+  Texture2D texture = LoadTextureFromImage(image);
+  UnloadImage(image);
+  GenTextureMipmaps(&texture);
+  SetTextureFilter(texture, TEXTURE_FILTER_TRILINEAR);
+  return texture;
+}
+
+static void draw_entities(const Camera2D &camera, Texture2D circle)
+{
+  const Vector2 viewMin = GetScreenToWorld2D(Vector2{0.f, 0.f}, camera);
+  const Vector2 viewMax = GetScreenToWorld2D(Vector2{float(GetScreenWidth()), float(GetScreenHeight())}, camera);
+  const Rectangle source = {0.f, 0.f, float(circle.width), float(circle.height)};
+  for (const Entity &e : entities)
+  {
+    if (e.pos.x + e.size < viewMin.x || e.pos.x - e.size > viewMax.x ||
+        e.pos.y + e.size < viewMin.y || e.pos.y - e.size > viewMax.y)
+      continue;
+    const Rectangle dest = {e.pos.x - e.size, e.pos.y - e.size, 2.f * e.size, 2.f * e.size};
+    DrawTexturePro(circle, source, dest, Vector2{0.f, 0.f}, 0.f, e.color);
+  }
+}
+
 int main(int argc, const char **argv)
 {
   if (enet_initialize() != 0)
@@ -52,23 +96,21 @@ int main(int argc, const char **argv)
     return 1;
   }
 
-  ENetHost *client = enet_host_create(nullptr, 1, 2, 0, 0);
-  if (!client)
+  // w4 [--server host:port], e.g. a link_conditioner in front of the server
+  std::string serverHost = "127.0.0.1";
+  uint16_t serverPort = 10131;
+  for (int i = 1; i + 1 < argc; ++i)
   {
-    printf("Cannot create ENet client\n");
-    return 1;
+    if (strcmp(argv[i], "--server") != 0)
+      continue;
+    const char *server = argv[++i];
+    const char *colon = strrchr(server, ':');
+    serverHost.assign(server, colon ? colon : server + strlen(server));
+    if (colon)
+      serverPort = uint16_t(atoi(colon + 1));
   }
-
-  ENetAddress address;
-  enet_address_set_host(&address, "127.0.0.1");
-  address.port = 10131;
-
-  ENetPeer *serverPeer = enet_host_connect(client, &address, 2, 0);
-  if (!serverPeer)
-  {
-    printf("Cannot connect to server");
+  if (!client_net_start(serverHost.c_str(), serverPort))
     return 1;
-  }
 
   int width = 1920;
   int height = 1080;
@@ -89,38 +131,29 @@ int main(int argc, const char **argv)
   camera.rotation = 0.f;
   camera.zoom = 1.f;
 
+  const Texture2D circle = make_circle_texture();
+
   SetTargetFPS(60);               // Set our game to run at 60 frames-per-second
 
-  bool connected = false;
   while (!WindowShouldClose())
   {
     float dt = GetFrameTime();
-    ENetEvent event;
-    while (enet_host_service(client, &event, 0) > 0)
+    ClientEvent event;
+    while (client_net_poll(event))
     {
       switch (event.type)
       {
-      case ENET_EVENT_TYPE_CONNECT:
-        printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
-        send_join(serverPeer);
-        connected = true;
+      case E_CLIENT_EVENT_NEW_ENTITY:
+        on_new_entity(event.entity);
         break;
-      case ENET_EVENT_TYPE_RECEIVE:
-        switch (get_packet_type(event.packet))
-        {
-        case E_SERVER_TO_CLIENT_NEW_ENTITY:
-          on_new_entity_packet(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY:
-          on_set_controlled_entity(event.packet);
-          break;
-        case E_SERVER_TO_CLIENT_SNAPSHOT:
-          on_snapshot(event.packet);
-          break;
-        };
-        enet_packet_destroy(event.packet);
+      case E_CLIENT_EVENT_CONTROLLED_ENTITY:
+        my_entity = event.entity.eid;
+        break;
+      case E_CLIENT_EVENT_SNAPSHOT:
+        on_snapshot(event.entity);
         break;
-      default:
+      case E_CLIENT_EVENT_DESPAWN:
+        on_despawn(event.entity.eid);
         break;
       };
     }
@@ -138,8 +171,8 @@ int main(int argc, const char **argv)
           e.pos.x += ((left ? -dt : 0.f) + (right ? +dt : 0.f)) * 100.f;
           e.pos.y += ((up ? -dt : 0.f) + (down ? +dt : 0.f)) * 100.f;
 
-          // Send
-          send_entity_state(serverPeer, my_entity, e.pos);
+          // sent by the network thread at its own rate
+          client_net_set_state(e.pos);
         }
     }
 
@@ -147,15 +180,14 @@ int main(int argc, const char **argv)
     BeginDrawing();
       ClearBackground(GRAY);
       BeginMode2D(camera);
-        for (const Entity &e : entities)
-        {
-          DrawCircle(e.pos.x, e.pos.y, e.size, e.color);
-        }
+        draw_entities(camera, circle);
 
       EndMode2D();
     EndDrawing();
   }
 
+  client_net_stop();
+  UnloadTexture(circle);
   CloseWindow();
 
   return 0;
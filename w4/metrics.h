@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Server metrics. Counters, gauges and histograms are plain objects owned by the code
+// that updates them; an update is a single relaxed atomic op, so job threads and the
+// hot path can touch them freely. metrics_register lists them for the Prometheus text
+// dump, which a background thread serves on a local TCP port and/or writes to a file.
+struct MetricCounter
+{
+  std::atomic<uint64_t> value{0};
+
+  void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+};
+
+struct MetricGauge
+{
+  std::atomic<int64_t> value{0};
+
+  void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+};
+
+// HDR style log-linear buckets: values below 2^SUB_BITS get a bucket each, every power
+// of two above is split into 2^SUB_BITS buckets, so any value up to 2^64 is kept within
+// 1/2^SUB_BITS of itself. Count, sum and quantiles are worked out from the buckets when
+// dumped, recording is one increment.
+const int METRIC_HISTOGRAM_SUB_BITS = 3;
+const size_t METRIC_HISTOGRAM_BUCKETS = size_t(65 - METRIC_HISTOGRAM_SUB_BITS) << METRIC_HISTOGRAM_SUB_BITS;
+
+inline size_t metric_bucket(uint64_t v)
+{
+  if (v < (1u << METRIC_HISTOGRAM_SUB_BITS))
+    return size_t(v);
+  int msb = 63;
+  while (!(v >> msb))
+    --msb;
+  const int shift = msb - METRIC_HISTOGRAM_SUB_BITS;
+  return (size_t(shift) << METRIC_HISTOGRAM_SUB_BITS) + size_t(v >> shift);
+}
+
+struct MetricHistogram
+{
+  std::atomic<uint64_t> buckets[METRIC_HISTOGRAM_BUCKETS] = {};
+
+  void record(uint64_t v) { buckets[metric_bucket(v)].fetch_add(1, std::memory_order_relaxed); }
+};
+
+// Metrics must outlive the dump thread. `labels` is the inside of the braces, e.g.
+// `type="snapshot",direction="out"`; metrics sharing a name have to differ in labels.
+// Values are multiplied by `scale` when dumped, so hot paths can count integer units
+// (us, ENet's packet loss scale) and the dump still reads in seconds or ratios.
+void metrics_register(MetricCounter &metric, const std::string &name, const char *help,
+                      const std::string &labels = std::string());
+void metrics_register(MetricGauge &metric, const std::string &name, const char *help,
+                      const std::string &labels = std::string(), double scale = 1.0);
+void metrics_register(MetricHistogram &metric, const std::string &name, const char *help,
+                      const std::string &labels = std::string(), double scale = 1.0);
+
+// Prometheus text exposition format 0.0.4, histograms as summaries
+std::string metrics_text();
+
+// `port` - serve the dump over HTTP on 127.0.0.1, 0 for none; `path` - rewrite the file
+// every `file_interval_ms`, nullptr for none
+bool metrics_start(uint16_t port, const char *path, uint32_t file_interval_ms = 1000);
+void metrics_stop();
@@ -0,0 +1,83 @@
+#include "position_history.h"
+#include <algorithm>
+
+void PositionHistory::grow(size_t new_capacity)
+{
+  std::vector<uint16_t> newEids(new_capacity * HISTORY_TICKS, invalid_entity);
+  std::vector<float> newXs(new_capacity * HISTORY_TICKS, 0.f);
+  std::vector<float> newYs(new_capacity * HISTORY_TICKS, 0.f);
+  std::vector<float> newSizes(new_capacity * HISTORY_TICKS, 0.f);
+  for (size_t row = 0; row < HISTORY_TICKS && capacity > 0; ++row)
+  {
+    std::copy_n(eids.begin() + row * capacity, capacity, newEids.begin() + row * new_capacity);
+    std::copy_n(xs.begin() + row * capacity, capacity, newXs.begin() + row * new_capacity);
+    std::copy_n(ys.begin() + row * capacity, capacity, newYs.begin() + row * new_capacity);
+    std::copy_n(sizes.begin() + row * capacity, capacity, newSizes.begin() + row * new_capacity);
+  }
+  eids.swap(newEids);
+  xs.swap(newXs);
+  ys.swap(newYs);
+  sizes.swap(newSizes);
+  capacity = new_capacity;
+}
+
+void PositionHistory::record(uint32_t tick, const std::vector<Entity> &entities)
+{
+  size_t needed = capacity;
+  for (const Entity &e : entities)
+    if (e.eid != invalid_entity)
+      needed = std::max(needed, size_t(eid_index(e.eid)) + 1);
+  if (needed > capacity)
+    grow(std::max(needed, capacity * 2));
+
+  const size_t base = (tick % HISTORY_TICKS) * capacity;
+  uint16_t *eid = eids.data() + base;
+  float *x = xs.data() + base;
+  float *y = ys.data() + base;
+  float *size = sizes.data() + base;
+  std::fill_n(eid, capacity, invalid_entity);
+  for (const Entity &e : entities)
+  {
+    if (e.eid == invalid_entity)
+      continue;
+    uint16_t idx = eid_index(e.eid);
+    eid[idx] = e.eid;
+    x[idx] = e.pos.x;
+    y[idx] = e.pos.y;
+    size[idx] = e.size;
+  }
+  newestTick = tick;
+  recordedTicks = std::min(recordedTicks + 1, HISTORY_TICKS);
+}
+
+uint32_t PositionHistory::oldest_tick() const
+{
+  return recordedTicks == 0 ? newestTick : newestTick - (recordedTicks - 1);
+}
+
+PositionHistory::View PositionHistory::at(uint32_t tick) const
+{
+  View view;
+  if (recordedTicks == 0)
+    return view;
+  // ticks wrap, compare distances from the newest one instead of raw values
+  uint32_t back = std::min(newestTick - tick, recordedTicks - 1);
+  if (newestTick - tick > (1u << 31))
+    back = 0; // asked for the future
+  view.tick = newestTick - back;
+  const size_t base = (view.tick % HISTORY_TICKS) * capacity;
+  view.eid = eids.data() + base;
+  view.x = xs.data() + base;
+  view.y = ys.data() + base;
+  view.size = sizes.data() + base;
+  view.count = capacity;
+  return view;
+}
+
+uint32_t rewind_tick(uint32_t server_tick, uint32_t rtt_ms, uint32_t interp_delay_ms,
+                     uint32_t tickrate)
+{
+  uint32_t lagMs = rtt_ms + interp_delay_ms;
+  uint32_t lagTicks = (lagMs * tickrate + 500) / 1000;
+  return server_tick - lagTicks;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "entity.h"
+#include "eid_allocator.h"
+
+// Last HISTORY_TICKS world states for lag compensation. Rows are tick-major and SoA:
+// every recorded tick owns one contiguous run of eid, x and size indexed by
+// eid_index, so looking at the world as it was at tick T is pointer arithmetic, not a copy.
+class PositionHistory
+{
+public:
+  static constexpr uint32_t HISTORY_TICKS = 64;
+
+  struct View
+  {
+    const uint16_t *eid = nullptr; // who held the index at that tick, invalid_entity - nobody
+    const float *x = nullptr;
+    const float *y = nullptr;
+    const float *size = nullptr;
+    size_t count = 0;
+    uint32_t tick = 0;
+
+    bool get(uint16_t id, Vector2 &pos, float &sz) const
+    {
+      uint16_t idx = eid_index(id);
+      if (idx >= count || eid[idx] != id)
+        return false;
+      pos = {x[idx], y[idx]};
+      sz = size[idx];
+      return true;
+    }
+  };
+
+  void record(uint32_t tick, const std::vector<Entity> &entities);
+  // closest recorded tick not newer than `tick`, clamped to the oldest row kept
+  View at(uint32_t tick) const;
+
+  uint32_t newest_tick() const { return newestTick; }
+  uint32_t oldest_tick() const;
+
+private:
+  void grow(size_t new_capacity);
+
+  size_t capacity = 0; // eid indices per row
+  std::vector<uint16_t> eids;
+  std::vector<float> xs;
+  std::vector<float> ys;
+  std::vector<float> sizes;
+  uint32_t recordedTicks = 0;
+  uint32_t newestTick = 0;
+};
+
+// tick the client was looking at when its state left it: the snapshot it rendered
+// travelled one way, sat in the interpolation buffer, and the reply travelled back
+uint32_t rewind_tick(uint32_t server_tick, uint32_t rtt_ms, uint32_t interp_delay_ms,
+                     uint32_t tickrate);
@@ -1,23 +1,97 @@
 #include "protocol.h"
+#include "capture.h"
+#include "metrics.h"
 #include "bitstream.h"
+#include <algorithm>
+
+static const char *MESSAGE_TYPE_NAMES[] = {
+  "join", "new_entity", "set_controlled_entity", "state", "snapshot", "despawn", "snapshot_batch",
+  "unknown"
+};
+static_assert(sizeof(MESSAGE_TYPE_NAMES) / sizeof(MESSAGE_TYPE_NAMES[0]) == E_MESSAGE_TYPE_COUNT + 1,
+              "every message type needs a metrics name");
+// by message type, the last slot takes whatever a peer sent that isn't one
+static uint8_t reliableChannel = 0;
+static uint8_t unreliableChannel = 1;
+static MetricCounter packetsOut[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter bytesOut[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter packetsIn[E_MESSAGE_TYPE_COUNT + 1];
+static MetricCounter bytesIn[E_MESSAGE_TYPE_COUNT + 1];
+
+static size_t metric_type(const ENetPacket *packet)
+{
+  return packet->dataLength && *packet->data < E_MESSAGE_TYPE_COUNT ? size_t(*packet->data) : size_t(E_MESSAGE_TYPE_COUNT);
+}
+
+void register_protocol_metrics()
+{
+  for (size_t type = 0; type <= E_MESSAGE_TYPE_COUNT; ++type)
+  {
+    const std::string out = std::string("type=\"") + MESSAGE_TYPE_NAMES[type] + "\",direction=\"out\"";
+    const std::string in = std::string("type=\"") + MESSAGE_TYPE_NAMES[type] + "\",direction=\"in\"";
+    metrics_register(packetsOut[type], "server_packets_total", "Packets by message type.", out);
+    metrics_register(packetsIn[type], "server_packets_total", "Packets by message type.", in);
+    metrics_register(bytesOut[type], "server_bytes_total", "Payload bytes by message type.", out);
+    metrics_register(bytesIn[type], "server_bytes_total", "Payload bytes by message type.", in);
+  }
+}
+
+void count_received(const ENetPacket *packet)
+{
+  const size_t type = metric_type(packet);
+  packetsIn[type].add();
+  bytesIn[type].add(packet->dataLength);
+}
+
+void set_channel_layout(uint8_t reliable, uint8_t unreliable)
+{
+  reliableChannel = reliable;
+  unreliableChannel = unreliable;
+}
+
+uint8_t reliable_channel()
+{
+  return reliableChannel;
+}
+
+uint8_t unreliable_channel()
+{
+  return unreliableChannel;
+}
+
+void peer_send(ENetPeer *peer, uint8_t channel, ENetPacket *packet)
+{
+  const size_t type = metric_type(packet);
+  const size_t size = packet->dataLength;
+  // the packet is ENet's after a successful send, but its data lives until it goes out
+  if (enet_peer_send(peer, channel, packet) != 0)
+    return;
+  packetsOut[type].add();
+  bytesOut[type].add(size);
+  capture_record(E_CAPTURE_OUT, peer->incomingPeerID, channel, packet->data, size);
+}
 
 void send_join(ENetPeer *peer)
 {
   ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t), ENET_PACKET_FLAG_RELIABLE);
   *packet->data = E_CLIENT_TO_SERVER_JOIN;
 
-  enet_peer_send(peer, 0, packet);
+  peer_send(peer, reliableChannel, packet);
 }
 
 void send_new_entity(ENetPeer *peer, const Entity &ent)
+{
+  peer_send(peer, reliableChannel, create_new_entity_packet(ent));
+}
+
+ENetPacket *create_new_entity_packet(const Entity &ent)
 {
   ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(Entity),
                                                    ENET_PACKET_FLAG_RELIABLE);
   Bitstream bs{packet->data};
   bs.write(E_SERVER_TO_CLIENT_NEW_ENTITY);
   bs.write(ent);
-
-  enet_peer_send(peer, 0, packet);
+  return packet;
 }
 
 void send_set_controlled_entity(ENetPeer *peer, uint16_t eid)
@@ -28,7 +102,7 @@ void send_set_controlled_entity(ENetPeer *peer, uint16_t eid)
   bs.write(E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY);
   bs.write(eid);
 
-  enet_peer_send(peer, 0, packet);
+  peer_send(peer, reliableChannel, packet);
 }
 
 void send_entity_state(ENetPeer *peer, uint16_t eid, Vector2 pos)
@@ -41,7 +115,7 @@ void send_entity_state(ENetPeer *peer, uint16_t eid, Vector2 pos)
   bs.write(eid);
   bs.write(pos);
 
-  enet_peer_send(peer, 1, packet);
+  peer_send(peer, unreliableChannel, packet);
 }
 
 void send_snapshot(ENetPeer *peer, uint16_t eid, Vector2 pos, float size)
@@ -55,7 +129,48 @@ void send_snapshot(ENetPeer *peer, uint16_t eid, Vector2 pos, float size)
   bs.write(pos);
   bs.write(size);
 
-  enet_peer_send(peer, 1, packet);
+  peer_send(peer, unreliableChannel, packet);
+}
+
+void send_despawn(ENetPeer *peer, const std::vector<uint16_t> &eids)
+{
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
+                                                   sizeof(uint16_t) * eids.size(),
+                                                   ENET_PACKET_FLAG_RELIABLE);
+  Bitstream bs{packet->data};
+  bs.write(E_SERVER_TO_CLIENT_DESPAWN);
+  bs.write(uint16_t(eids.size()));
+  for (uint16_t eid : eids)
+    bs.write(eid);
+
+  peer_send(peer, reliableChannel, packet);
+}
+
+void send_shared(ENetPeer *const *peers, size_t count, uint8_t channel, ENetPacket *packet)
+{
+  for (size_t i = 0; i < count; ++i)
+    peer_send(peers[i], channel, packet);
+  if (packet->referenceCount == 0)
+    enet_packet_destroy(packet);
+}
+
+const size_t SNAPSHOT_BATCH_ENTRY_SIZE = sizeof(uint16_t) + sizeof(Vector2) + sizeof(float);
+
+ENetPacket *create_snapshot_batch_packet(const Entity *entities, size_t count)
+{
+  ENetPacket *packet = enet_packet_create(nullptr, sizeof(uint8_t) + sizeof(uint16_t) +
+                                                   SNAPSHOT_BATCH_ENTRY_SIZE * count,
+                                                   ENET_PACKET_FLAG_UNSEQUENCED);
+  Bitstream bs{packet->data};
+  bs.write(E_SERVER_TO_CLIENT_SNAPSHOT_BATCH);
+  bs.write(uint16_t(count));
+  for (size_t i = 0; i < count; ++i)
+  {
+    bs.write(entities[i].eid);
+    bs.write(entities[i].pos);
+    bs.write(entities[i].size);
+  }
+  return packet;
 }
 
 MessageType get_packet_type(ENetPacket *packet)
@@ -98,3 +213,43 @@ void deserialize_snapshot(ENetPacket *packet, uint16_t &eid, Vector2& pos, float
   bs.read(size);
 }
 
+
+void deserialize_despawn(ENetPacket *packet, std::vector<uint16_t> &eids)
+{
+  MessageType type{};
+  uint16_t count = 0;
+  const size_t header = sizeof(uint8_t) + sizeof(uint16_t);
+  if (packet->dataLength < header)
+  {
+    eids.clear();
+    return;
+  }
+  Bitstream bs{packet->data};
+  bs.read(type);
+  bs.read(count);
+  eids.resize(std::min<size_t>(count, (packet->dataLength - header) / sizeof(uint16_t)));
+  for (uint16_t &eid : eids)
+    bs.read(eid);
+}
+
+void deserialize_snapshot_batch(ENetPacket *packet, std::vector<Entity> &entities)
+{
+  MessageType type{};
+  uint16_t count = 0;
+  const size_t header = sizeof(uint8_t) + sizeof(uint16_t);
+  if (packet->dataLength < header)
+  {
+    entities.clear();
+    return;
+  }
+  Bitstream bs{packet->data};
+  bs.read(type);
+  bs.read(count);
+  entities.resize(std::min<size_t>(count, (packet->dataLength - header) / SNAPSHOT_BATCH_ENTRY_SIZE));
+  for (Entity &e : entities)
+  {
+    bs.read(e.eid);
+    bs.read(e.pos);
+    bs.read(e.size);
+  }
+}
@@ -2,6 +2,11 @@
 #include <cstdint>
 #include <enet/enet.h>
 #include "entity.h"
+#include <vector>
+
+// entries per snapshot batch, 3 + 64 * 14 bytes stays inside one datagram; a bigger
+// unsequenced packet would go out as reliable fragments
+const size_t SNAPSHOT_BATCH_MAX_ENTRIES = 64;
 
 enum MessageType : uint8_t
 {
@@ -9,14 +14,36 @@ enum MessageType : uint8_t
   E_SERVER_TO_CLIENT_NEW_ENTITY,
   E_SERVER_TO_CLIENT_SET_CONTROLLED_ENTITY,
   E_CLIENT_TO_SERVER_STATE,
-  E_SERVER_TO_CLIENT_SNAPSHOT
+  E_SERVER_TO_CLIENT_SNAPSHOT,
+  E_SERVER_TO_CLIENT_DESPAWN,
+  E_SERVER_TO_CLIENT_SNAPSHOT_BATCH,
+  E_MESSAGE_TYPE_COUNT
 };
 
+// enet_peer_send that also records the payload when a capture is running
+void peer_send(ENetPeer *peer, uint8_t channel, ENetPacket *packet);
+// channels the send_* helpers use, 0 and 1 unless the server's config moves them;
+// clients keep the defaults, a server always has at least those two channels open
+void set_channel_layout(uint8_t reliable, uint8_t unreliable);
+uint8_t reliable_channel();
+uint8_t unreliable_channel();
+// packets and bytes per message type both ways: peer_send counts what goes out,
+// received packets have to be passed to count_received
+void register_protocol_metrics();
+void count_received(const ENetPacket *packet);
 void send_join(ENetPeer *peer);
 void send_new_entity(ENetPeer *peer, const Entity &ent);
 void send_set_controlled_entity(ENetPeer *peer, uint16_t eid);
 void send_entity_state(ENetPeer *peer, uint16_t eid, Vector2 pos);
 void send_snapshot(ENetPeer *peer, uint16_t eid, Vector2 pos, float size);
+void send_despawn(ENetPeer *peer, const std::vector<uint16_t> &eids);
+// the same packet to every peer: ENet only takes a reference per send, so the bytes are
+// built once however many peers get them; destroyed here if none of the sends took it
+void send_shared(ENetPeer *const *peers, size_t count, uint8_t channel, ENetPacket *packet);
+ENetPacket *create_new_entity_packet(const Entity &ent);
+// up to SNAPSHOT_BATCH_MAX_ENTRIES entities' eid, pos and size, the same for every peer;
+// clients skip the entity they control, the server tells them about it directly
+ENetPacket *create_snapshot_batch_packet(const Entity *entities, size_t count);
 
 MessageType get_packet_type(ENetPacket *packet);
 
@@ -24,4 +51,7 @@ void deserialize_new_entity(ENetPacket *packet, Entity &ent);
 void deserialize_set_controlled_entity(ENetPacket *packet, uint16_t &eid);
 void deserialize_entity_state(ENetPacket *packet, uint16_t &eid, Vector2 &pos);
 void deserialize_snapshot(ENetPacket *packet, uint16_t &eid, Vector2 &pos, float &size);
+void deserialize_despawn(ENetPacket *packet, std::vector<uint16_t> &eids);
+// entries past the end of a short packet are dropped; only eid, pos and size are set
+void deserialize_snapshot_batch(ENetPacket *packet, std::vector<Entity> &entities);
 
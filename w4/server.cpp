@@ -2,24 +2,103 @@
 #include <iostream>
 #include "entity.h"
 #include "protocol.h"
+#include "position_history.h"
+#include "eid_map.h"
+#include "ai.h"
+#include "eid_allocator.h"
+#include "capture.h"
+#include "metrics.h"
+#include "lobby_link.h"
+#include "server_config.h"
+#include "collision.h"
+#include "job_system.h"
 #include <stdlib.h>
+#include <csignal>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
 #include <vector>
-#include <map>
 #include "raymath.h"
 #include <random>
 
 static std::vector<Entity> entities;
-static std::map<uint16_t, ENetPeer*> controlledMap;
-static std::map<uint16_t, Vector2> aiTargets;
+static EidAllocator eidAllocator;
+// eid_index -> position in entities, keeps lookups O(1) while removals swap-and-pop
+static std::vector<uint32_t> entitySlot(EID_INDEX_MASK, UINT32_MAX);
+static std::vector<uint16_t> pendingDespawns;
+static EidMap<ENetPeer*> controlledMap;
+static BotSwarm bots;
+static PositionHistory history;
+static uint32_t serverTick = 0;
+static std::vector<ENetPeer*> connectedPeers;
 
 std::random_device rd{};
 std::default_random_engine gen{rd()};
-std::uniform_real_distribution<float> posDistr{-600.f, 600.f};
+// world bounds from the config
+std::uniform_real_distribution<float> posXDistr;
+std::uniform_real_distribution<float> posYDistr;
 std::uniform_real_distribution<float> playerPosDistr{-100.f, 100.f};
 std::uniform_int_distribution<uint8_t> colorDistr{0, 255};
 std::uniform_real_distribution<float> sizeDistr{20.f, 50.f};
 
-const uint16_t TICKRATE = 60;
+static uint32_t tickRate = 60;
+// w4 client draws the newest snapshot as is, nothing is buffered
+const uint32_t INTERP_DELAY_MS = 0;
+// units per second along each axis, bots and players alike
+const float ENTITY_SPEED = 100.f;
+// client states can bunch up, this much of a player's movement may land in one tick;
+// anything further is a jump and doesn't sweep
+const float MAX_STATE_GAP = 0.25f; // s
+const float MAX_STEP = ENTITY_SPEED * 1.41421356f * MAX_STATE_GAP;
+
+static MetricHistogram tickDuration; // us
+static MetricGauge entityCount;
+static MetricGauge peerCount;
+static MetricGauge peersSize;
+static MetricGauge eidsUsed;
+static MetricGauge eidsSize;
+static std::vector<MetricGauge> peerRtt; // ms, by incomingPeerID
+static std::vector<MetricGauge> peerLoss; // ENET_PEER_PACKET_LOSS_SCALE
+
+Entity *find_entity(uint16_t eid)
+{
+  uint32_t slot = entitySlot[eid_index(eid)];
+  if (slot >= entities.size() || entities[slot].eid != eid)
+    return nullptr;
+  return &entities[slot];
+}
+
+void spawn_entity(const Entity &ent)
+{
+  entitySlot[eid_index(ent.eid)] = uint32_t(entities.size());
+  entities.push_back(ent);
+}
+
+void remove_entity(uint16_t eid)
+{
+  uint32_t slot = entitySlot[eid_index(eid)];
+  if (!find_entity(eid))
+    return;
+  uint32_t last = uint32_t(entities.size() - 1);
+  if (slot != last)
+  {
+    entities[slot] = entities[last];
+    entitySlot[eid_index(entities[slot].eid)] = slot;
+    bots_on_entity_moved(bots, last, slot);
+  }
+  entities.pop_back();
+  entitySlot[eid_index(eid)] = UINT32_MAX;
+}
+
+// the host's peer table has a slot per possible peer, only connected ones get sends
+static const std::vector<ENetPeer*> &connected_peers(ENetHost *host)
+{
+  connectedPeers.clear();
+  for (size_t i = 0; i < host->peerCount; ++i)
+    if (host->peers[i].state == ENET_PEER_STATE_CONNECTED)
+      connectedPeers.push_back(&host->peers[i]);
+  return connectedPeers;
+}
 
 void on_join(ENetPacket *packet, ENetPeer *peer, ENetHost *host)
 {
@@ -27,11 +106,12 @@ void on_join(ENetPacket *packet, ENetPeer *peer, ENetHost *host)
   for (const Entity &ent : entities)
     send_new_entity(peer, ent);
 
-  // find max eid
-  uint16_t maxEid = entities.empty() ? invalid_entity : entities[0].eid;
-  for (const Entity &e : entities)
-    maxEid = std::max(maxEid, e.eid);
-  uint16_t newEid = maxEid + 1;
+  uint16_t newEid = eidAllocator.allocate();
+  if (newEid == invalid_entity)
+  {
+    printf("Out of eids, %x:%u stays a spectator\n", peer->address.host, peer->address.port);
+    return;
+  }
   Color color = {colorDistr(gen),
                  colorDistr(gen),
                  colorDistr(gen),
@@ -43,55 +123,226 @@ void on_join(ENetPacket *packet, ENetPeer *peer, ENetHost *host)
   };
   float size = sizeDistr(gen);
   Entity ent = {color, pos, size, newEid};
-  entities.push_back(ent);
+  spawn_entity(ent);
 
   controlledMap[newEid] = peer;
 
   // send info about new entity to everyone
-  for (size_t i = 0; i < host->peerCount; ++i)
-    send_new_entity(&host->peers[i], ent);
+  const std::vector<ENetPeer*> &peers = connected_peers(host);
+  send_shared(peers.data(), peers.size(), reliable_channel(), create_new_entity_packet(ent));
   // send info about controlled entity
   send_set_controlled_entity(peer, newEid);
 }
 
+// queued until the end of the event loop, so one message covers every despawn of a tick
+void despawn_entity(uint16_t eid)
+{
+  if (eidAllocator.is_alive(eid))
+    pendingDespawns.push_back(eid);
+}
+
+void flush_despawns(ENetHost *host)
+{
+  if (pendingDespawns.empty())
+    return;
+  for (uint16_t eid : pendingDespawns)
+  {
+    remove_entity(eid);
+    controlledMap.erase(eid);
+    eidAllocator.free(eid);
+  }
+  for (size_t i = 0; i < host->peerCount; ++i)
+    if (host->peers[i].state == ENET_PEER_STATE_CONNECTED)
+      send_despawn(&host->peers[i], pendingDespawns);
+  pendingDespawns.clear();
+}
+
+void on_disconnect(ENetPeer *peer)
+{
+  uint16_t eid = invalid_entity;
+  controlledMap.for_each([&](uint16_t controlled, ENetPeer *owner)
+  {
+    if (owner == peer)
+      eid = controlled;
+  });
+  if (eid != invalid_entity)
+    despawn_entity(eid);
+}
+
+// a controlled entity the server respawned: its player keeps sending where it was
+// until the snapshot about it arrives, those states are dropped
+struct PendingRespawn
+{
+  uint16_t eid;
+  Vector2 pos;
+  uint32_t tick;
+};
+static std::vector<PendingRespawn> pendingRespawns;
+
 void on_state(ENetPacket *packet)
 {
   uint16_t eid = invalid_entity;
   Vector2 pos;
   deserialize_entity_state(packet, eid, pos);
-  for (Entity &e : entities)
-    if (e.eid == eid)
+  Entity *e = find_entity(eid);
+  if (!e)
+    return;
+  for (size_t i = 0; i < pendingRespawns.size(); ++i)
+  {
+    if (pendingRespawns[i].eid != eid)
+      continue;
+    // the first state from around the respawn point, given how far it could have moved
+    // since, is from after the player heard of it
+    const float since = float(serverTick - pendingRespawns[i].tick) / float(tickRate);
+    if (Vector2Distance(pos, pendingRespawns[i].pos) > ENTITY_SPEED * 1.41421356f * since + MAX_STEP)
+      return;
+    pendingRespawns[i] = pendingRespawns.back();
+    pendingRespawns.pop_back();
+    break;
+  }
+  e->pos = pos;
+}
+
+// collision scratch, reused every tick
+static std::vector<PositionHistory::View> rewindViews;
+static RewindViews rewound;
+static std::vector<CollisionContact> contacts;
+static std::vector<CollisionContact> appliedContacts;
+static std::vector<uint32_t> notifiedSlots;
+static std::vector<uint16_t> respawnedEids; // last tick's, put down rather than moved
+static TeleportMarks teleportMarks;
+
+// each controlled entity is judged from the history row its player was looking at
+void update_rewind_views()
+{
+  rewound.assign(entities.size(), nullptr);
+  rewindViews.resize(controlledMap.size());
+  size_t count = 0;
+  controlledMap.for_each([&](uint16_t eid, ENetPeer *peer)
+  {
+    if (!find_entity(eid))
+      return;
+    uint32_t tick = rewind_tick(serverTick, peer->roundTripTime, INTERP_DELAY_MS, tickRate);
+    rewindViews[count] = history.at(tick);
+    rewound[entitySlot[eid_index(eid)]] = &rewindViews[count++];
+  });
+}
+
+void resolve_collisions()
+{
+  update_rewind_views();
+  teleportMarks.assign(entities.size(), 0);
+  for (uint16_t eid : respawnedEids)
+    if (find_entity(eid))
+      teleportMarks[entitySlot[eid_index(eid)]] = 1;
+  // the last row recorded is where the previous tick left everyone, sweeps start there
+  collisions_detect(entities, history.at(serverTick - 1), rewound, teleportMarks, contacts);
+  collisions_resolve(entities, contacts, appliedContacts);
+  respawnedEids.clear();
+  for (const CollisionContact &contact : appliedContacts)
+  {
+    Entity &eaten = entities[contact.eatenIdx];
+    eaten.pos =
+    {
+      .x = posXDistr(gen),
+      .y = posYDistr(gen)
+    };
+    respawnedEids.push_back(eaten.eid);
+    if (!controlledMap.find(eaten.eid))
+      continue;
+    auto pending = std::find_if(pendingRespawns.begin(), pendingRespawns.end(),
+                                [&eaten](const PendingRespawn &p) { return p.eid == eaten.eid; });
+    if (pending != pendingRespawns.end())
+      *pending = {eaten.eid, eaten.pos, serverTick};
+    else
+      pendingRespawns.push_back({eaten.eid, eaten.pos, serverTick});
+  }
+  // controlled entities don't get batch snapshots of themselves, tell their players,
+  // once each however many contacts they were in; the snapshot may be lost, so it goes
+  // again every tick until the player is seen at its respawn point
+  notifiedSlots.clear();
+  for (const CollisionContact &contact : appliedContacts)
+    for (uint32_t idx : {contact.eaterIdx, contact.eatenIdx})
+      if (controlledMap.find(entities[idx].eid))
+        notifiedSlots.push_back(idx);
+  for (size_t i = 0; i < pendingRespawns.size();)
+  {
+    if (find_entity(pendingRespawns[i].eid) && controlledMap.find(pendingRespawns[i].eid))
     {
-      e.pos = pos;
+      notifiedSlots.push_back(entitySlot[eid_index(pendingRespawns[i].eid)]);
+      ++i;
+      continue;
     }
+    pendingRespawns[i] = pendingRespawns.back();
+    pendingRespawns.pop_back();
+  }
+  std::sort(notifiedSlots.begin(), notifiedSlots.end());
+  notifiedSlots.erase(std::unique(notifiedSlots.begin(), notifiedSlots.end()), notifiedSlots.end());
+  for (uint32_t idx : notifiedSlots)
+  {
+    const Entity &e = entities[idx];
+    send_snapshot(*controlledMap.find(e.eid), e.eid, e.pos, e.size);
+  }
 }
 
-void generate_ai_entities()
+void register_server_metrics(size_t max_peers)
 {
-  for (uint16_t i = 0; i < 10; ++i)
+  register_protocol_metrics();
+  metrics_register(tickDuration, "server_tick_duration_seconds", "Time spent on a tick, sleep excluded.",
+                   "", 1e-6);
+  metrics_register(entityCount, "server_entities", "Simulated entities.");
+  metrics_register(peerCount, "server_peers", "Connected peers.");
+  peersSize.set(int64_t(max_peers));
+  eidsSize.set(EID_INDEX_MASK);
+  metrics_register(peerCount, "server_pool_used", "Pool slots in use.", "pool=\"peers\"");
+  metrics_register(eidsUsed, "server_pool_used", "Pool slots in use.", "pool=\"eids\"");
+  metrics_register(peersSize, "server_pool_size", "Pool capacity.", "pool=\"peers\"");
+  metrics_register(eidsSize, "server_pool_size", "Pool capacity.", "pool=\"eids\"");
+  peerRtt = std::vector<MetricGauge>(max_peers);
+  peerLoss = std::vector<MetricGauge>(max_peers);
+  for (size_t i = 0; i < max_peers; ++i)
   {
+    const std::string peer = "peer=\"" + std::to_string(i) + "\"";
+    metrics_register(peerRtt[i], "server_peer_rtt_seconds", "Round trip time ENet measures.", peer, 1e-3);
+    metrics_register(peerLoss[i], "server_peer_packet_loss_ratio", "Packet loss ENet measures.", peer,
+                     1.0 / ENET_PEER_PACKET_LOSS_SCALE);
+  }
+}
+
+void generate_ai_entities(uint16_t count)
+{
+  for (uint16_t i = 0; i < count; ++i)
+  {
+    uint16_t eid = eidAllocator.allocate();
+    if (eid == invalid_entity)
+    {
+      printf("Out of eids, spawned %u bots\n", i);
+      break;
+    }
     Color color = {colorDistr(gen),
                   colorDistr(gen),
                   colorDistr(gen),
                   255};
     Vector2 pos
     {
-      .x = posDistr(gen),
-      .y = posDistr(gen)
+      .x = posXDistr(gen),
+      .y = posYDistr(gen)
     };
     float size = sizeDistr(gen);
     
-    Entity ent = {color, pos, size, i};
-    entities.push_back(ent);
-
-    Vector2 target {
-      .x = posDistr(gen),
-      .y = posDistr(gen)
-    };
-    aiTargets[i] = target;
+    Entity ent = {color, pos, size, eid};
+    spawn_entity(ent);
+    bots_add(bots, entities.size() - 1);
   }
 }
 
+static volatile std::sig_atomic_t running = 1;
+
+static void on_stop_signal(int)
+{
+  running = 0;
+}
+
 int main(int argc, const char **argv)
 {
   if (enet_initialize() != 0)
@@ -99,12 +350,57 @@ int main(int argc, const char **argv)
     printf("Cannot init ENet");
     return 1;
   }
+  // w4_server [bot count] [--config file] [--key value ...] [--capture file]
+  // every server_config.h key is a flag too, e.g. --port 10132 --max-peers 64;
+  // --lobby host:port registers with a w2 lobby's control port and reports load to it,
+  // metrics are served on 127.0.0.1:metrics-port and/or rewritten to metrics-file every second
+  ServerConfig config;
+  std::vector<const char*> args;
+  if (!server_config_parse_args(config, argc, argv, args) || !server_config_validate(config))
+    return 1;
+  uint16_t botCount = 10;
+  for (size_t i = 0; i < args.size(); ++i)
+  {
+    if (strcmp(args[i], "--capture") == 0 && i + 1 < args.size())
+    {
+      const char *path = args[++i];
+      if (!capture_open(path, "w4"))
+        printf("Cannot open capture file %s\n", path);
+    }
+    else
+    {
+      // every peer's entity has to find an eid next to the bots
+      const long maxBots = long(EID_INDEX_MASK) - long(config.maxPeers);
+      char *end = nullptr;
+      const long count = strtol(args[i], &end, 10);
+      if (end == args[i] || *end != '\0' || count < 0 || count > maxBots)
+      {
+        printf("Bad bot count '%s', has to be within 0..%ld with %zu peers\n", args[i], maxBots,
+               config.maxPeers);
+        return 1;
+      }
+      botCount = uint16_t(count);
+    }
+  }
+  server_config_print(config);
+  jobs_init();
+  printf("Running with %zu job workers\n", jobs_worker_count());
+  tickRate = config.tickRate;
+  collisions_set_max_step(MAX_STEP);
+  posXDistr = std::uniform_real_distribution<float>{config.worldMinX, config.worldMaxX};
+  posYDistr = std::uniform_real_distribution<float>{config.worldMinY, config.worldMaxY};
+  set_channel_layout(config.reliableChannel, config.unreliableChannel);
+  // whole ticks between snapshot rounds, so the rate rounds down to what the tick allows
+  const uint32_t sendRate = config.sendRate ? config.sendRate : config.tickRate;
+  const uint32_t snapshotInterval = (config.tickRate + sendRate - 1) / sendRate;
+
   ENetAddress address;
 
   address.host = ENET_HOST_ANY;
-  address.port = 10131;
+  address.port = config.port;
 
-  ENetHost *server = enet_host_create(&address, 32, 2, 0, 0);
+  ENetHost *server = enet_host_create(&address, config.maxPeers, config.channels,
+                                      config.incomingBandwidth, config.outgoingBandwidth);
 
   if (!server)
   {
@@ -112,10 +408,21 @@ int main(int argc, const char **argv)
     return 1;
   }
 
-  generate_ai_entities();
+  generate_ai_entities(botCount);
+  register_server_metrics(config.maxPeers);
+  const char *metricsFile = config.metricsFile.empty() ? nullptr : config.metricsFile.c_str();
+  if ((config.metricsPort || metricsFile) && !metrics_start(config.metricsPort, metricsFile))
+    printf("Cannot start metrics on port %u\n", config.metricsPort);
+  if (!config.lobby.empty() &&
+      !lobby_link_start(config.lobby.c_str(), E_LOBBY_GAME_W4, config.port, uint16_t(config.maxPeers)))
+    printf("Cannot reach lobby %s\n", config.lobby.c_str());
 
-  while (true)
+  // Ctrl+C or a kill ends the loop so the capture and metrics get closed properly
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+  while (running)
   {
+    auto tickStart = std::chrono::steady_clock::now();
     ENetEvent event;
     while (enet_host_service(server, &event, 0) > 0)
     {
@@ -123,8 +430,19 @@ int main(int argc, const char **argv)
       {
       case ENET_EVENT_TYPE_CONNECT:
         printf("Connection with %x:%u established\n", event.peer->address.host, event.peer->address.port);
+        capture_record(E_CAPTURE_CONNECT, event.peer->incomingPeerID, 0, nullptr, 0);
+        break;
+      case ENET_EVENT_TYPE_DISCONNECT:
+        printf("Disconnected %x:%u\n", event.peer->address.host, event.peer->address.port);
+        capture_record(E_CAPTURE_DISCONNECT, event.peer->incomingPeerID, 0, nullptr, 0);
+        peerRtt[event.peer->incomingPeerID].set(0);
+        peerLoss[event.peer->incomingPeerID].set(0);
+        on_disconnect(event.peer);
         break;
       case ENET_EVENT_TYPE_RECEIVE:
+        capture_record(E_CAPTURE_IN, event.peer->incomingPeerID, event.channelID,
+                       event.packet->data, event.packet->dataLength);
+        count_received(event.packet);
         switch (get_packet_type(event.packet))
         {
           case E_CLIENT_TO_SERVER_JOIN:
@@ -140,63 +458,45 @@ int main(int argc, const char **argv)
         break;
       };
     }
-    static int t = 0;
-    for (Entity &e : entities)
+    flush_despawns(server);
+    bots_steer(bots, entities, ENTITY_SPEED / tickRate);
+    const bool snapshotTick = serverTick % snapshotInterval == 0;
+    resolve_collisions();
+    // every peer sees the same world, so each batch is serialized once and shared
+    if (snapshotTick)
     {
-      for (Entity &e_two : entities)
-      {
-        if (e_two.eid != e.eid)
-        {
-          if (Vector2Distance(e.pos, e_two.pos) < e.size + e_two.size)
-          {
-            if (e.size > e_two.size)
-            {
-              e.size = std::min(e.size + e_two.size / 2.f, 300.f);
-              e_two.size = std::max(e_two.size / 2.f, 20.f);
-              e_two.pos =
-              {
-                .x = posDistr(gen),
-                .y = posDistr(gen)
-              };
-
-              if (controlledMap.contains(e_two.eid))
-              {
-                send_snapshot(controlledMap[e_two.eid], e_two.eid, e_two.pos, e_two.size);
-              }
-              if (controlledMap.contains(e.eid))
-              {
-                send_snapshot(controlledMap[e.eid], e.eid, e.pos, e.size);
-              }
-            }
-          }
-        }
-      }
-
-      if (aiTargets.contains(e.eid))
+      const std::vector<ENetPeer*> &peers = connected_peers(server);
+      for (size_t first = 0; !peers.empty() && first < entities.size();
+           first += SNAPSHOT_BATCH_MAX_ENTRIES)
       {
-        if (Vector2Distance(aiTargets[e.eid], e.pos) < 1.f)
-        {
-          Vector2 target {
-            .x = posDistr(gen),
-            .y = posDistr(gen)
-          };
-          aiTargets[e.eid] = target;
-        }
-        Vector2 dir = Vector2Normalize(Vector2Subtract(aiTargets[e.eid], e.pos));
-        e.pos.x += dir.x * 1 / TICKRATE * 100.f;
-        e.pos.y += dir.y * 1 / TICKRATE * 100.f;
-      }
-
-      for (size_t i = 0; i < server->peerCount; ++i)
-      {
-        ENetPeer *peer = &server->peers[i];
-        if (!controlledMap.contains(e.eid) || controlledMap[e.eid] != peer)
-          send_snapshot(peer, e.eid, e.pos, e.size);
+        const size_t count = std::min(SNAPSHOT_BATCH_MAX_ENTRIES, entities.size() - first);
+        send_shared(peers.data(), peers.size(), unreliable_channel(),
+                    create_snapshot_batch_packet(entities.data() + first, count));
       }
     }
-    usleep(static_cast<useconds_t>(1.f / TICKRATE * 1000000.f));
+    history.record(serverTick++, entities);
+    for (size_t i = 0; i < server->peerCount; ++i)
+    {
+      const ENetPeer &peer = server->peers[i];
+      if (peer.state != ENET_PEER_STATE_CONNECTED)
+        continue;
+      peerRtt[peer.incomingPeerID].set(peer.roundTripTime);
+      peerLoss[peer.incomingPeerID].set(peer.packetLoss);
+    }
+    entityCount.set(int64_t(entities.size()));
+    peerCount.set(int64_t(server->connectedPeers));
+    eidsUsed.set(int64_t(eidAllocator.alive_count()));
+    const uint64_t tickUs = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - tickStart).count());
+    tickDuration.record(tickUs);
+    lobby_link_update(uint16_t(server->connectedPeers), uint32_t(entities.size()), uint32_t(tickUs));
+    usleep(static_cast<useconds_t>(1.f / tickRate * 1000000.f));
   }
 
+  jobs_shutdown();
+  lobby_link_stop();
+  metrics_stop();
+  capture_close();
   enet_host_destroy(server);
 
   atexit(enet_deinitialize);
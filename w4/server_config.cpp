@@ -0,0 +1,200 @@
+#include "server_config.h"
+#include "capture.h"
+#include <enet/enet.h>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+struct ConfigKey
+{
+  const char *name;
+  bool (*set)(ServerConfig &config, const char *value);
+};
+
+template<typename T>
+static bool set_uint(T &field, const char *value)
+{
+  if (!isdigit((unsigned char)*value))
+    return false;
+  char *end = nullptr;
+  const unsigned long long v = strtoull(value, &end, 10);
+  if (*end != '\0' || v > std::numeric_limits<T>::max())
+    return false;
+  field = T(v);
+  return true;
+}
+
+static bool set_float(float &field, const char *value)
+{
+  char *end = nullptr;
+  const float v = strtof(value, &end);
+  if (end == value || *end != '\0' || !std::isfinite(v))
+    return false;
+  field = v;
+  return true;
+}
+
+static const ConfigKey CONFIG_KEYS[] =
+{
+  {"port", [](ServerConfig &c, const char *v) { return set_uint(c.port, v); }},
+  {"metrics_port", [](ServerConfig &c, const char *v) { return set_uint(c.metricsPort, v); }},
+  {"metrics_file", [](ServerConfig &c, const char *v) { c.metricsFile = v; return true; }},
+  {"lobby", [](ServerConfig &c, const char *v) { c.lobby = v; return true; }},
+  {"max_peers", [](ServerConfig &c, const char *v) { return set_uint(c.maxPeers, v); }},
+  {"channels", [](ServerConfig &c, const char *v) { return set_uint(c.channels, v); }},
+  {"reliable_channel", [](ServerConfig &c, const char *v) { return set_uint(c.reliableChannel, v); }},
+  {"unreliable_channel", [](ServerConfig &c, const char *v) { return set_uint(c.unreliableChannel, v); }},
+  {"bandwidth_in", [](ServerConfig &c, const char *v) { return set_uint(c.incomingBandwidth, v); }},
+  {"bandwidth_out", [](ServerConfig &c, const char *v) { return set_uint(c.outgoingBandwidth, v); }},
+  {"tick_rate", [](ServerConfig &c, const char *v) { return set_uint(c.tickRate, v); }},
+  {"send_rate", [](ServerConfig &c, const char *v) { return set_uint(c.sendRate, v); }},
+  {"world_min_x", [](ServerConfig &c, const char *v) { return set_float(c.worldMinX, v); }},
+  {"world_min_y", [](ServerConfig &c, const char *v) { return set_float(c.worldMinY, v); }},
+  {"world_max_x", [](ServerConfig &c, const char *v) { return set_float(c.worldMaxX, v); }},
+  {"world_max_y", [](ServerConfig &c, const char *v) { return set_float(c.worldMaxY, v); }},
+};
+
+static const ConfigKey *find_key(const char *name)
+{
+  for (const ConfigKey &key : CONFIG_KEYS)
+    if (strcmp(key.name, name) == 0)
+      return &key;
+  return nullptr;
+}
+
+static char *trim(char *str)
+{
+  while (isspace((unsigned char)*str))
+    ++str;
+  char *end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1]))
+    --end;
+  *end = '\0';
+  return str;
+}
+
+bool server_config_load(ServerConfig &config, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+  {
+    printf("Cannot open config %s\n", path);
+    return false;
+  }
+  bool ok = true;
+  char line[512];
+  for (size_t lineNo = 1; fgets(line, sizeof(line), file); ++lineNo)
+  {
+    if (char *comment = strchr(line, '#'))
+      *comment = '\0';
+    char *name = trim(line);
+    if (*name == '\0')
+      continue;
+    char *eq = strchr(name, '=');
+    if (!eq)
+    {
+      printf("%s:%zu: expected key = value\n", path, lineNo);
+      ok = false;
+      continue;
+    }
+    *eq = '\0';
+    name = trim(name);
+    const char *value = trim(eq + 1);
+    const ConfigKey *key = find_key(name);
+    if (!key)
+    {
+      printf("%s:%zu: unknown key %s\n", path, lineNo, name);
+      ok = false;
+    }
+    else if (!key->set(config, value))
+    {
+      printf("%s:%zu: bad value '%s' for %s\n", path, lineNo, value, name);
+      ok = false;
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+bool server_config_parse_args(ServerConfig &config, int argc, const char **argv,
+                              std::vector<const char*> &rest)
+{
+  // the file is the base whatever the order, flags always win over it
+  for (int i = 1; i + 1 < argc; ++i)
+    if (strcmp(argv[i], "--config") == 0 && !server_config_load(config, argv[i + 1]))
+      return false;
+
+  bool ok = true;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+    {
+      ++i;
+      continue;
+    }
+    const ConfigKey *key = nullptr;
+    if (strncmp(argv[i], "--", 2) == 0 && i + 1 < argc)
+    {
+      std::string name = argv[i] + 2;
+      for (char &c : name)
+        if (c == '-')
+          c = '_';
+      key = find_key(name.c_str());
+    }
+    if (!key)
+    {
+      rest.push_back(argv[i]);
+      continue;
+    }
+    if (!key->set(config, argv[i + 1]))
+    {
+      printf("Bad value '%s' for %s\n", argv[i + 1], argv[i]);
+      ok = false;
+    }
+    ++i;
+  }
+  return ok;
+}
+
+bool server_config_validate(const ServerConfig &config)
+{
+  bool ok = true;
+  auto check = [&ok](bool cond, const char *problem)
+  {
+    if (!cond)
+    {
+      printf("Config: %s\n", problem);
+      ok = false;
+    }
+  };
+  check(config.port != 0, "port can't be 0");
+  check(config.maxPeers >= 1 && config.maxPeers <= ENET_PROTOCOL_MAXIMUM_PEER_ID,
+        "max_peers has to be within 1..4095");
+  // clients send on the unreliable channel's default, 1, whatever the server uses;
+  // captures keep 6 bits of channel
+  check(config.channels >= 2 && config.channels <= CAPTURE_MAX_CHANNELS,
+        "channels has to be within 2..64");
+  check(config.reliableChannel < config.channels, "reliable_channel is past the channel count");
+  check(config.unreliableChannel < config.channels, "unreliable_channel is past the channel count");
+  check(config.tickRate >= 1 && config.tickRate <= 1000, "tick_rate has to be within 1..1000");
+  check(config.sendRate <= config.tickRate,
+        "send_rate can't be over tick_rate, snapshots go out at most once a tick");
+  check(config.worldMinX < config.worldMaxX && config.worldMinY < config.worldMaxY,
+        "world min has to be below world max");
+  check(config.lobby.empty() || config.lobby.find(':') != std::string::npos,
+        "lobby has to be host:port");
+  return ok;
+}
+
+void server_config_print(const ServerConfig &config)
+{
+  printf("Port %u, %zu peers, %zu channels (reliable %u, unreliable %u), bandwidth in %u out %u\n",
+         config.port, config.maxPeers, config.channels, config.reliableChannel,
+         config.unreliableChannel, config.incomingBandwidth, config.outgoingBandwidth);
+  printf("Tick %u Hz, send %u Hz, world (%g, %g)..(%g, %g)\n", config.tickRate,
+         config.sendRate ? config.sendRate : config.tickRate,
+         config.worldMinX, config.worldMinY, config.worldMaxX, config.worldMaxY);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+// Bounded single producer, single consumer ring. One thread pushes, one other pops,
+// neither ever takes a lock or allocates. Each side caches the other's index and only
+// reloads it when the ring looks full (or empty), so the indices' cache lines don't
+// bounce on every call.
+template<typename T, size_t Capacity>
+class SpscQueue
+{
+  static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "capacity has to be a power of two");
+public:
+  // producer only; false if the ring is full
+  bool push(const T &val)
+  {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - headCache == Capacity)
+    {
+      headCache = head.load(std::memory_order_acquire);
+      if (t - headCache == Capacity)
+        return false;
+    }
+    items[t & (Capacity - 1)] = val;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer only; false if the ring is empty
+  bool pop(T &val)
+  {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tailCache)
+    {
+      tailCache = tail.load(std::memory_order_acquire);
+      if (h == tailCache)
+        return false;
+    }
+    val = items[h & (Capacity - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  alignas(64) std::atomic<size_t> head{0};
+  size_t tailCache = 0; // consumer's
+  alignas(64) std::atomic<size_t> tail{0};
+  size_t headCache = 0; // producer's
+  alignas(64) T items[Capacity];
+};